@@ -0,0 +1,315 @@
+// abbench runs a cluster of nodes over loopback in one process, each node
+// on its own event loop thread, and drives appends through the leader.
+// It reports append throughput and append-to-commit latency percentiles,
+// once without a key and once with one.
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+#include <signal.h>
+
+#include <cpl/flags.hpp>
+
+#include "ab.h"
+
+typedef std::chrono::steady_clock Clock;
+
+const std::string NAME    = "abbench";
+const std::string VERSION = "DEV";
+
+struct Options
+{
+	int         nodes    = 3;
+	int         port     = 24000;
+	int         rate     = 0; // appends per second, 0 for as fast as possible
+	int         size     = 128;
+	int         duration = 10; // seconds
+	int         window   = 32;
+	int         batch    = 1;
+	std::string modes    = "plain,keyed";
+};
+
+void
+set_int(std::string a, std::string b, void* d) {
+	*reinterpret_cast<int*>(d) = atoi(b.c_str());
+}
+
+void
+set_string(std::string a, std::string b, void* d) {
+	*reinterpret_cast<std::string*>(d) = b;
+}
+
+void
+show_help(std::string a, std::string b, void* d) {
+	reinterpret_cast<cpl::Flags*>(d)->print_usage();
+	exit(0);
+}
+
+struct Cluster;
+
+struct Member
+{
+	Cluster*    cluster;
+	ab_node_t*  node;
+	std::thread thread;
+};
+
+struct Cluster
+{
+	std::vector<std::unique_ptr<Member>> members;
+	std::atomic<ab_node_t*>              leader{nullptr};
+};
+
+// Shared by the driver thread and the leader's event loop thread.
+struct Run
+{
+	std::vector<Clock::time_point> sent;
+	std::vector<int64_t>           latency_ns;
+	std::atomic<int>               outstanding{0};
+	std::atomic<int>               completed{0};
+	std::atomic<int>               failed{0};
+};
+
+struct AppendContext
+{
+	Run* run;
+	int  index;
+};
+
+static void
+on_append_done(int status, void* data) {
+	auto ctx = (AppendContext*)data;
+	auto run = ctx->run;
+	if (status < 0) {
+		run->failed++;
+	} else {
+		run->latency_ns[ctx->index] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			Clock::now() - run->sent[ctx->index]).count();
+		run->completed++;
+	}
+	run->outstanding--;
+}
+
+static std::unique_ptr<Cluster>
+start_cluster(const Options& opts, int port, const std::string& key) {
+	auto cluster = std::make_unique<Cluster>();
+	ab_callbacks_t callbacks = {};
+	callbacks.on_append = [](uint64_t round, const char* data, int data_len, void* cb_data) {
+		auto member = (Member*)cb_data;
+		ab_confirm_append(member->node, round);
+	};
+	callbacks.gained_leadership = [](void* cb_data) {
+		auto member = (Member*)cb_data;
+		member->cluster->leader = member->node;
+	};
+	callbacks.lost_leadership = [](void* cb_data) {
+		auto member = (Member*)cb_data;
+		ab_node_t* node = member->node;
+		member->cluster->leader.compare_exchange_strong(node, nullptr);
+	};
+
+	for (int i = 0; i < opts.nodes; i++) {
+		auto member = std::make_unique<Member>();
+		member->cluster = cluster.get();
+		member->node = ab_node_create(i+1, opts.nodes);
+		if (member->node == nullptr) {
+			return nullptr;
+		}
+		ab_set_callbacks(member->node, callbacks, member.get());
+		if (key != "" && ab_set_key(member->node, key.data(), key.size()) < 0) {
+			return nullptr;
+		}
+		ab_set_append_window(member->node, opts.window);
+		if (opts.batch > 1) {
+			ab_set_batching(member->node, opts.batch, 1 << 20, 200);
+		}
+		auto address = "127.0.0.1:" + std::to_string(port+i);
+		if (ab_listen(member->node, address.c_str()) < 0) {
+			std::cerr << "failed to listen on " << address << std::endl;
+			return nullptr;
+		}
+		cluster->members.push_back(std::move(member));
+	}
+
+	// Connect every pair once. The lower ID dials.
+	for (int i = 0; i < opts.nodes; i++) {
+		for (int j = i+1; j < opts.nodes; j++) {
+			auto address = "127.0.0.1:" + std::to_string(port+j);
+			ab_connect_to_peer(cluster->members[i]->node, address.c_str());
+		}
+	}
+
+	for (auto& member : cluster->members) {
+		auto node = member->node;
+		member->thread = std::thread([node]() {
+			ab_run(node);
+		});
+	}
+	return cluster;
+}
+
+static void
+stop_cluster(std::unique_ptr<Cluster> cluster) {
+	for (auto& member : cluster->members) {
+		// Blocks until the event loop stops.
+		ab_destroy(member->node);
+		member->thread.join();
+	}
+}
+
+static int64_t
+percentile(const std::vector<int64_t>& sorted, double p) {
+	if (sorted.empty()) {
+		return 0;
+	}
+	size_t i = (size_t)(p * (sorted.size()-1));
+	return sorted[i];
+}
+
+static int
+run_mode(const Options& opts, const std::string& mode, int port) {
+	std::string key;
+	if (mode == "keyed") {
+		key = std::string(32, 'k');
+	} else if (mode != "plain") {
+		std::cerr << "unknown mode " << mode << std::endl;
+		return 1;
+	}
+
+	auto cluster = start_cluster(opts, port, key);
+	if (cluster == nullptr) {
+		return 1;
+	}
+
+	// Wait for an election.
+	auto deadline = Clock::now() + std::chrono::seconds(30);
+	while (cluster->leader == nullptr && Clock::now() < deadline) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	ab_node_t* leader = cluster->leader;
+	if (leader == nullptr) {
+		std::cerr << mode << ": no leader elected" << std::endl;
+		stop_cluster(std::move(cluster));
+		return 1;
+	}
+
+	// Preallocate for the largest possible run so the callbacks can
+	// write without locking.
+	size_t max_appends = opts.rate > 0 ? (size_t)opts.rate * opts.duration + 1 : 1 << 21;
+	Run run;
+	run.sent.resize(max_appends);
+	run.latency_ns.resize(max_appends, -1);
+	std::vector<AppendContext> contexts(max_appends);
+	std::string payload(opts.size, 'x');
+
+	auto start = Clock::now();
+	auto end = start + std::chrono::seconds(opts.duration);
+	size_t sent = 0;
+	while (sent < max_appends) {
+		auto now = Clock::now();
+		if (now >= end) {
+			break;
+		}
+		if (opts.rate > 0) {
+			auto due = start + std::chrono::nanoseconds((int64_t)(sent * 1e9 / opts.rate));
+			if (now < due) {
+				std::this_thread::sleep_until(due);
+				continue;
+			}
+		} else if (run.outstanding >= opts.window) {
+			std::this_thread::yield();
+			continue;
+		}
+		contexts[sent] = AppendContext{&run, (int)sent};
+		run.sent[sent] = Clock::now();
+		run.outstanding++;
+		ab_append(leader, payload.data(), payload.size(), on_append_done, &contexts[sent]);
+		sent++;
+	}
+
+	// Let outstanding appends finish.
+	deadline = Clock::now() + std::chrono::seconds(5);
+	while (run.outstanding > 0 && Clock::now() < deadline) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+	int outstanding = run.outstanding;
+
+	stop_cluster(std::move(cluster));
+
+	std::vector<int64_t> latencies;
+	latencies.reserve(run.completed);
+	for (size_t i = 0; i < sent; i++) {
+		if (run.latency_ns[i] >= 0) {
+			latencies.push_back(run.latency_ns[i]);
+		}
+	}
+	std::sort(latencies.begin(), latencies.end());
+
+	std::cout << std::fixed << std::setprecision(1)
+		<< mode
+		<< "," << opts.nodes
+		<< "," << opts.size
+		<< "," << opts.rate
+		<< "," << sent
+		<< "," << latencies.size()
+		<< "," << run.failed + outstanding
+		<< "," << latencies.size() / elapsed
+		<< "," << percentile(latencies, 0.5) / 1e3
+		<< "," << percentile(latencies, 0.99) / 1e3
+		<< "," << percentile(latencies, 0.999) / 1e3
+		<< std::endl;
+	return 0;
+}
+
+int
+main(int argc, char* argv[]) {
+	signal(SIGPIPE, SIG_IGN);
+
+	Options opts;
+	cpl::Flags flags(NAME, VERSION);
+	flags.add_option("--help", "-h", "show help documentation", show_help, &flags);
+	flags.add_option("--nodes", "-n", "cluster size", set_int, &opts.nodes);
+	flags.add_option("--port", "-p", "first listen port; nodes use consecutive ports",
+		set_int, &opts.port);
+	flags.add_option("--rate", "-r", "appends per second (0 for as fast as the window allows)",
+		set_int, &opts.rate);
+	flags.add_option("--size", "-s", "append payload size in bytes", set_int, &opts.size);
+	flags.add_option("--duration", "-d", "seconds to drive appends", set_int, &opts.duration);
+	flags.add_option("--window", "-w", "append window", set_int, &opts.window);
+	flags.add_option("--batch", "-b", "maximum appends per batch", set_int, &opts.batch);
+	flags.add_option("--modes", "-m", "comma separated list of plain and keyed",
+		set_string, &opts.modes);
+	flags.parse(argc, argv);
+
+	if (opts.nodes < 1 || opts.size < 0 || opts.duration < 1 || opts.window < 1 ||
+		opts.batch < 1 || opts.rate < 0) {
+		std::cerr << "invalid options" << std::endl;
+		return 1;
+	}
+
+	std::cout << "mode,nodes,size,rate,sent,committed,failed,commits_per_sec,"
+		"p50_us,p99_us,p999_us" << std::endl;
+	int port = opts.port;
+	size_t pos = 0;
+	while (pos <= opts.modes.size()) {
+		auto comma = opts.modes.find(',', pos);
+		if (comma == std::string::npos) {
+			comma = opts.modes.size();
+		}
+		auto mode = opts.modes.substr(pos, comma-pos);
+		pos = comma+1;
+		if (run_mode(opts, mode, port) != 0) {
+			return 1;
+		}
+		// Fresh ports so the previous run's connections can't interfere.
+		port += opts.nodes;
+	}
+	return 0;
+}
@@ -0,0 +1,239 @@
+// codecbench measures the message codec: Message::pack and unpack,
+// Codec::pack_message, decode_message and decode_message_length for
+// every message type, across payload sizes, with and without a key.
+// Results are printed as CSV (default) or JSON lines.
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <functional>
+
+#include <cpl/flags.hpp>
+
+#include "message/codec.hpp"
+#include "message/message.hpp"
+
+// Count heap allocations.
+static std::atomic<size_t> allocations(0);
+
+void*
+operator new(size_t size) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	void* p = malloc(size ? size : 1);
+	if (p == nullptr) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void
+operator delete(void* p) noexcept {
+	free(p);
+}
+
+void
+operator delete(void* p, size_t) noexcept {
+	free(p);
+}
+
+typedef std::chrono::steady_clock Clock;
+
+const std::string NAME    = "codecbench";
+const std::string VERSION = "DEV";
+
+// Each benchmark runs for at least this long.
+const double MIN_SECONDS = 0.05;
+
+const size_t SIZES[] = {0, 64, 1024, 16*1024, 256*1024, 1024*1024};
+
+// Identity addresses have a 16-bit length.
+const size_t MAX_ADDRESS_SIZE = 0xffff;
+
+// Batches split the payload across this many entries.
+const int BATCH_ENTRIES = 16;
+
+struct Case
+{
+	std::string                               name;
+	std::function<std::unique_ptr<Message>()> make_empty;
+	std::unique_ptr<Message>                  msg;
+};
+
+static std::vector<Case>
+make_cases(size_t size) {
+	std::vector<Case> cases;
+	std::string payload(size, 'x');
+
+	if (size <= MAX_ADDRESS_SIZE) {
+		cases.push_back(Case{"ident_request",
+			[]() { return std::make_unique<IdentityRequest>(); },
+			std::make_unique<IdentityRequest>(1, payload)});
+		cases.push_back(Case{"ident",
+			[]() { return std::make_unique<IdentityMessage>(); },
+			std::make_unique<IdentityMessage>(1, payload)});
+	}
+	cases.push_back(Case{"leader_active",
+		[]() { return std::make_unique<LeaderActiveMessage>(); },
+		std::make_unique<LeaderActiveMessage>(1, 2, 3, 4, payload)});
+	std::vector<std::string> batch;
+	for (int i = 0; i < BATCH_ENTRIES; i++) {
+		batch.push_back(std::string(size / BATCH_ENTRIES, 'x'));
+	}
+	cases.push_back(Case{"leader_active_batch",
+		[]() { return std::make_unique<LeaderActiveMessage>(); },
+		std::make_unique<LeaderActiveMessage>(1, 2, 3, 4, batch)});
+	if (size == 0) {
+		// Fixed size.
+		cases.push_back(Case{"leader_active_ack",
+			[]() { return std::make_unique<LeaderActiveAck>(); },
+			std::make_unique<LeaderActiveAck>(1, 2, 3)});
+	}
+	return cases;
+}
+
+struct Result
+{
+	double ns_per_op;
+	double bytes_per_sec;
+	double allocs_per_op;
+};
+
+// measure runs f until MIN_SECONDS have passed. f returns a negative
+// value on failure.
+static Result
+measure(size_t bytes, const std::function<int()>& f) {
+	uint64_t ops = 0;
+	uint64_t batch = 1;
+	double elapsed = 0;
+	size_t allocs = 0;
+	while (elapsed < MIN_SECONDS) {
+		auto allocs_before = allocations.load();
+		auto start = Clock::now();
+		for (uint64_t i = 0; i < batch; i++) {
+			if (f() < 0) {
+				std::cerr << "operation failed" << std::endl;
+				exit(1);
+			}
+		}
+		elapsed += std::chrono::duration<double>(Clock::now() - start).count();
+		allocs += allocations.load() - allocs_before;
+		ops += batch;
+		batch *= 2;
+	}
+	return Result{
+		elapsed * 1e9 / ops,
+		bytes * ops / elapsed,
+		(double)allocs / ops,
+	};
+}
+
+static void
+report(const std::string& format, const std::string& mode, const std::string& type,
+	size_t size, size_t frame_size, const std::string& op, const Result& r) {
+	if (format == "json") {
+		std::cout << "{\"mode\":\"" << mode << "\""
+			<< ",\"type\":\"" << type << "\""
+			<< ",\"size\":" << size
+			<< ",\"frame_size\":" << frame_size
+			<< ",\"op\":\"" << op << "\""
+			<< ",\"ns_per_op\":" << r.ns_per_op
+			<< ",\"bytes_per_sec\":" << r.bytes_per_sec
+			<< ",\"allocs_per_op\":" << r.allocs_per_op
+			<< "}" << std::endl;
+		return;
+	}
+	std::cout << mode << "," << type << "," << size << "," << frame_size << "," << op
+		<< "," << r.ns_per_op << "," << r.bytes_per_sec << "," << r.allocs_per_op
+		<< std::endl;
+}
+
+static void
+run_mode(const std::string& format, const std::string& mode) {
+	Codec codec;
+	if (mode == "keyed") {
+		codec.set_key(std::string(KEY_SIZE, 'k'));
+	} else if (mode == "crc32c") {
+		codec.set_checksum(CHECKSUM_CRC32C);
+	}
+
+	for (auto size : SIZES) {
+		for (auto& c : make_cases(size)) {
+			const Message* msg = c.msg.get();
+			size_t frame_size = msg->packed_size();
+			std::vector<uint8_t> buf(frame_size);
+			std::vector<uint8_t> packed(frame_size);
+
+			// Message-level encoding doesn't depend on the mode.
+			if (mode == "sha512") {
+				report(format, mode, c.name, size, frame_size, "pack",
+					measure(frame_size, [&]() {
+						return msg->pack(buf.data(), buf.size());
+					}));
+				msg->pack(packed.data(), packed.size());
+				auto m = c.make_empty();
+				report(format, mode, c.name, size, frame_size, "unpack",
+					measure(frame_size, [&]() {
+						return m->unpack(packed.data(), packed.size());
+					}));
+			}
+
+			report(format, mode, c.name, size, frame_size, "pack_message",
+				measure(frame_size, [&]() {
+					return codec.pack_message(msg, buf.data(), buf.size());
+				}));
+
+			// Decoding works in place, so every iteration restores the frame
+			// first. The copy is included in the result.
+			codec.pack_message(msg, packed.data(), packed.size());
+			std::unique_ptr<Message> m;
+			report(format, mode, c.name, size, frame_size, "decode_message",
+				measure(frame_size, [&]() {
+					memcpy(buf.data(), packed.data(), packed.size());
+					m = nullptr;
+					return codec.decode_message(m, buf.data(), buf.size());
+				}));
+
+			report(format, mode, c.name, size, frame_size, "decode_message_length",
+				measure(frame_size, [&]() {
+					return codec.decode_message_length(packed.data(), packed.size());
+				}));
+		}
+	}
+}
+
+void
+set_string(std::string a, std::string b, void* d) {
+	*reinterpret_cast<std::string*>(d) = b;
+}
+
+void
+show_help(std::string a, std::string b, void* d) {
+	reinterpret_cast<cpl::Flags*>(d)->print_usage();
+	exit(0);
+}
+
+int
+main(int argc, char* argv[]) {
+	std::string format = "csv";
+	cpl::Flags flags(NAME, VERSION);
+	flags.add_option("--help", "-h", "show help documentation", show_help, &flags);
+	flags.add_option("--format", "-f", "output format (csv or json)", set_string, &format);
+	flags.parse(argc, argv);
+
+	if (format != "csv" && format != "json") {
+		std::cerr << "invalid format: " << format << std::endl;
+		return 1;
+	}
+	if (format == "csv") {
+		std::cout << "mode,type,size,frame_size,op,ns_per_op,bytes_per_sec,allocs_per_op"
+			<< std::endl;
+	}
+	for (auto mode : {"sha512", "crc32c", "keyed"}) {
+		run_mode(format, mode);
+	}
+	return 0;
+}
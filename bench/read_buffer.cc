@@ -0,0 +1,115 @@
+// readbench measures the peer read path: one 16 KB read full of
+// heartbeats is fed to the read buffer and split into frames.
+#include <chrono>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <iostream>
+
+#include "peer/peer.hpp"
+#include "message/codec.hpp"
+#include "message/message.hpp"
+
+const int ITERATIONS = 2000;
+
+// Fills a 16 KB read with as many packed heartbeats as fit.
+static std::vector<uint8_t>
+heartbeat_read(Codec& codec, int* frames) {
+	std::vector<uint8_t> read;
+	*frames = 0;
+	for (uint64_t seq = 1; ; seq++) {
+		LeaderActiveMessage msg(1, seq, 0);
+		auto frame = codec.pack_frame(&msg);
+		if (read.size() + frame->size() > READ_BUFFER_SIZE) {
+			break;
+		}
+		read.insert(read.end(), frame->begin(), frame->end());
+		(*frames)++;
+	}
+	return read;
+}
+
+// The read path before ReadBuffer: copy byte by byte and rebuild the
+// buffer after every frame.
+static int
+legacy_read(Codec& codec, std::vector<uint8_t>& read_buf, const std::vector<uint8_t>& read) {
+	int frames = 0;
+	int pending_msg_size = read_buf.size();
+	for (size_t i = 0; i < read.size(); i++) {
+		read_buf.push_back(read[i]);
+		pending_msg_size++;
+	}
+	while (true) {
+		auto msg_length = codec.decode_message_length(read_buf.data(), read_buf.size());
+		if (msg_length > 0 && pending_msg_size >= msg_length) {
+			frames++;
+			std::vector<uint8_t> replacement;
+			for (auto& i : read_buf) {
+				if (msg_length > 0) {
+					msg_length--;
+					continue;
+				}
+				replacement.push_back(i);
+			}
+			read_buf = std::move(replacement);
+			pending_msg_size = read_buf.size();
+		} else {
+			break;
+		}
+	}
+	return frames;
+}
+
+static int
+ring_read(Codec& codec, ReadBuffer& read_buf, const std::vector<uint8_t>& read) {
+	int frames = 0;
+	size_t free;
+	auto dest = read_buf.reserve(read.size(), &free);
+	memcpy(dest, read.data(), read.size()); // stands in for the socket read
+	read_buf.commit(read.size());
+	while (true) {
+		auto msg_length = codec.decode_message_length(read_buf.data(), read_buf.size());
+		if (msg_length <= 0 || read_buf.size() < (size_t)msg_length) {
+			break;
+		}
+		read_buf.consume(msg_length);
+		frames++;
+	}
+	return frames;
+}
+
+template <typename F>
+static double
+ns_per_op(F f) {
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < ITERATIONS; i++) {
+		f();
+	}
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	return std::chrono::duration<double, std::nano>(elapsed).count() / ITERATIONS;
+}
+
+int
+main(int argc, char* argv[]) {
+	Codec codec;
+	int frames;
+	auto read = heartbeat_read(codec, &frames);
+
+	int total = 0;
+	std::vector<uint8_t> legacy_buf;
+	auto legacy = ns_per_op([&]() {
+		total += legacy_read(codec, legacy_buf, read);
+	});
+
+	ReadBuffer ring_buf(READ_BUFFER_CAPACITY);
+	auto ring = ns_per_op([&]() {
+		total += ring_read(codec, ring_buf, read);
+	});
+
+	std::cout << "heartbeats per 16 KB read: " << frames << std::endl;
+	std::cout << "legacy:     " << legacy << " ns/read, "
+		<< legacy/frames << " ns/frame" << std::endl;
+	std::cout << "ReadBuffer: " << ring << " ns/read, "
+		<< ring/frames << " ns/frame" << std::endl;
+	return total == 0;
+}
@@ -0,0 +1,57 @@
+// secretboxbench compares the secretbox backend against tweetnacl.
+#include <chrono>
+#include <vector>
+#include <iostream>
+#include <tweetnacl/tweetnacl.h>
+
+#include "message/secretbox.h"
+
+typedef int (*box_fn)(uint8_t*, const uint8_t*, uint64_t, const uint8_t*, const uint8_t*);
+
+static int
+tweetnacl_box(uint8_t* c, const uint8_t* m, uint64_t len, const uint8_t* n, const uint8_t* k) {
+	return crypto_secretbox(c, m, len, n, k);
+}
+
+static int
+tweetnacl_open(uint8_t* m, const uint8_t* c, uint64_t len, const uint8_t* n, const uint8_t* k) {
+	return crypto_secretbox_open(m, c, len, n, k);
+}
+
+// Returns MB/s for the given function and message size.
+static double
+throughput(box_fn f, const std::vector<uint8_t>& in, std::vector<uint8_t>& out) {
+	uint8_t key[32] = {1};
+	uint8_t nonce[24] = {2};
+	// Run for roughly 64 MB.
+	int iterations = 64*1024*1024 / in.size() + 1;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < iterations; i++) {
+		f(out.data(), in.data(), in.size(), nonce, key);
+	}
+	auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+	return (double)in.size() * iterations / elapsed.count() / 1e6;
+}
+
+int
+main(int argc, char* argv[]) {
+	std::cout << "backend: " << secretbox_backend() << std::endl;
+	std::cout << "size,tweetnacl_seal_MBps,seal_MBps,tweetnacl_open_MBps,open_MBps" << std::endl;
+	size_t sizes[] = {64, 1024, 16*1024, 256*1024};
+	for (auto size : sizes) {
+		std::vector<uint8_t> m(32 + size, 0);
+		std::vector<uint8_t> c(m.size());
+		std::vector<uint8_t> opened(m.size());
+		uint8_t key[32] = {1};
+		uint8_t nonce[24] = {2};
+		secretbox(c.data(), m.data(), m.size(), nonce, key);
+
+		std::cout << size
+			<< "," << throughput(tweetnacl_box, m, c)
+			<< "," << throughput(secretbox, m, c)
+			<< "," << throughput(tweetnacl_open, c, opened)
+			<< "," << throughput(secretbox_open, c, opened)
+			<< std::endl;
+	}
+	return 0;
+}
@@ -45,10 +45,18 @@ typedef struct ab_node_t ab_node_t;
 // changes or broadcasts. Since these functions are called from the libab event loop, it's important
 // to avoid blocking actions.
 typedef struct {
-	// on_append is called when a new message is broadcasted from a leader.
-	// The round number should monotonically increase.
-	// The caller maintains ownership of the data pointer.
-	// ab_confirm_append should be called after the message is durably stored.
+	// on_append is called when a new message is broadcasted from a leader, on the
+	// leader itself too. The round number should monotonically increase.
+	// The caller maintains ownership of the data pointer. With a write-ahead log, data
+	// points into the log's memory-mapped segments, or a copy held for the log, and
+	// stays valid until its round is truncated (see ab_truncate_wal) or ab_destroy,
+	// so it doesn't have to be copied.
+	// ab_confirm_append should be called after the message is durably stored,
+	// unless the node has a write-ahead log (see ab_set_wal). The leader must confirm
+	// its own rounds too: its confirmation counts toward the majority that commits a
+	// round like any follower's, and without it a majority of the followers alone has
+	// to store the round. A leader of a two-node cluster that doesn't confirm never
+	// commits anything.
 	void (*on_append)(uint64_t round, const char* data, int data_len, void* cb_data);
 	// gained_leadership is called when the node gains the leadership role.
 	void (*gained_leadership)(void* cb_data);
@@ -58,13 +66,27 @@ typedef struct {
 	// leader_id is set to 0 if the the current leader is suspected to have failed
 	// (meaning there is no active leader).
 	void (*on_leader_change)(uint64_t leader_id, void* cb_data);
+	// on_commit is called when rounds are committed, meaning a majority of the cluster
+	// stored them and they will never be replaced. Every round up to round is committed
+	// and has been passed to on_append, so it can be applied. A call may cover several
+	// rounds. Followers learn the leader's commits from its next message, which is sent
+	// right away once the leader has no more appends in flight.
+	void (*on_commit)(uint64_t round, void* cb_data);
+	// on_wal_failed is called when the write-ahead log fails, for example because the
+	// disk is full. The log stays failed: the node no longer confirms entries, so it
+	// doesn't count toward the quorum, and should be restarted.
+	void (*on_wal_failed)(void* cb_data);
 } ab_callbacks_t;
 
+// Largest supported cluster.
+#define AB_MAX_CLUSTER_SIZE 64
+
 // ab_node_create returns a pointer to a new node handle.
 // Callers should verify that the pointer is not NULL.
 // Argument details:
 // - id: the ID for this node, which should be nonzero and unique among the cluster.
-// - cluster_size: the total size of the cluster including this node.
+// - cluster_size: the total size of the cluster including this node, from 1 to
+//   AB_MAX_CLUSTER_SIZE. NULL is returned for other sizes.
 // - callbacks: node event callbacks (see below)
 // - data: user-provided pointer passed as the last argument in the ab_callbacks_t callbacks.
 // The return value should eventually be passed to ab_destroy.
@@ -82,6 +104,289 @@ ab_set_callbacks(ab_node_t* node, ab_callbacks_t callbacks, void* data);
 int
 ab_set_key(ab_node_t* node, const char* key, int key_len);
 
+// ab_checksum_t selects the integrity check used when no key is set.
+typedef enum {
+	// First 24 bytes of a SHA-512 hash. This is the default.
+	AB_CHECKSUM_SHA512 = 0,
+	// Hardware accelerated CRC32C. Much cheaper, but only detects accidental
+	// corruption, so it should only be used on trusted networks.
+	AB_CHECKSUM_CRC32C = 1
+} ab_checksum_t;
+
+// ab_set_checksum sets the checksum used for messages sent by this node.
+// Received messages are verified with whichever checksum the sender used,
+// so the setting does not need to match across the cluster.
+// It has no effect when a key is set.
+int
+ab_set_checksum(ab_node_t* node, ab_checksum_t checksum);
+
+// ab_set_append_window sets the maximum number of appends a leader keeps in flight
+// while waiting for a majority to confirm them. Appends are committed in order.
+// window must be positive and at least the max_entries of ab_set_batching. The default
+// is 32.
+int
+ab_set_append_window(ab_node_t* node, int window);
+
+// ab_set_batching sets the leader's group commit policy. Appends are queued and broadcast
+// to the cluster as one message once max_entries appends or max_bytes of content are
+// queued, or linger_us microseconds have passed since the first queued append.
+// Each append still gets its own round and its own ab_append_cb call.
+// max_entries and max_bytes must be positive, max_entries at most the append window (see
+// ab_set_append_window) and max_bytes at most 16 MiB. By default every append is sent
+// on its own.
+int
+ab_set_batching(ab_node_t* node, int max_entries, int max_bytes, int linger_us);
+
+// ab_set_retention sets how many recent entries, and how many bytes of them, a node
+// keeps in memory to resend to followers that fall behind. A follower that missed
+// rounds, because it was down or disconnected, gets them streamed from the leader
+// before it sees new ones, so on_append still sees every round in order. A follower
+// further behind than the leader's retained entries skips the rounds in between.
+// Zero disables catch-up. The defaults are 65536 entries and 64 MiB.
+int
+ab_set_retention(ab_node_t* node, int max_entries, int max_bytes);
+
+// ab_snapshot_callbacks_t lets a leader bring a follower that is further behind than
+// the retained entries up to date with a snapshot of the application's state instead
+// of skipping rounds. The leader reads the snapshot in chunks and streams them to the
+// follower, then sends the rounds after the snapshot as usual. Like ab_callbacks_t,
+// these are called from the libab event loop.
+typedef struct {
+	// open_snapshot is called on the leader to start a transfer. It stores the last
+	// round the snapshot includes in *round, which must not be after the last round
+	// passed to on_append, and returns a handle for the calls below. NULL means no
+	// snapshot is available. Several snapshots may be open at once.
+	void* (*open_snapshot)(uint64_t* round, void* cb_data);
+	// read_snapshot copies up to len bytes of the snapshot, starting at offset, into buf.
+	// It returns the number of bytes copied, 0 at the end, or a negative value on error.
+	// Parts lost with a connection are read again.
+	int (*read_snapshot)(void* snapshot, uint64_t offset, char* buf, int len, void* cb_data);
+	// close_snapshot releases a handle returned by open_snapshot.
+	void (*close_snapshot)(void* snapshot, void* cb_data);
+	// on_snapshot_chunk is called on the follower with the snapshot in order. Offset 0
+	// starts a snapshot, replacing any partial one. A nonzero return abandons it.
+	int (*on_snapshot_chunk)(uint64_t round, uint64_t offset, const char* data, int data_len,
+		void* cb_data);
+	// on_snapshot is called on the follower once the whole snapshot of size bytes has
+	// arrived. Its state then includes every round up to round, and on_append continues
+	// with round+1. A nonzero return rejects the snapshot.
+	int (*on_snapshot)(uint64_t round, uint64_t size, void* cb_data);
+} ab_snapshot_callbacks_t;
+
+// ab_set_snapshot_callbacks sets the callbacks used to transfer snapshots. Leaders and
+// followers both need them. If the leader's open_snapshot fails, or the follower
+// rejects the snapshot, the follower skips the rounds it missed instead.
+// It must be called before ab_run.
+int
+ab_set_snapshot_callbacks(ab_node_t* node, ab_snapshot_callbacks_t callbacks, void* cb_data);
+
+// ab_timing_t holds a node's protocol timeouts, in milliseconds. Shorter timeouts fail
+// over faster but need a network with low and steady latency.
+typedef struct {
+	// How often an idle leader sends a heartbeat. The default is 50.
+	int heartbeat_ms;
+	// How long a leader waits for a majority to ack a heartbeat or an append before it
+	// gives up leadership. Candidates wait this long for votes. The default is 300.
+	int leadership_loss_ms;
+	// The longest a follower waits without hearing from the leader before it starts an
+	// election. The default is 1000.
+	int follower_timeout_ms;
+	// Delay between attempts to reconnect to a peer. The default is 3000.
+	int reconnect_ms;
+	// Suspicion level at which a follower considers the leader failed. Followers learn
+	// the leader's heartbeat intervals and suspect it once the chance that it is only
+	// late drops below 10^-phi_threshold. The resulting timeout adapts to the network
+	// but stays between leadership_loss_ms and follower_timeout_ms. 0 always waits
+	// follower_timeout_ms. The default is 8.
+	double phi_threshold;
+} ab_timing_t;
+
+// ab_get_timing copies the node's current timeouts into timing.
+int
+ab_get_timing(ab_node_t* node, ab_timing_t* timing);
+
+// ab_set_timing sets the node's timeouts. All values except phi_threshold must be
+// positive, phi_threshold must not be negative, and
+// heartbeat_ms < leadership_loss_ms < follower_timeout_ms, so that a leader heartbeats
+// before it gives up and gives up before its followers elect another leader.
+// Every node in a cluster should use the same values. It must be called before ab_run.
+int
+ab_set_timing(ab_node_t* node, const ab_timing_t* timing);
+
+// ab_set_wal makes the node keep its entries in a write-ahead log in the directory dir,
+// which is created if it doesn't exist. Every entry, on the leader and on followers, is
+// written to the log before on_append is called, and the node confirms it by itself once
+// the log is synced to disk. ab_confirm_append calls are then ignored and on_append
+// is optional. If the log fails, on_wal_failed is called.
+// Syncs are group committed: the entries that arrive while a sync is running, and
+// within sync_window_us after it starts, share one sync. The log is split into
+// segments preallocated to segment_bytes, or 64 MiB if segment_bytes is 0, and
+// memory-mapped. Existing segments are mapped rather than read when the node starts.
+// Segments are created by the syncing thread, never on the event loop: if the next one
+// isn't ready when a segment fills up, entries are held in memory until it is.
+// The log is trimmed with ab_truncate_wal, and up to a snapshot's round once a follower
+// installs it (see ab_set_snapshot_callbacks), so a restart only replays the entries
+// after it.
+// It must be called before ab_run.
+int
+ab_set_wal(ab_node_t* node, const char* dir, int segment_bytes, int sync_window_us);
+
+// ab_replay_cb is called by ab_replay_wal with each entry in the log.
+typedef void (*ab_replay_cb)(uint64_t round, const char* data, int data_len, void* cb_data);
+
+// ab_replay_wal calls cb with every entry synced to the node's write-ahead log, in log
+// order, and returns the number of entries. data points into the mapped segments
+// and stays valid until its round is truncated or ab_destroy. An entry that was never
+// committed may be followed by another entry with the same round. -1 is returned if
+// the node has no log.
+// It is safe to call from any thread.
+int
+ab_replay_wal(ab_node_t* node, ab_replay_cb cb, void* cb_data);
+
+// ab_truncate_wal tells the node that the application no longer needs the entries up
+// to round in its write-ahead log, for example because its own snapshot covers them.
+// The next sync deletes the segments before the one being written whose entries are
+// all truncated, so the log doesn't grow without bound and a restart replays only the
+// rest. Pointers to truncated entries become invalid. round never moves back.
+// -1 is returned if the node has no log.
+// It is safe to call from any thread.
+int
+ab_truncate_wal(ab_node_t* node, uint64_t round);
+
+// Message types, used to index the per-type counters in ab_stats_t.
+// Index 0 counts messages of an unknown type.
+enum {
+	AB_MSG_IDENT_REQUEST = 1,
+	AB_MSG_IDENT = 2,
+	AB_MSG_LEADER_ACTIVE = 3,
+	AB_MSG_LEADER_ACTIVE_ACK = 4,
+	AB_MSG_SNAPSHOT_CHUNK = 5,
+	AB_MSG_SNAPSHOT_ACK = 6,
+	AB_MSG_TYPES = 7
+};
+
+// Node states reported in ab_stats_t.
+enum {
+	AB_STATE_LEADER = 0,
+	AB_STATE_POTENTIAL_LEADER = 1,
+	AB_STATE_FOLLOWER = 2
+};
+
+// ab_stats_t is a snapshot of a node's counters. Counters start at zero
+// when the node is created and only increase, except for round, seq and state,
+// which hold current values.
+typedef struct {
+	uint64_t messages_sent[AB_MSG_TYPES];
+	uint64_t bytes_sent[AB_MSG_TYPES];
+	uint64_t messages_received[AB_MSG_TYPES];
+	uint64_t bytes_received[AB_MSG_TYPES];
+	// Messages that could not be packed or failed verification.
+	uint64_t encode_failures;
+	uint64_t decode_failures;
+	// Appends passed to ab_append on this node, and how they ended.
+	uint64_t appends_submitted;
+	uint64_t appends_committed;
+	uint64_t appends_rejected_not_leader; // status -1 when submitted
+	uint64_t appends_rejected_window;     // status -2
+	uint64_t appends_rejected_size;       // status -3
+	uint64_t appends_cancelled;           // status -1 after leadership was lost
+	// Times this node started campaigning for leadership.
+	uint64_t elections_started;
+	uint64_t leadership_gained;
+	uint64_t leadership_lost;
+	// on_leader_change events.
+	uint64_t leader_changes;
+	// Connection attempts to peers after a disconnect.
+	uint64_t reconnects;
+	// Entries written to the write-ahead log, their content bytes, the syncs that made
+	// them durable, and failed writes.
+	uint64_t wal_records;
+	uint64_t wal_bytes;
+	uint64_t wal_syncs;
+	uint64_t wal_errors;
+	// Leader: frames and entries resent to lagging followers.
+	uint64_t catch_up_frames;
+	uint64_t catch_up_entries;
+	// Follower: rounds it never received because the leader no longer had them.
+	uint64_t catch_up_skipped;
+	// Leader: snapshots sent to followers and the bytes sent for them.
+	uint64_t snapshots_sent;
+	uint64_t snapshot_bytes;
+	// Follower: snapshots installed.
+	uint64_t snapshots_installed;
+	uint64_t round;
+	uint64_t seq;
+	int      state;
+} ab_stats_t;
+
+// ab_get_stats copies a snapshot of the node's counters into stats.
+// It is safe to call from any thread and never blocks the event loop.
+int
+ab_get_stats(ab_node_t* node, ab_stats_t* stats);
+
+// ab_latency_t selects one of a node's latency histograms.
+typedef enum {
+	// Leader only: from when the event loop takes an append to when a majority commits it.
+	AB_LATENCY_COMMIT = 0,
+	// Any node: from on_append to when the event loop takes the matching
+	// ab_confirm_append. On followers this is the local storage time; the rest of
+	// the commit latency is network time.
+	AB_LATENCY_CONFIRM = 1
+} ab_latency_t;
+
+// ab_latency_summary_t summarizes a latency histogram. Values are in nanoseconds
+// and percentiles are accurate to within about 3%.
+typedef struct {
+	uint64_t count;
+	uint64_t min_ns;
+	uint64_t mean_ns;
+	uint64_t max_ns;
+	uint64_t p50_ns;
+	uint64_t p90_ns;
+	uint64_t p99_ns;
+	uint64_t p999_ns;
+} ab_latency_summary_t;
+
+// ab_get_latency summarizes the samples recorded since the node was created or
+// the histogram was last reset. It is safe to call from any thread.
+int
+ab_get_latency(ab_node_t* node, ab_latency_t which, ab_latency_summary_t* summary);
+
+// ab_get_latency_percentile sets ns to the given percentile (0 to 100) of a histogram.
+int
+ab_get_latency_percentile(ab_node_t* node, ab_latency_t which, double percentile,
+	uint64_t* ns);
+
+// ab_reset_latency clears a histogram to start a new measurement window.
+// Samples recorded while it is being cleared may or may not be kept.
+int
+ab_reset_latency(ab_node_t* node, ab_latency_t which);
+
+// ab_peer_stats_t is the leader's view of one follower.
+typedef struct {
+	uint64_t id;
+	// Round trip time from a broadcast to its ack, smoothed like TCP's SRTT, and
+	// the maximum seen. Acks for appends include the follower's confirmation time.
+	uint64_t rtt_ewma_ns;
+	uint64_t rtt_max_ns;
+	// Highest round the follower acked, and how far it is behind the leader's
+	// latest round.
+	uint64_t acked_round;
+	uint64_t round_lag;
+	// Time since the follower's last ack.
+	uint64_t last_ack_age_ns;
+	uint64_t acks;
+} ab_peer_stats_t;
+
+// ab_get_peer_stats copies up to max entries of per-follower stats into peers and
+// returns the number of followers known. Only a leader reports followers; the
+// stats restart when a node gains leadership. The leader refreshes the snapshot
+// whenever its role timer fires, at least once per heartbeat interval while idle,
+// so it may be slightly stale.
+// It is safe to call from any thread.
+int
+ab_get_peer_stats(ab_node_t* node, ab_peer_stats_t* peers, int max);
+
 // ab_listen sets the listen address for the node.
 // address can either be an IPv4 or an IPv6 address in the following forms:
 // - 127.0.0.1:2020
@@ -107,10 +412,20 @@ typedef void (*ab_append_cb)(int status, void* data);
 
 // ab_append broadcasts a message with the given content to the rest of the cluster.
 // ab_append_cb is called on success or failure with the provided data pointer.
+// The status is -1 if the node is not a leader, -2 if the append window is full and
+// -3 if content is larger than 16 MiB.
+// The leader passes the message to its own on_append too, and must confirm it like
+// the followers do (with ab_confirm_append, or its write-ahead log). The message
+// commits once a majority of the cluster, counting the leader, confirmed it.
+// It may be called from any thread, including from callbacks, once ab_listen succeeded.
+// Before that -1 is returned and cb is not called.
 int
 ab_append(ab_node_t* node, const char* content, int content_len, ab_append_cb cb, void* data);
 
-// ab_confirm_append should be called when a message is durably stored after on_append is called.
+// ab_confirm_append should be called when a message is durably stored after on_append is called,
+// on leaders and followers alike.
+// It is ignored when the node has a write-ahead log, and before ab_listen succeeded.
+// It may be called from any thread, including from on_append.
 void
 ab_confirm_append(ab_node_t* node, uint64_t round);
 
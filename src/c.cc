@@ -5,8 +5,20 @@
 
 struct ab_node_t { Node* rep; };
 
+static_assert(AB_MAX_CLUSTER_SIZE == MAX_CLUSTER_SIZE, "cluster size limits out of sync");
+
+static_assert(AB_MSG_LEADER_ACTIVE_ACK == (int)MSG_LEADER_ACTIVE_ACK &&
+	AB_MSG_SNAPSHOT_ACK == (int)MSG_SNAPSHOT_ACK &&
+	AB_MSG_TYPES == (int)MSG_SNAPSHOT_ACK+1, "message types out of sync");
+static_assert(AB_STATE_LEADER == (int)Leader &&
+	AB_STATE_POTENTIAL_LEADER == (int)PotentialLeader &&
+	AB_STATE_FOLLOWER == (int)Follower, "states out of sync");
+
 ab_node_t*
 ab_node_create(uint64_t id, int cluster_size) {
+	if (cluster_size < 1 || cluster_size > MAX_CLUSTER_SIZE) {
+		return nullptr;
+	}
 	auto node = new ab_node_t;
 	node->rep = new Node(id, cluster_size);
 	return node;
@@ -23,6 +35,134 @@ ab_set_key(ab_node_t* node, const char* key, int key_len) {
 	return node->rep->set_key(key_str);
 }
 
+int
+ab_set_checksum(ab_node_t* node, ab_checksum_t checksum) {
+	return node->rep->set_checksum(checksum);
+}
+
+int
+ab_set_append_window(ab_node_t* node, int window) {
+	return node->rep->set_append_window(window);
+}
+
+int
+ab_set_batching(ab_node_t* node, int max_entries, int max_bytes, int linger_us) {
+	if (linger_us < 0) {
+		return -1;
+	}
+	return node->rep->set_batching(max_entries, max_bytes, (uint64_t)linger_us*1000);
+}
+
+int
+ab_set_retention(ab_node_t* node, int max_entries, int max_bytes) {
+	return node->rep->set_retention(max_entries, max_bytes);
+}
+
+int
+ab_set_snapshot_callbacks(ab_node_t* node, ab_snapshot_callbacks_t callbacks, void* cb_data) {
+	node->rep->set_snapshot_callbacks(callbacks, cb_data);
+	return 0;
+}
+
+int
+ab_get_timing(ab_node_t* node, ab_timing_t* timing) {
+	if (node == nullptr || timing == nullptr) {
+		return -1;
+	}
+	node->rep->get_timing(timing);
+	return 0;
+}
+
+int
+ab_set_timing(ab_node_t* node, const ab_timing_t* timing) {
+	if (node == nullptr || timing == nullptr) {
+		return -1;
+	}
+	return node->rep->set_timing(*timing);
+}
+
+int
+ab_set_wal(ab_node_t* node, const char* dir, int segment_bytes, int sync_window_us) {
+	if (node == nullptr || dir == nullptr || segment_bytes < 0 || sync_window_us < 0) {
+		return -1;
+	}
+	uint64_t segment_size = segment_bytes > 0 ? segment_bytes : DEFAULT_WAL_SEGMENT_SIZE;
+	return node->rep->set_wal(dir, segment_size, sync_window_us);
+}
+
+int
+ab_replay_wal(ab_node_t* node, ab_replay_cb cb, void* cb_data) {
+	if (node == nullptr || cb == nullptr) {
+		return -1;
+	}
+	return node->rep->replay_wal([=](uint64_t round, const char* data, size_t len) {
+		cb(round, data, (int)len, cb_data);
+	});
+}
+
+int
+ab_truncate_wal(ab_node_t* node, uint64_t round) {
+	if (node == nullptr) {
+		return -1;
+	}
+	return node->rep->truncate_wal(round);
+}
+
+int
+ab_get_stats(ab_node_t* node, ab_stats_t* stats) {
+	if (node == nullptr || stats == nullptr) {
+		return -1;
+	}
+	node->rep->get_stats(stats);
+	return 0;
+}
+
+int
+ab_get_peer_stats(ab_node_t* node, ab_peer_stats_t* peers, int max) {
+	if (node == nullptr || (peers == nullptr && max > 0) || max < 0) {
+		return -1;
+	}
+	return node->rep->get_peer_stats(peers, max);
+}
+
+int
+ab_get_latency(ab_node_t* node, ab_latency_t which, ab_latency_summary_t* summary) {
+	auto histogram = node->rep->latency(which);
+	if (histogram == nullptr || summary == nullptr) {
+		return -1;
+	}
+	summary->count = histogram->count();
+	summary->min_ns = histogram->min();
+	summary->mean_ns = summary->count > 0 ? histogram->sum() / summary->count : 0;
+	summary->max_ns = histogram->max();
+	summary->p50_ns = histogram->percentile(50);
+	summary->p90_ns = histogram->percentile(90);
+	summary->p99_ns = histogram->percentile(99);
+	summary->p999_ns = histogram->percentile(99.9);
+	return 0;
+}
+
+int
+ab_get_latency_percentile(ab_node_t* node, ab_latency_t which, double percentile,
+	uint64_t* ns) {
+	auto histogram = node->rep->latency(which);
+	if (histogram == nullptr || ns == nullptr || percentile < 0 || percentile > 100) {
+		return -1;
+	}
+	*ns = histogram->percentile(percentile);
+	return 0;
+}
+
+int
+ab_reset_latency(ab_node_t* node, ab_latency_t which) {
+	auto histogram = node->rep->latency(which);
+	if (histogram == nullptr) {
+		return -1;
+	}
+	histogram->reset();
+	return 0;
+}
+
 int
 ab_listen(ab_node_t* node, const char* address) {
 	return node->rep->start(address);
@@ -52,8 +192,7 @@ ab_shutdown(ab_node_t* node) {
 int
 ab_append(ab_node_t* node, const char* content, int content_len,
 	ab_append_cb cb, void* data) {
-	node->rep->append(std::string(content, content_len), cb, data);
-	return 0;
+	return node->rep->append(std::string(content, content_len), cb, data);
 }
 
 void
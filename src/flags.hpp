@@ -40,6 +40,18 @@ set_cluster_size(std::string a, std::string b, void* d) {
 	*cluster_size = atoi(b.c_str());
 }
 
+void
+set_int(std::string a, std::string b, void* d) {
+	auto i = reinterpret_cast<int*>(d);
+	*i = atoi(b.c_str());
+}
+
+void
+set_double(std::string a, std::string b, void* d) {
+	auto f = reinterpret_cast<double*>(d);
+	*f = atof(b.c_str());
+}
+
 void
 add_peers(std::string a, std::string b, void* d) {
 	auto peers = reinterpret_cast<std::vector<cpl::net::SockAddr>*>(d);
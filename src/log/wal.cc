@@ -0,0 +1,509 @@
+#include "wal.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "message/crc32c.h"
+#include "message/encoding.h"
+
+static const char SEGMENT_MAGIC[8] = {'A', 'B', 'W', 'A', 'L', '0', '0', '1'};
+static const char SEGMENT_SUFFIX[] = ".wal";
+
+// sync_dir makes a new file's directory entry durable.
+static int
+sync_dir(const std::string& dir) {
+	int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	int status = fsync(fd);
+	::close(fd);
+	return status;
+}
+
+// sync_range flushes the pages of a mapping that cover [begin, end).
+static int
+sync_range(char* base, uint64_t begin, uint64_t end) {
+	static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+	auto start = (uintptr_t)(base + begin) & ~(page_size - 1);
+	return msync((void*)start, (uintptr_t)(base + end) - start, MS_SYNC);
+}
+
+// record_crc returns the checksum of a record, which starts at record.
+static uint32_t
+record_crc(const uint8_t* record, size_t data_len) {
+	return crc32c(0, record + 4, Wal::RECORD_HEADER_SIZE - 4 + data_len);
+}
+
+static bool
+valid_header(const WalSegment& segment) {
+	return segment.m_base != nullptr && segment.m_size >= Wal::SEGMENT_HEADER_SIZE &&
+		memcmp(segment.m_base, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) == 0;
+}
+
+WalSegment :: ~WalSegment() {
+	if (m_base != nullptr) {
+		munmap(m_base, m_size);
+	}
+}
+
+Wal :: Wal()
+: m_segment_size(DEFAULT_WAL_SEGMENT_SIZE)
+, m_active(nullptr)
+, m_offset(0)
+, m_next_seq(1)
+, m_appended(0)
+, m_written(0)
+, m_written_round(0)
+, m_synced_record(0)
+, m_synced_segment(nullptr)
+, m_synced_offset(0)
+, m_last_round(0)
+, m_truncate_round(0)
+, m_open(false)
+, m_failed(false)
+{
+}
+
+std::string
+Wal :: segment_name(uint64_t seq) {
+	char name[32];
+	snprintf(name, sizeof(name), "%016" PRIx64 "%s", seq, SEGMENT_SUFFIX);
+	return name;
+}
+
+int
+Wal :: open(const std::string& dir, uint64_t segment_size) {
+	if (m_open || dir.empty() || segment_size <= SEGMENT_HEADER_SIZE) {
+		return -1;
+	}
+	if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST) {
+		return -1;
+	}
+	m_dir = dir;
+	m_segment_size = segment_size;
+
+	DIR* d = opendir(dir.c_str());
+	if (d == nullptr) {
+		return -1;
+	}
+	std::vector<uint64_t> seqs;
+	while (auto entry = readdir(d)) {
+		const char* name = entry->d_name;
+		char* end = nullptr;
+		if (strlen(name) != 16 + strlen(SEGMENT_SUFFIX)) {
+			continue;
+		}
+		uint64_t seq = strtoull(name, &end, 16);
+		if (end == name + 16 && strcmp(end, SEGMENT_SUFFIX) == 0) {
+			seqs.push_back(seq);
+		}
+	}
+	closedir(d);
+	std::sort(seqs.begin(), seqs.end());
+
+	// Map the segments instead of reading them. Pages are only read
+	// when something touches them.
+	std::vector<std::unique_ptr<WalSegment>> segments;
+	for (auto seq : seqs) {
+		auto segment = map(seq);
+		if (segment == nullptr) {
+			return -1;
+		}
+		segments.push_back(std::move(segment));
+	}
+	// Segments at the end without a header were never used. They're
+	// spares, or were created right before a crash.
+	while (!segments.empty() && !valid_header(*segments.back())) {
+		auto path = m_dir + "/" + segment_name(segments.back()->m_seq);
+		segments.pop_back();
+		if (unlink(path.c_str()) < 0) {
+			return -1;
+		}
+	}
+
+	// Only the last segment has to be scanned for the end of the log.
+	// If it has no records, the last round is in the one before.
+	uint64_t last_round = 0;
+	for (size_t i = segments.size(); i > 0; i--) {
+		auto& segment = *segments[i-1];
+		uint64_t end = walk(segment, segment.m_size,
+			[&](uint64_t round, const char*, size_t) {
+				last_round = round;
+			});
+		if (i == segments.size()) {
+			m_active = &segment;
+			m_offset = end;
+		}
+		if (end > SEGMENT_HEADER_SIZE) {
+			break;
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!segments.empty()) {
+			m_next_seq = segments.back()->m_seq + 1;
+		}
+		m_segments = std::move(segments);
+		m_synced_segment = m_active;
+		m_synced_offset = m_offset;
+		m_last_round = last_round;
+		m_open = true;
+	}
+
+	// Have a segment ready for the first append.
+	prepare_spare();
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_spare == nullptr) {
+		m_open = false;
+		return -1;
+	}
+	return 0;
+}
+
+std::unique_ptr<WalSegment>
+Wal :: map(uint64_t seq) {
+	auto path = m_dir + "/" + segment_name(seq);
+	int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		return nullptr;
+	}
+	auto segment = std::make_unique<WalSegment>();
+	segment->m_seq = seq;
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		::close(fd);
+		return nullptr;
+	}
+	if (st.st_size >= (off_t)SEGMENT_HEADER_SIZE) {
+		void* base = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (base == MAP_FAILED) {
+			::close(fd);
+			return nullptr;
+		}
+		segment->m_base = (char*)base;
+		segment->m_size = st.st_size;
+	}
+	// The mapping doesn't need the descriptor.
+	::close(fd);
+	return segment;
+}
+
+std::unique_ptr<WalSegment>
+Wal :: create(uint64_t seq, uint64_t size) {
+	auto path = m_dir + "/" + segment_name(seq);
+	int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return nullptr;
+	}
+	// Allocate every block up front. Writing to a hole in a mapping
+	// on a full disk would raise SIGBUS instead of returning an error.
+	void* base = MAP_FAILED;
+	if (posix_fallocate(fd, 0, size) == 0 && fsync(fd) == 0 && sync_dir(m_dir) == 0) {
+		base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	::close(fd);
+	if (base == MAP_FAILED) {
+		unlink(path.c_str());
+		return nullptr;
+	}
+	auto segment = std::make_unique<WalSegment>();
+	segment->m_seq = seq;
+	segment->m_base = (char*)base;
+	segment->m_size = size;
+	return segment;
+}
+
+uint64_t
+Wal :: walk(const WalSegment& segment, uint64_t limit,
+	std::function<void(uint64_t, const char*, size_t)> fn) {
+	if (!valid_header(segment)) {
+		return 0;
+	}
+	auto base = (const uint8_t*)segment.m_base;
+	uint64_t offset = SEGMENT_HEADER_SIZE;
+	while (offset + RECORD_HEADER_SIZE <= limit) {
+		auto record = base + offset;
+		uint64_t len = read32le((uint8_t*)record + 4);
+		if (len > limit - offset - RECORD_HEADER_SIZE ||
+			record_crc(record, len) != read32le((uint8_t*)record)) {
+			break;
+		}
+		fn(read64le((uint8_t*)record + 8), (const char*)record + RECORD_HEADER_SIZE, len);
+		offset += RECORD_HEADER_SIZE + len;
+	}
+	return offset;
+}
+
+void
+Wal :: activate(uint64_t first_round) {
+	auto segment = std::move(m_spare);
+	memcpy(segment->m_base, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+	write64le(first_round, (uint8_t*)segment->m_base + sizeof(SEGMENT_MAGIC));
+	m_active = segment.get();
+	m_offset = SEGMENT_HEADER_SIZE;
+	m_dirty.push_back(Dirty{m_active, 0, SEGMENT_HEADER_SIZE});
+	m_segments.push_back(std::move(segment));
+}
+
+const char*
+Wal :: write(uint64_t round, const char* data, size_t len) {
+	uint64_t size = RECORD_HEADER_SIZE + len;
+	auto record = (uint8_t*)m_active->m_base + m_offset;
+	write32le((uint32_t)len, record + 4);
+	write64le(round, record + 8);
+	memcpy(record + RECORD_HEADER_SIZE, data, len);
+	write32le(record_crc(record, len), record);
+
+	if (!m_dirty.empty() && m_dirty.back().m_segment == m_active &&
+		m_dirty.back().m_end == m_offset) {
+		m_dirty.back().m_end += size;
+	} else {
+		m_dirty.push_back(Dirty{m_active, m_offset, m_offset + size});
+	}
+	m_written++;
+	m_written_round = round;
+	m_offset += size;
+	return (const char*)record + RECORD_HEADER_SIZE;
+}
+
+const char*
+Wal :: append(uint64_t round, const char* data, size_t len, uint64_t& record) {
+	if (len > UINT32_MAX) {
+		return nullptr;
+	}
+	uint64_t size = RECORD_HEADER_SIZE + len;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!m_open || m_failed) {
+		return nullptr;
+	}
+	record = ++m_appended;
+	if (m_backlog.empty() && (m_active == nullptr || m_offset + size > m_active->m_size) &&
+		m_spare != nullptr && m_spare->m_size >= SEGMENT_HEADER_SIZE + size) {
+		activate(round);
+	}
+	if (!m_backlog.empty() || m_active == nullptr || m_offset + size > m_active->m_size) {
+		// No segment is ready. Hold the record until sync creates
+		// one, behind any records already waiting.
+		m_backlog.push_back(Held{round, std::make_unique<std::string>(data, len)});
+		return m_backlog.back().m_data->data();
+	}
+	return write(round, data, len);
+}
+
+int
+Wal :: write_held() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_backlog.empty()) {
+		auto& held = m_backlog.front();
+		uint64_t size = RECORD_HEADER_SIZE + held.m_data->size();
+		if (m_active != nullptr && m_offset + size <= m_active->m_size) {
+			write(held.m_round, held.m_data->data(), held.m_data->size());
+			m_active->m_held.push_back(std::move(held.m_data));
+			m_backlog.pop_front();
+			continue;
+		}
+		if (m_spare != nullptr && m_spare->m_size >= SEGMENT_HEADER_SIZE + size) {
+			activate(held.m_round);
+			continue;
+		}
+
+		// Create a segment big enough. A spare that's too small is
+		// replaced under the same name, since it's next in the log.
+		uint64_t seq = m_spare != nullptr ? m_spare->m_seq : m_next_seq++;
+		m_spare = nullptr;
+		lock.unlock();
+		auto segment = create(seq, std::max(m_segment_size, SEGMENT_HEADER_SIZE + size));
+		lock.lock();
+		if (segment == nullptr) {
+			return -1;
+		}
+		m_spare = std::move(segment);
+	}
+	return 0;
+}
+
+bool
+Wal :: pending() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_written > m_synced_record || !m_backlog.empty();
+}
+
+uint64_t
+Wal :: last_round() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_last_round;
+}
+
+int
+Wal :: sync(uint64_t& synced) {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_open || m_failed) {
+			return -1;
+		}
+	}
+	if (write_held() < 0) {
+		return fail();
+	}
+
+	std::vector<Dirty> dirty;
+	uint64_t written;
+	uint64_t written_round;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		dirty.swap(m_dirty);
+		written = m_written;
+		written_round = m_written_round;
+	}
+
+	// Records are written in place, so syncing is flushing the pages
+	// they touched. The ranges are in log order, so a new segment's
+	// records are never durable before the end of the previous one.
+	for (auto& range : dirty) {
+		if (sync_range(range.m_segment->m_base, range.m_begin, range.m_end) < 0) {
+			return fail();
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!dirty.empty()) {
+			m_synced_segment = dirty.back().m_segment;
+			m_synced_offset = dirty.back().m_end;
+		}
+		if (written > m_synced_record) {
+			m_last_round = written_round;
+			m_synced_record = written;
+		}
+		synced = m_synced_record;
+	}
+
+	remove_segments();
+
+	// Have the next segment ready before the active one fills up.
+	prepare_spare();
+	return 0;
+}
+
+void
+Wal :: truncate(uint64_t round) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_truncate_round = std::max(m_truncate_round, round);
+}
+
+void
+Wal :: remove_segments() {
+	std::unique_lock<std::mutex> replaying(m_replay_mutex, std::try_to_lock);
+	if (!replaying.owns_lock()) {
+		// Try again after the next sync.
+		return;
+	}
+
+	std::vector<std::unique_ptr<WalSegment>> removed;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_synced_segment == nullptr) {
+			return;
+		}
+		// A segment can go once the next one starts at or below the
+		// round after the truncation point. Each of its entries is then
+		// truncated, or was replaced by an entry in a later segment.
+		// Only synced segments before the one being written are removed.
+		size_t n = 0;
+		while (n+1 < m_segments.size() && m_segments[n].get() != m_synced_segment &&
+			m_segments[n].get() != m_active &&
+			read64le((uint8_t*)m_segments[n+1]->m_base + sizeof(SEGMENT_MAGIC)) <=
+				m_truncate_round + 1) {
+			n++;
+		}
+		for (size_t i = 0; i < n; i++) {
+			removed.push_back(std::move(m_segments[i]));
+		}
+		m_segments.erase(m_segments.begin(), m_segments.begin() + n);
+	}
+
+	// Oldest first, making each removal durable before the next, so a
+	// crash can't leave a gap in the log.
+	for (auto& segment : removed) {
+		auto path = m_dir + "/" + segment_name(segment->m_seq);
+		if (unlink(path.c_str()) < 0 || sync_dir(m_dir) < 0) {
+			// The rest stay on disk and are mapped again by the
+			// next open.
+			break;
+		}
+	}
+}
+
+void
+Wal :: prepare_spare() {
+	uint64_t seq;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_spare != nullptr || m_failed) {
+			return;
+		}
+		seq = m_next_seq++;
+	}
+	// Appends only take the spare once it's set, so it can be created
+	// without the lock.
+	auto spare = create(seq, m_segment_size);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_spare = std::move(spare);
+}
+
+int
+Wal :: replay(std::function<void(uint64_t, const char*, size_t)> fn) {
+	// Segments are only unmapped by remove_segments, so they can be
+	// walked without m_mutex once the synced part of the log is known.
+	std::lock_guard<std::mutex> replaying(m_replay_mutex);
+	std::vector<std::pair<const WalSegment*, uint64_t>> segments;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_open) {
+			return -1;
+		}
+		for (auto& segment : m_segments) {
+			if (m_synced_segment == nullptr) {
+				break;
+			}
+			if (segment.get() == m_synced_segment) {
+				segments.push_back({segment.get(), m_synced_offset});
+				break;
+			}
+			segments.push_back({segment.get(), segment->m_size});
+		}
+	}
+
+	int n = 0;
+	for (auto& it : segments) {
+		walk(*it.first, it.second, [&](uint64_t round, const char* data, size_t len) {
+			fn(round, data, len);
+			n++;
+		});
+	}
+	return n;
+}
+
+int
+Wal :: fail() {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_failed = true;
+	m_dirty.clear();
+	for (auto& held : m_backlog) {
+		m_unwritten.push_back(std::move(held.m_data));
+	}
+	m_backlog.clear();
+	return -1;
+}
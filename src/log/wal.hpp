@@ -0,0 +1,232 @@
+#pragma once
+
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <deque>
+
+// Segments are preallocated to this size by default.
+const uint64_t DEFAULT_WAL_SEGMENT_SIZE = 64*1024*1024;
+
+// WalSegment is a segment file mapped into memory. The mapping lives as
+// long as the segment, so pointers into it stay valid until the segment
+// is truncated.
+struct WalSegment
+{
+	WalSegment()
+	: m_seq(0)
+	, m_base(nullptr)
+	, m_size(0)
+	{
+	}
+
+	~WalSegment();
+
+	uint64_t m_seq;
+	char*    m_base;
+	uint64_t m_size;
+	// Copies of records that waited for this segment. Their pointers
+	// were handed out too, so they go with it.
+	std::vector<std::unique_ptr<std::string>> m_held;
+}; // WalSegment
+
+// Wal is an append-only log of entries kept in a directory of segment
+// files named by sequence number. Segments are preallocated and mapped
+// into memory, so appending is a copy into the mapping and syncing is an
+// msync of the pages written since the last sync. Nothing changes the
+// file size, so a sync doesn't have to flush metadata. The next segment
+// is prepared in the background by sync. A segment is full once the next
+// record doesn't fit; records never span segments.
+//
+// append never touches the file system. If the next segment isn't ready
+// when one fills up, or is too small for a record, records are held in
+// memory until sync has created one and written them to it.
+//
+// The log is trimmed from the front: once the application no longer
+// needs the entries up to a round, truncate lets sync remove the
+// segments that only hold those.
+//
+// A segment starts with a 16 byte header: the magic "ABWAL001" and the
+// first round in it. Each record is
+//
+//   crc32c (4) | length (4) | round (8) | data (length)
+//
+// with little endian integers and the CRC covering everything after it.
+// The log ends at the first record that fails its check, which covers
+// both torn writes and the zeroed preallocated space. Rounds are usually
+// increasing, but an entry that was never committed can be followed by a
+// different entry for the same round from a new leader.
+//
+// append and sync run on different threads, so syncs don't block
+// appends. replay may run on any thread.
+class Wal
+{
+public:
+	static const size_t SEGMENT_HEADER_SIZE = 16;
+	static const size_t RECORD_HEADER_SIZE = 16;
+
+	Wal();
+
+	Wal(const Wal&) = delete;
+	Wal& operator =(const Wal&) = delete;
+
+	// open opens the log in dir, creating the directory if needed. The
+	// existing segments are mapped, not read, and only the last one is
+	// scanned to find the end of the log. New segments are preallocated
+	// to segment_size bytes.
+	// A negative value is returned for errors.
+	int
+	open(const std::string& dir, uint64_t segment_size = DEFAULT_WAL_SEGMENT_SIZE);
+
+	// append copies an entry into the log, to be made durable by the
+	// next sync, and returns where its data is mapped, or the held copy
+	// if it has to wait for a segment. The pointer stays valid until the
+	// entry is truncated. nullptr is returned if the log isn't open or
+	// failed.
+	// Records are numbered from 1 in append order since open; record is
+	// set to the entry's number.
+	const char*
+	append(uint64_t round, const char* data, size_t len, uint64_t& record);
+
+	// pending reports whether entries are waiting for a sync.
+	bool
+	pending();
+
+	// sync waits until the appended entries are on disk, then sets
+	// synced to the number of the last one. Every record up to it is
+	// durable. It blocks, so it should run off the event loop. Only one
+	// sync may run at a time, and only sync creates segments after open.
+	// After an error the log stays failed.
+	int
+	sync(uint64_t& synced);
+
+	// replay calls fn with every synced entry in log order, with data
+	// pointing into the mapping. It returns the number of entries.
+	int
+	replay(std::function<void(uint64_t round, const char* data, size_t len)> fn);
+
+	// truncate tells the log that entries up to round are no longer
+	// needed, for example because a snapshot covers them. The next sync
+	// removes every segment before the one being written whose entries
+	// are all at or below round, or were replaced by later entries.
+	// Pointers into removed segments become invalid. It's safe to call
+	// from any thread, and round never moves back.
+	void
+	truncate(uint64_t round);
+
+	// last_round returns the round of the last synced entry, including
+	// entries found by open, or 0 if there are none.
+	uint64_t
+	last_round();
+
+	// segment returns the sequence number of the segment being written,
+	// or 0 if there is none yet.
+	uint64_t
+	segment() const
+	{
+		return m_active != nullptr ? m_active->m_seq : 0;
+	}
+
+	static std::string
+	segment_name(uint64_t seq);
+
+private:
+	// A range of a segment written since the last sync.
+	struct Dirty
+	{
+		WalSegment* m_segment;
+		uint64_t    m_begin;
+		uint64_t    m_end;
+	}; // Dirty
+
+	// map maps an existing segment file.
+	std::unique_ptr<WalSegment>
+	map(uint64_t seq);
+
+	// create creates and maps a preallocated segment of at least size
+	// bytes.
+	std::unique_ptr<WalSegment>
+	create(uint64_t seq, uint64_t size);
+
+	// walk calls fn with each valid record of a segment before limit and
+	// returns where the valid records end.
+	static uint64_t
+	walk(const WalSegment& segment, uint64_t limit,
+		std::function<void(uint64_t, const char*, size_t)> fn);
+
+	// A record waiting for a segment. Once it's written, its copy moves
+	// to the segment.
+	struct Held
+	{
+		uint64_t                     m_round;
+		std::unique_ptr<std::string> m_data;
+	}; // Held
+
+	// activate starts writing to the spare segment. m_mutex must be held.
+	void
+	activate(uint64_t first_round);
+
+	// write writes a record to the active segment, which must have room
+	// for it. m_mutex must be held.
+	const char*
+	write(uint64_t round, const char* data, size_t len);
+
+	// write_held writes the held records, creating segments as needed.
+	int
+	write_held();
+
+	// prepare_spare creates the next segment ahead of time.
+	void
+	prepare_spare();
+
+	// remove_segments removes the segments truncate allows, unless a
+	// replay is walking them.
+	void
+	remove_segments();
+
+	int
+	fail();
+
+private:
+	std::string           m_dir;
+	uint64_t              m_segment_size;
+
+	// Segment being appended to and where the next record goes.
+	// Only append touches these after open.
+	WalSegment*           m_active;
+	uint64_t              m_offset;
+
+	// Held by replay while it walks the segments, so they aren't
+	// removed under it.
+	std::mutex            m_replay_mutex;
+	// Guards the fields below.
+	std::mutex            m_mutex;
+	// All mapped segments, oldest first.
+	std::vector<std::unique_ptr<WalSegment>> m_segments;
+	// The next segment, created before it's needed.
+	std::unique_ptr<WalSegment> m_spare;
+	uint64_t              m_next_seq;
+	// Records waiting for a segment, in log order.
+	std::deque<Held>      m_backlog;
+	// Copies of held records that were never written because the log
+	// failed. Their pointers stay valid as long as the Wal.
+	std::vector<std::unique_ptr<std::string>> m_unwritten;
+	// Entries up to this round may be removed.
+	uint64_t              m_truncate_round;
+	std::vector<Dirty>    m_dirty;
+	// Records appended, and written to segments, since open, and the
+	// round of the last one written.
+	uint64_t              m_appended;
+	uint64_t              m_written;
+	uint64_t              m_written_round;
+	uint64_t              m_synced_record;
+	// End of the synced part of the log.
+	WalSegment*           m_synced_segment;
+	uint64_t              m_synced_offset;
+	uint64_t              m_last_round;
+	bool                  m_open;
+	bool                  m_failed;
+}; // Wal
@@ -23,21 +23,43 @@ main(int argc, char* argv[]) {
 	std::string addr_str;
 	// Shared encryption key
 	std::string key;
+	// Checksum for unencrypted messages
+	std::string checksum = "sha512";
 	// Peers to initially connect to.
 	// These are automatically marked as valid.
 	std::vector<cpl::net::SockAddr> peer_addrs;
 	uint64_t id = 0;
 	int cluster_size = 0;
+	// Timeouts in ms. Zero keeps the default.
+	ab_timing_t timing = {};
+	// Negative keeps the default.
+	timing.phi_threshold = -1;
+	// Write-ahead log directory. Empty leaves storage to the callbacks.
+	std::string wal_dir;
 
 	// Flags
 	cpl::Flags flags(NAME, VERSION);
 	flags.add_option("--help", "-h", "show help documentation", show_help, &flags);
 	flags.add_option("--listen", "-l", "set listen address for cluster nodes", set_string, &addr_str);
 	flags.add_option("--key", "-k", "set shared cluster encryption key", set_string, &key);
+	flags.add_option("--checksum", "-c", "checksum used without a key (sha512 or crc32c)",
+		set_string, &checksum);
 	flags.add_option("--peers", "-p", "list of peers", add_peers, &peer_addrs);
 	flags.add_option("--id", "-i", "ID, unique among the cluster", set_id, &id);
 	flags.add_option("--cluster-size", "-s", "Total size of the cluster. Determines quorum size.",
 		set_cluster_size, &cluster_size);
+	flags.add_option("--heartbeat-ms", "-H", "leader heartbeat interval in ms",
+		set_int, &timing.heartbeat_ms);
+	flags.add_option("--leadership-loss-ms", "-L", "time a leader waits for a majority in ms",
+		set_int, &timing.leadership_loss_ms);
+	flags.add_option("--follower-timeout-ms", "-F", "time before a follower starts an election in ms",
+		set_int, &timing.follower_timeout_ms);
+	flags.add_option("--reconnect-ms", "-R", "delay between peer reconnection attempts in ms",
+		set_int, &timing.reconnect_ms);
+	flags.add_option("--phi-threshold", "-P", "leader failure suspicion level (0 for a fixed timeout)",
+		set_double, &timing.phi_threshold);
+	flags.add_option("--wal", "-W", "keep entries in a write-ahead log in this directory",
+		set_string, &wal_dir);
 	flags.parse(argc, argv);
 
 	// Check required flags
@@ -56,15 +78,53 @@ main(int argc, char* argv[]) {
 		cluster_size = 1;
 	}
 
+	if (cluster_size < 0 || cluster_size > MAX_CLUSTER_SIZE) {
+		std::cerr << "--cluster-size must be at most " << MAX_CLUSTER_SIZE << "." << std::endl;
+		return 1;
+	}
+
 	// Initialize node
 	auto n = std::make_unique<Node>(id, cluster_size);
 	if (n->set_key(key) < 0) {
 		std::cerr << "invalid key" << std::endl;
 		return 1;
 	}
+	if (checksum == "crc32c") {
+		n->set_checksum(CHECKSUM_CRC32C);
+	} else if (checksum != "sha512") {
+		std::cerr << "invalid checksum: " << checksum << std::endl;
+		return 1;
+	}
+	ab_timing_t node_timing;
+	n->get_timing(&node_timing);
+	if (timing.heartbeat_ms != 0) {
+		node_timing.heartbeat_ms = timing.heartbeat_ms;
+	}
+	if (timing.leadership_loss_ms != 0) {
+		node_timing.leadership_loss_ms = timing.leadership_loss_ms;
+	}
+	if (timing.follower_timeout_ms != 0) {
+		node_timing.follower_timeout_ms = timing.follower_timeout_ms;
+	}
+	if (timing.reconnect_ms != 0) {
+		node_timing.reconnect_ms = timing.reconnect_ms;
+	}
+	if (timing.phi_threshold >= 0) {
+		node_timing.phi_threshold = timing.phi_threshold;
+	}
+	if (n->set_timing(node_timing) < 0) {
+		std::cerr << "invalid timing: heartbeat < leadership loss < follower timeout is required"
+			<< std::endl;
+		return 1;
+	}
+
+	if (!wal_dir.empty() && n->set_wal(wal_dir, DEFAULT_WAL_SEGMENT_SIZE, 0) < 0) {
+		std::cerr << "failed to open write-ahead log in " << wal_dir << std::endl;
+		return 1;
+	}
 
 	// Set up callbacks
-	ab_callbacks_t callbacks;
+	ab_callbacks_t callbacks = {};
 	callbacks.gained_leadership = [](void* cb_data) {
 		std::cerr << "gained leadership" << std::endl;
 	};
@@ -79,6 +139,12 @@ main(int argc, char* argv[]) {
 		std::cerr << "on append " << round << std::endl;
 		node->confirm_append(round);
 	};
+	callbacks.on_commit = [](uint64_t round, void* cb_data) {
+		std::cerr << "on commit " << round << std::endl;
+	};
+	callbacks.on_wal_failed = [](void* cb_data) {
+		std::cerr << "write-ahead log failed" << std::endl;
+	};
 	n->set_callbacks(callbacks, n.get());
 
 	// Start
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <string>
+#include <vector>
+#include <memory>
 #include <cassert>
 #include <cstdlib>
 #include <iostream>
@@ -8,12 +10,29 @@
 #include "message.hpp"
 
 const int KEY_SIZE = 32;
+const int NONCE_PREFIX_SIZE = 16;
+
+// Frame is a packed and sealed message. Frames are not modified after
+// packing, so one frame can be written to any number of peers.
+typedef std::vector<uint8_t> Frame;
+
+// Integrity checks for unencrypted messages. Encrypted messages are
+// always authenticated with Poly1305.
+enum CHECKSUM_TYPE
+{
+	// First 24 bytes of a SHA-512 hash
+	CHECKSUM_SHA512,
+	// Hardware accelerated CRC32C. Only detects corruption, not tampering.
+	CHECKSUM_CRC32C
+};
 
 class Codec {
 public:
 	Codec()
 	: m_key("")
+	, m_checksum(CHECKSUM_SHA512)
 	{
+		reset_nonce();
 	}
 
 	int
@@ -27,18 +46,58 @@ public:
 			return -1;
 		}
 		m_key = key;
+		reset_nonce();
+		return 0;
+	}
+
+	// set_checksum sets the checksum used for outgoing unencrypted messages.
+	// Incoming messages are verified with whichever checksum their
+	// flags indicate, so nodes with different settings interoperate.
+	int
+	set_checksum(int checksum)
+	{
+		if (checksum != CHECKSUM_SHA512 && checksum != CHECKSUM_CRC32C) {
+			return -1;
+		}
+		m_checksum = (CHECKSUM_TYPE)checksum;
 		return 0;
 	}
 
 	int
 	pack_message(const Message* m, uint8_t* dest, int dest_len);
 
+	// pack_frame packs a message into a new frame.
+	// nullptr is returned if packing fails.
+	std::shared_ptr<const Frame>
+	pack_frame(const Message* m);
+
+	// open_frame verifies a received frame and decrypts it in place.
+	// The plaintext starts at the same offset as in an unencrypted frame.
+	int
+	open_frame(uint8_t* src, int src_len);
+
 	int
 	decode_message(std::unique_ptr<Message>& m, uint8_t* src, int src_len);
 
+	// decode_message_length returns the length of the frame at src,
+	// -1 if the length isn't there yet, or -2 if it is out of range,
+	// after which the stream can't be parsed anymore.
 	int
 	decode_message_length(uint8_t* src, int src_len);
 
 private:
-	std::string m_key;
+	// Nonces are a random prefix followed by a 64-bit counter. The prefix
+	// is drawn once per key, so nonces never repeat for a key without
+	// needing fresh randomness for every message.
+	void
+	reset_nonce();
+
+	void
+	next_nonce(uint8_t* nonce);
+
+private:
+	std::string   m_key;
+	CHECKSUM_TYPE m_checksum;
+	uint8_t       m_nonce_prefix[NONCE_PREFIX_SIZE];
+	uint64_t      m_nonce_counter;
 }; // Codec
@@ -0,0 +1,159 @@
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC32C_X86
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM
+#endif
+
+#include "crc32c.h"
+
+namespace {
+
+const uint32_t POLY = 0x82f63b78; // reflected 0x1edc6f41
+
+struct Tables
+{
+	uint32_t t[8][256];
+
+	Tables()
+	{
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++) {
+				c = (c >> 1) ^ (POLY & (0 - (c & 1)));
+			}
+			t[0][i] = c;
+		}
+		for (uint32_t i = 0; i < 256; i++) {
+			for (int j = 1; j < 8; j++) {
+				t[j][i] = (t[j-1][i] >> 8) ^ t[0][t[j-1][i] & 0xff];
+			}
+		}
+	}
+};
+
+const Tables&
+tables() {
+	static const Tables t;
+	return t;
+}
+
+uint32_t
+crc32c_sw(uint32_t crc, const uint8_t* p, size_t len) {
+	const Tables& tab = tables();
+	auto t = tab.t;
+	while (len >= 8) {
+		uint32_t lo = (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+			(uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+		lo ^= crc;
+		crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+			t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+			t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0) {
+		crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+	}
+	return crc;
+}
+
+#if defined(CRC32C_X86)
+
+__attribute__((target("sse4.2")))
+uint32_t
+crc32c_hw(uint32_t crc, const uint8_t* p, size_t len) {
+	uint64_t c = crc;
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		len -= 8;
+	}
+	uint32_t c32 = (uint32_t)c;
+	while (len-- > 0) {
+		c32 = _mm_crc32_u8(c32, *p++);
+	}
+	return c32;
+}
+
+bool
+hw_supported() {
+	return __builtin_cpu_supports("sse4.2");
+}
+
+#elif defined(CRC32C_ARM)
+
+uint32_t
+crc32c_hw(uint32_t crc, const uint8_t* p, size_t len) {
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		crc = __crc32cd(crc, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0) {
+		crc = __crc32cb(crc, *p++);
+	}
+	return crc;
+}
+
+bool
+hw_supported() {
+	return true;
+}
+
+#else
+
+uint32_t
+crc32c_hw(uint32_t crc, const uint8_t* p, size_t len) {
+	return crc32c_sw(crc, p, len);
+}
+
+bool
+hw_supported() {
+	return false;
+}
+
+#endif
+
+bool
+use_hw() {
+	static const bool hw = hw_supported();
+	return hw;
+}
+
+} // namespace
+
+uint32_t
+crc32c(uint32_t crc, const uint8_t* data, size_t len) {
+	crc = ~crc;
+	if (use_hw()) {
+		crc = crc32c_hw(crc, data, len);
+	} else {
+		crc = crc32c_sw(crc, data, len);
+	}
+	return ~crc;
+}
+
+uint32_t
+crc32c_portable(uint32_t crc, const uint8_t* data, size_t len) {
+	return ~crc32c_sw(~crc, data, len);
+}
+
+const char*
+crc32c_backend(void) {
+	if (!use_hw()) {
+		return "table";
+	}
+#if defined(CRC32C_X86)
+	return "sse4.2";
+#else
+	return "armv8";
+#endif
+}
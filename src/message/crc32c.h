@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// CRC32C (Castagnoli). Uses the SSE4.2 or ARMv8 CRC instructions when the
+// CPU supports them and a slicing-by-8 table otherwise.
+// crc is the value returned by a previous call, or 0 to start.
+uint32_t crc32c(uint32_t crc, const uint8_t* data, size_t len);
+
+// crc32c_portable always uses the table implementation.
+uint32_t crc32c_portable(uint32_t crc, const uint8_t* data, size_t len);
+
+// crc32c_backend returns the name of the selected implementation.
+const char* crc32c_backend(void);
+
+#ifdef __cplusplus
+}
+#endif
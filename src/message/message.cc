@@ -7,7 +7,9 @@
 
 #include "codec.hpp"
 #include "message.hpp"
+#include "crc32c.h"
 #include "randombytes.h"
+#include "secretbox.h"
 
 /**
  * A message header has the following fields:
@@ -20,11 +22,13 @@
  */
 const int MSG_HEADER_SIZE = 38;
 const int MSG_PADDING_SIZE = 16; // for crypto
+static_assert(MSG_PADDING_SIZE == SECRETBOX_MACBYTES, "padding must fit the MAC");
 
 const int NONCE_HASH_OFFSET = 4;
 const int NONCE_HASH_SIZE = 24;
 
 const int TYPE_OFFSET = 4+NONCE_HASH_SIZE;
+const int FLAGS_OFFSET = TYPE_OFFSET+1;
 const int PAYLOAD_OFFSET = TYPE_OFFSET;
 
 int
@@ -70,7 +74,7 @@ Message :: unpack(uint8_t* src, int src_len) {
 
 	uint32_t length = read32le(src);
 	src += 4;
-	if (src_len < length) {
+	if (length < MSG_HEADER_SIZE || (uint32_t)src_len < length) {
 		return -2;
 	}
 	memcpy(nonce_hash, src, NONCE_HASH_SIZE);
@@ -81,49 +85,55 @@ Message :: unpack(uint8_t* src, int src_len) {
 	src++;
 	message_id = read64le(src);
 	src += 8;
-	unpack_body(src, length - MSG_HEADER_SIZE);
-	return 0;
+	// A malformed body fails the whole message.
+	return unpack_body(src, length - MSG_HEADER_SIZE);
 }
 
 int
-Codec :: decode_message(std::unique_ptr<Message>& m, uint8_t* src, int src_len) {
-	if (src_len < MSG_HEADER_SIZE) {
+Codec :: open_frame(uint8_t* src, int src_len) {
+	if (src_len < MSG_HEADER_SIZE + MSG_PADDING_SIZE) {
 		return -1;
 	}
 
 	if (m_key == "") {
 		// No encryption. Just verify hash.
 		uint8_t h[64];
-		crypto_hash(h,
-			src + PAYLOAD_OFFSET,
-			src_len - PAYLOAD_OFFSET);
+		if (src[FLAGS_OFFSET] & MSG_FLAG_CRC32C) {
+			memset(h, 0, NONCE_HASH_SIZE);
+			write32le(crc32c(0, src + PAYLOAD_OFFSET, src_len - PAYLOAD_OFFSET), h);
+		} else {
+			crypto_hash(h,
+				src + PAYLOAD_OFFSET,
+				src_len - PAYLOAD_OFFSET);
+		}
 		if (memcmp(h, src + NONCE_HASH_OFFSET, NONCE_HASH_SIZE) != 0) {
 			return -2;
 		}
 	} else {
+		// The MAC is at the start of the payload, followed by the ciphertext.
+		// Decrypt in place so the plaintext starts at the payload offset.
 		uint8_t* nonce = src+NONCE_HASH_OFFSET;
-		int payload_size = src_len - PAYLOAD_OFFSET;
-		int clen = payload_size + crypto_secretbox_BOXZEROBYTES;
-		std::vector<uint8_t> c(clen, 0);
-		std::vector<uint8_t> message_data(clen, 0);
-
-		for (int i = 0; i < payload_size; ++i) {
-			c[i + crypto_secretbox_BOXZEROBYTES] = src[i + PAYLOAD_OFFSET];
-		}
-
-		int i = crypto_secretbox_open(
-			message_data.data(),
-			c.data(),
+		uint8_t* mac = src+PAYLOAD_OFFSET;
+		int clen = src_len - PAYLOAD_OFFSET - SECRETBOX_MACBYTES;
+		int i = secretbox_open_detached(
+			src + PAYLOAD_OFFSET,
+			mac + SECRETBOX_MACBYTES,
+			mac,
 			clen,
 			nonce,
 			(uint8_t*)m_key.data());
 		if (i < 0) {
 			return -1;
 		}
+	}
+	return 0;
+}
 
-		for (int i = 0; i < payload_size - MSG_PADDING_SIZE; ++i) {
-			src[i + PAYLOAD_OFFSET] = message_data[i + crypto_secretbox_ZEROBYTES];
-		}
+int
+Codec :: decode_message(std::unique_ptr<Message>& m, uint8_t* src, int src_len) {
+	int status = open_frame(src, src_len);
+	if (status < 0) {
+		return status;
 	}
 
 	// Peek at the message type
@@ -140,6 +150,12 @@ Codec :: decode_message(std::unique_ptr<Message>& m, uint8_t* src, int src_len)
 	case MSG_LEADER_ACTIVE_ACK:
 		m = std::make_unique<LeaderActiveAck>();
 		break;
+	case MSG_SNAPSHOT_CHUNK:
+		m = std::make_unique<SnapshotChunk>();
+		break;
+	case MSG_SNAPSHOT_ACK:
+		m = std::make_unique<SnapshotAck>();
+		break;
 	default:
 		return -1;
 	}
@@ -156,46 +172,74 @@ Codec :: pack_message(const Message* m, uint8_t* dest, int dest_len) {
 	if (m_key == "") {
 		// No encryption. Just compute a checksum.
 		uint8_t h[64];
-		crypto_hash(h,
-			dest+PAYLOAD_OFFSET,
-			m->packed_size()-PAYLOAD_OFFSET);
+		if (m_checksum == CHECKSUM_CRC32C) {
+			// The flag is covered by the checksum.
+			dest[FLAGS_OFFSET] |= MSG_FLAG_CRC32C;
+			memset(h, 0, NONCE_HASH_SIZE);
+			write32le(crc32c(0, dest+PAYLOAD_OFFSET, m->packed_size()-PAYLOAD_OFFSET), h);
+		} else {
+			crypto_hash(h,
+				dest+PAYLOAD_OFFSET,
+				m->packed_size()-PAYLOAD_OFFSET);
+		}
 		memcpy(dest + NONCE_HASH_OFFSET, h, NONCE_HASH_SIZE);
 	} else {
 		// Initialize nonce.
-		uint8_t n[NONCE_HASH_SIZE];
-		randombytes(n, NONCE_HASH_SIZE);
-		for (int i = 0; i < NONCE_HASH_SIZE; i++) {
-			dest[i + NONCE_HASH_OFFSET] = n[i];
-		}
-		int payload_size = m->packed_size() - PAYLOAD_OFFSET - MSG_PADDING_SIZE;
-		int mlen = payload_size + crypto_secretbox_ZEROBYTES;
-		std::vector<uint8_t> message_data(mlen, 0);
-		std::vector<uint8_t> c(mlen, 0);
-		for (int i = 0; i < payload_size; ++i) {
-			message_data[i + crypto_secretbox_ZEROBYTES] = dest[i + PAYLOAD_OFFSET];
-		}
-
-		crypto_secretbox(
-			c.data(),
-			message_data.data(),
+		uint8_t* n = dest + NONCE_HASH_OFFSET;
+		next_nonce(n);
+		// Shift the plaintext into the padding to make room for the MAC,
+		// then encrypt it in place.
+		uint8_t* mac = dest + PAYLOAD_OFFSET;
+		int mlen = m->packed_size() - PAYLOAD_OFFSET - MSG_PADDING_SIZE;
+		memmove(mac + SECRETBOX_MACBYTES, mac, mlen);
+		secretbox_detached(
+			mac + SECRETBOX_MACBYTES,
+			mac,
+			mac + SECRETBOX_MACBYTES,
 			mlen,
 			n,
 			(uint8_t*)m_key.data());
-
-		assert(mlen - crypto_secretbox_BOXZEROBYTES == payload_size + MSG_PADDING_SIZE);
-		for (int i = 0; i < mlen-crypto_secretbox_BOXZEROBYTES; ++i) {
-			dest[i + PAYLOAD_OFFSET] = c[i + crypto_secretbox_BOXZEROBYTES];
-		}
 	}
 	return 0;
 }
 
+void
+Codec :: reset_nonce() {
+	randombytes(m_nonce_prefix, NONCE_PREFIX_SIZE);
+	m_nonce_counter = 0;
+}
+
+void
+Codec :: next_nonce(uint8_t* nonce) {
+	static_assert(NONCE_PREFIX_SIZE + 8 == NONCE_HASH_SIZE, "nonce size mismatch");
+	if (m_nonce_counter == UINT64_MAX) {
+		reset_nonce();
+	}
+	memcpy(nonce, m_nonce_prefix, NONCE_PREFIX_SIZE);
+	write64le(m_nonce_counter++, nonce + NONCE_PREFIX_SIZE);
+}
+
+std::shared_ptr<const Frame>
+Codec :: pack_frame(const Message* m) {
+	if (m->packed_size() > MAX_FRAME_SIZE) {
+		return nullptr;
+	}
+	auto frame = std::make_shared<Frame>(m->packed_size());
+	if (pack_message(m, frame->data(), frame->size()) < 0) {
+		return nullptr;
+	}
+	return frame;
+}
+
 int
 Codec :: decode_message_length(uint8_t* src, int src_len) {
 	if (src_len < 4) {
 		return -1;
 	}
 	uint32_t length = read32le(src);
+	if (length < MSG_HEADER_SIZE + MSG_PADDING_SIZE || length > MAX_FRAME_SIZE) {
+		return -2;
+	}
 	return (int)length;
 }
 
@@ -4,6 +4,7 @@
 #include <cstring>
 #include <cstdint>
 #include <string>
+#include <vector>
 #include <random>
 #include <chrono>
 
@@ -20,7 +21,11 @@ enum MESSAGE_TYPE : uint8_t
 	// Active leader
 	MSG_LEADER_ACTIVE,
 	// Active leader acknowledgement
-	MSG_LEADER_ACTIVE_ACK
+	MSG_LEADER_ACTIVE_ACK,
+	// Part of a snapshot for a lagging follower
+	MSG_SNAPSHOT_CHUNK,
+	// Snapshot chunk acknowledgement
+	MSG_SNAPSHOT_ACK
 };
 
 inline
@@ -34,6 +39,10 @@ const char* MSG_STR(uint8_t type) {
 		return "MSG_LEADER_ACTIVE";
 	case MSG_LEADER_ACTIVE_ACK:
 		return "MSG_LEADER_ACTIVE_ACK";
+	case MSG_SNAPSHOT_CHUNK:
+		return "MSG_SNAPSHOT_CHUNK";
+	case MSG_SNAPSHOT_ACK:
+		return "MSG_SNAPSHOT_ACK";
 	}
 
 	return "MSG_INVALID";
@@ -41,9 +50,25 @@ const char* MSG_STR(uint8_t type) {
 
 enum MESSAGE_FLAG
 {
-	// Unused
+	// LeaderActiveMessage carries a batch of appends
+	MSG_FLAG_BATCH = 1 << 0,
+	// The hash field holds a CRC32C instead of a SHA-512 prefix.
+	// Only used for unencrypted messages. Set by the Codec.
+	MSG_FLAG_CRC32C = 1 << 1,
+	// LeaderActiveMessage resends committed entries to a lagging
+	// follower. Missing rounds before next are no longer available.
+	MSG_FLAG_CATCH_UP = 1 << 2,
+	// SnapshotChunk ends its snapshot. On a SnapshotAck, the
+	// snapshot was installed.
+	MSG_FLAG_SNAPSHOT_END = 1 << 3,
+	// SnapshotAck: the follower could not take the snapshot.
+	MSG_FLAG_SNAPSHOT_FAILED = 1 << 4
 };
 
+// Largest frame a node sends or accepts, so a peer can't make it buffer
+// an arbitrary amount of data with a length prefix.
+const int MAX_FRAME_SIZE = 64*1024*1024;
+
 // Initialize RNG
 static std::mt19937_64 rng(
 	std::chrono::system_clock::now().time_since_epoch().count());
@@ -242,9 +267,30 @@ public:
 	{
 	}
 
+	// Batched append. The entries are assigned consecutive rounds
+	// starting at next.
+	LeaderActiveMessage(uint64_t id, uint64_t seq, uint64_t round,
+		uint64_t next, std::vector<std::string> next_batch)
+	: Message(MSG_LEADER_ACTIVE, MSG_FLAG_BATCH)
+	, id(id)
+	, seq(seq)
+	, round(round)
+	, next(next)
+	, next_content("")
+	, next_batch(next_batch)
+	{
+	}
+
 	inline int
 	body_size() const
 	{
+		if (flags & MSG_FLAG_BATCH) {
+			int size = 8+8+8+8+4;
+			for (auto& entry : next_batch) {
+				size += 4+entry.size();
+			}
+			return size;
+		}
 		return 8+8+8+8+4+next_content.size();
 	}
 
@@ -262,6 +308,17 @@ public:
 		dest += 8;
 		write64le(next, dest);
 		dest += 8;
+		if (flags & MSG_FLAG_BATCH) {
+			write32le(next_batch.size(), dest);
+			dest += 4;
+			for (auto& entry : next_batch) {
+				write32le(entry.size(), dest);
+				dest += 4;
+				memcpy(dest, entry.c_str(), entry.size());
+				dest += entry.size();
+			}
+			return 0;
+		}
 		write32le(next_content.size(), dest);
 		dest += 4;
 		memcpy(dest, next_content.c_str(), next_content.size());
@@ -271,7 +328,7 @@ public:
 	inline int
 	unpack_body(uint8_t* src, int src_len)
 	{
-		if (src_len < body_size()) {
+		if (src_len < 8+8+8+8+4) {
 			return -1;
 		}
 		id = read64le(src);
@@ -282,21 +339,68 @@ public:
 		src += 8;
 		next = read64le(src);
 		src += 8;
+		src_len -= 8+8+8+8;
+		if (flags & MSG_FLAG_BATCH) {
+			uint32_t count = read32le(src);
+			src += 4;
+			src_len -= 4;
+			next_batch.clear();
+			for (uint32_t i = 0; i < count; i++) {
+				if (src_len < 4) {
+					return -2;
+				}
+				uint32_t entry_size = read32le(src);
+				src += 4;
+				src_len -= 4;
+				if ((uint32_t)src_len < entry_size) {
+					return -2;
+				}
+				next_batch.emplace_back((const char*)src, entry_size);
+				src += entry_size;
+				src_len -= entry_size;
+			}
+			return 0;
+		}
 		uint32_t next_content_size = read32le(src);
 		src += 4;
-		if (src_len < 8+8+8+8+4 + next_content_size) {
+		src_len -= 4;
+		if ((uint32_t)src_len < next_content_size) {
 			return -2;
 		}
 		next_content = std::string((const char*)src, next_content_size);
 		return 0;
 	}
 
+	// entries returns the number of appends carried by the message.
+	inline size_t
+	entries() const
+	{
+		if (next == 0) {
+			return 0;
+		}
+		if (flags & MSG_FLAG_BATCH) {
+			return next_batch.size();
+		}
+		return 1;
+	}
+
+	// entry returns the content of the i-th append.
+	inline const std::string&
+	entry(size_t i) const
+	{
+		if (flags & MSG_FLAG_BATCH) {
+			return next_batch[i];
+		}
+		return next_content;
+	}
+
 public:
-	uint64_t    id;
-	uint64_t    seq;
-	uint64_t    round;
-	uint64_t    next;
-	std::string next_content;
+	uint64_t                 id;
+	uint64_t                 seq;
+	uint64_t                 round;
+	uint64_t                 next;
+	std::string              next_content;
+	std::vector<std::string> next_batch;
 };
 
 class LeaderActiveAck : public Message
@@ -307,21 +411,28 @@ public:
 	, id(0)
 	, seq(0)
 	, round(0)
+	, received(0)
 	{
 	}
 
 	LeaderActiveAck(uint64_t id, uint64_t seq, uint64_t round)
+	: LeaderActiveAck(id, seq, round, round)
+	{
+	}
+
+	LeaderActiveAck(uint64_t id, uint64_t seq, uint64_t round, uint64_t received)
 	: Message(MSG_LEADER_ACTIVE_ACK)
 	, id(id)
 	, seq(seq)
 	, round(round)
+	, received(received)
 	{
 	}
 
 	inline int
 	body_size() const
 	{
-		return 8+8+8;
+		return 8+8+8+8;
 	}
 
 	inline int
@@ -335,6 +446,8 @@ public:
 		write64le(seq, dest);
 		dest += 8;
 		write64le(round, dest);
+		dest += 8;
+		write64le(received, dest);
 		return 0;
 	}
 
@@ -349,6 +462,8 @@ public:
 		seq = read64le(src);
 		src += 8;
 		round = read64le(src);
+		src += 8;
+		received = read64le(src);
 		return 0;
 	}
 
@@ -356,4 +471,141 @@ public:
 	uint64_t id;
 	uint64_t seq;
 	uint64_t round;
+	// Last round the follower received with every round before it.
+	uint64_t received;
+};
+
+class SnapshotChunk : public Message
+{
+public:
+	SnapshotChunk()
+	: Message(MSG_SNAPSHOT_CHUNK)
+	, id(0)
+	, round(0)
+	, offset(0)
+	{
+	}
+
+	SnapshotChunk(uint64_t id, uint64_t round, uint64_t offset, std::string data)
+	: Message(MSG_SNAPSHOT_CHUNK)
+	, id(id)
+	, round(round)
+	, offset(offset)
+	, data(std::move(data))
+	{
+	}
+
+	inline int
+	body_size() const
+	{
+		return 8+8+8+4+data.size();
+	}
+
+	inline int
+	pack_body(uint8_t* dest, int dest_len) const
+	{
+		if (dest_len < body_size()) {
+			return -1;
+		}
+		write64le(id, dest);
+		dest += 8;
+		write64le(round, dest);
+		dest += 8;
+		write64le(offset, dest);
+		dest += 8;
+		write32le(data.size(), dest);
+		dest += 4;
+		memcpy(dest, data.c_str(), data.size());
+		return 0;
+	}
+
+	inline int
+	unpack_body(uint8_t* src, int src_len)
+	{
+		if (src_len < 8+8+8+4) {
+			return -1;
+		}
+		id = read64le(src);
+		src += 8;
+		round = read64le(src);
+		src += 8;
+		offset = read64le(src);
+		src += 8;
+		uint32_t data_size = read32le(src);
+		src += 4;
+		// In 64 bits, so a huge size can't wrap around.
+		if ((uint64_t)data_size > (uint64_t)(src_len - (8+8+8+4))) {
+			return -2;
+		}
+		data = std::string((const char*)src, data_size);
+		return 0;
+	}
+
+public:
+	uint64_t    id;
+	// Last round the snapshot includes.
+	uint64_t    round;
+	// Position of data in the snapshot.
+	uint64_t    offset;
+	std::string data;
+};
+
+class SnapshotAck : public Message
+{
+public:
+	SnapshotAck()
+	: Message(MSG_SNAPSHOT_ACK)
+	, id(0)
+	, round(0)
+	, offset(0)
+	{
+	}
+
+	SnapshotAck(uint64_t id, uint64_t round, uint64_t offset)
+	: Message(MSG_SNAPSHOT_ACK)
+	, id(id)
+	, round(round)
+	, offset(offset)
+	{
+	}
+
+	inline int
+	body_size() const
+	{
+		return 8+8+8;
+	}
+
+	inline int
+	pack_body(uint8_t* dest, int dest_len) const
+	{
+		if (dest_len < body_size()) {
+			return -1;
+		}
+		write64le(id, dest);
+		dest += 8;
+		write64le(round, dest);
+		dest += 8;
+		write64le(offset, dest);
+		return 0;
+	}
+
+	inline int
+	unpack_body(uint8_t* src, int src_len)
+	{
+		if (src_len < body_size()) {
+			return -1;
+		}
+		id = read64le(src);
+		src += 8;
+		round = read64le(src);
+		src += 8;
+		offset = read64le(src);
+		return 0;
+	}
+
+public:
+	uint64_t id;
+	uint64_t round;
+	// Bytes of the snapshot received so far.
+	uint64_t offset;
 };
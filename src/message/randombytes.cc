@@ -1,12 +1,27 @@
+#include <mutex>
+#include <algorithm>
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #include "randombytes.h"
 
-static FILE* dev_urandom;
+namespace {
 
-void randombytes(unsigned char* buf, unsigned int len) {
+// Fallback for systems without getrandom.
+std::mutex dev_urandom_lock;
+FILE* dev_urandom;
+
+void
+read_dev_urandom(unsigned char* buf, size_t len) {
+	std::lock_guard<std::mutex> lock(dev_urandom_lock);
 	if (dev_urandom == nullptr) {
 		dev_urandom = fopen("/dev/urandom", "r");
 		if (dev_urandom == nullptr) {
@@ -14,13 +29,70 @@ void randombytes(unsigned char* buf, unsigned int len) {
 			exit(1);
 		}
 	}
-	unsigned int remaining = len;
-	while (remaining > 0) {
-		size_t read = fread(buf + (len-remaining), remaining, 1, dev_urandom);
-		if (read == 0) {
-			std::cerr << "libab: failed to read from /dev/urandom" << std::endl;
-			exit(2);
+	if (fread(buf, 1, len, dev_urandom) != len) {
+		std::cerr << "libab: failed to read from /dev/urandom" << std::endl;
+		exit(2);
+	}
+}
+
+// fill_random fills buf from the kernel's CSPRNG.
+void
+fill_random(unsigned char* buf, size_t len) {
+#if defined(__linux__) && defined(SYS_getrandom)
+	while (len > 0) {
+		long n = syscall(SYS_getrandom, buf, len, 0);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			// ENOSYS on old kernels.
+			break;
+		}
+		buf += n;
+		len -= n;
+	}
+	if (len == 0) {
+		return;
+	}
+#endif
+	read_dev_urandom(buf, len);
+}
+
+const size_t POOL_SIZE = 256;
+
+// Each thread draws from its own pool, so small reads don't need a
+// syscall or a lock. Used bytes are wiped.
+struct Pool
+{
+	unsigned char data[POOL_SIZE];
+	size_t        available = 0;
+
+	~Pool()
+	{
+		memset(data, 0, sizeof(data));
+	}
+};
+
+thread_local Pool pool;
+
+} // namespace
+
+void randombytes(unsigned char* buf, unsigned int len) {
+	if (len > POOL_SIZE) {
+		fill_random(buf, len);
+		return;
+	}
+	while (len > 0) {
+		if (pool.available == 0) {
+			fill_random(pool.data, POOL_SIZE);
+			pool.available = POOL_SIZE;
 		}
-		remaining -= read;
+		size_t n = std::min<size_t>(len, pool.available);
+		unsigned char* src = pool.data + POOL_SIZE - pool.available;
+		memcpy(buf, src, n);
+		memset(src, 0, n);
+		pool.available -= n;
+		buf += n;
+		len -= n;
 	}
 }
@@ -4,6 +4,8 @@
 extern "C" {
 #endif
 
+// randombytes fills buf with cryptographically secure random bytes.
+// It is safe to call from any thread.
 void randombytes(unsigned char* buf, unsigned int len);
 
 #ifdef __cplusplus
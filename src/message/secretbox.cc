@@ -0,0 +1,541 @@
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SECRETBOX_X86
+#endif
+
+#ifndef __SIZEOF_INT128__
+#include <tweetnacl/tweetnacl.h>
+#endif
+
+#include "encoding.h"
+#include "secretbox.h"
+
+/**
+ * XSalsa20-Poly1305 with three Salsa20 backends:
+ * - scalar: one block at a time
+ * - sse2: four blocks at a time
+ * - avx2: eight blocks at a time
+ * Poly1305 uses 44-bit limbs with 128-bit products.
+ */
+
+namespace {
+
+enum BACKEND
+{
+	BACKEND_SCALAR,
+	BACKEND_SSE2,
+	BACKEND_AVX2
+};
+
+int
+detect_backend() {
+#ifdef SECRETBOX_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return BACKEND_AVX2;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		return BACKEND_SSE2;
+	}
+#endif
+	return BACKEND_SCALAR;
+}
+
+int
+backend() {
+	static const int b = detect_backend();
+	return b;
+}
+
+const uint32_t SIGMA[4] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+
+inline uint32_t
+rotl32(uint32_t x, int n) {
+	return (x << n) | (x >> (32 - n));
+}
+
+#define SALSA20_QR(a, b, c, d) \
+	b ^= rotl32(a + d, 7);    \
+	c ^= rotl32(b + a, 9);    \
+	d ^= rotl32(c + b, 13);   \
+	a ^= rotl32(d + c, 18);
+
+void
+salsa20_rounds(uint32_t x[16]) {
+	for (int i = 0; i < 10; i++) {
+		// Columns
+		SALSA20_QR(x[0], x[4], x[8], x[12]);
+		SALSA20_QR(x[5], x[9], x[13], x[1]);
+		SALSA20_QR(x[10], x[14], x[2], x[6]);
+		SALSA20_QR(x[15], x[3], x[7], x[11]);
+		// Rows
+		SALSA20_QR(x[0], x[1], x[2], x[3]);
+		SALSA20_QR(x[5], x[6], x[7], x[4]);
+		SALSA20_QR(x[10], x[11], x[8], x[9]);
+		SALSA20_QR(x[15], x[12], x[13], x[14]);
+	}
+}
+
+// Initializes the Salsa20 input words. n is 8 bytes for Salsa20
+// and 16 bytes for HSalsa20 (the counter words are overwritten).
+void
+salsa20_init(uint32_t x[16], const uint8_t* k, const uint8_t* n, int n_len, uint64_t counter) {
+	x[0] = SIGMA[0];
+	x[1] = read32le((uint8_t*)k);
+	x[2] = read32le((uint8_t*)k+4);
+	x[3] = read32le((uint8_t*)k+8);
+	x[4] = read32le((uint8_t*)k+12);
+	x[5] = SIGMA[1];
+	x[6] = read32le((uint8_t*)n);
+	x[7] = read32le((uint8_t*)n+4);
+	if (n_len == 16) {
+		x[8] = read32le((uint8_t*)n+8);
+		x[9] = read32le((uint8_t*)n+12);
+	} else {
+		x[8] = (uint32_t)counter;
+		x[9] = (uint32_t)(counter >> 32);
+	}
+	x[10] = SIGMA[2];
+	x[11] = read32le((uint8_t*)k+16);
+	x[12] = read32le((uint8_t*)k+20);
+	x[13] = read32le((uint8_t*)k+24);
+	x[14] = read32le((uint8_t*)k+28);
+	x[15] = SIGMA[3];
+}
+
+inline void
+increment_counter(uint32_t input[16], uint32_t n) {
+	uint32_t lo = input[8] + n;
+	if (lo < input[8]) {
+		input[9]++;
+	}
+	input[8] = lo;
+}
+
+void
+hsalsa20(uint8_t out[32], const uint8_t n[16], const uint8_t k[32]) {
+	uint32_t x[16];
+	salsa20_init(x, k, n, 16, 0);
+	salsa20_rounds(x);
+	write32le(x[0], out);
+	write32le(x[5], out+4);
+	write32le(x[10], out+8);
+	write32le(x[15], out+12);
+	write32le(x[6], out+16);
+	write32le(x[7], out+20);
+	write32le(x[8], out+24);
+	write32le(x[9], out+28);
+}
+
+void
+salsa20_block(uint8_t out[64], uint32_t input[16]) {
+	uint32_t x[16];
+	memcpy(x, input, sizeof(x));
+	salsa20_rounds(x);
+	for (int i = 0; i < 16; i++) {
+		write32le(x[i] + input[i], out + 4*i);
+	}
+	increment_counter(input, 1);
+}
+
+void
+salsa20_xor_scalar(uint8_t* out, const uint8_t* in, uint64_t len, uint32_t input[16]) {
+	uint8_t block[64];
+	while (len >= 64) {
+		salsa20_block(block, input);
+		for (int i = 0; i < 64; i += 4) {
+			write32le(read32le((uint8_t*)in+i) ^ read32le(block+i), out+i);
+		}
+		out += 64;
+		in += 64;
+		len -= 64;
+	}
+	if (len > 0) {
+		salsa20_block(block, input);
+		for (uint64_t i = 0; i < len; i++) {
+			out[i] = in[i] ^ block[i];
+		}
+	}
+	memset(block, 0, sizeof(block));
+}
+
+#ifdef SECRETBOX_X86
+
+#define SSE2_ROTL(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32-(n)))
+
+#define SSE2_QR(a, b, c, d)                                   \
+	b = _mm_xor_si128(b, SSE2_ROTL(_mm_add_epi32(a, d), 7));  \
+	c = _mm_xor_si128(c, SSE2_ROTL(_mm_add_epi32(b, a), 9));  \
+	d = _mm_xor_si128(d, SSE2_ROTL(_mm_add_epi32(c, b), 13)); \
+	a = _mm_xor_si128(a, SSE2_ROTL(_mm_add_epi32(d, c), 18));
+
+// Processes four blocks at a time and returns the number of bytes processed.
+// All input of a step is loaded before its output is stored, so out may
+// precede in.
+__attribute__((target("sse2")))
+uint64_t
+salsa20_xor_sse2(uint8_t* out, const uint8_t* in, uint64_t len, uint32_t input[16]) {
+	uint64_t done = 0;
+	while (len - done >= 256 && input[8] <= 0xffffffff - 4) {
+		__m128i x[16];
+		__m128i orig[16];
+		for (int i = 0; i < 16; i++) {
+			x[i] = _mm_set1_epi32(input[i]);
+		}
+		x[8] = _mm_add_epi32(x[8], _mm_set_epi32(3, 2, 1, 0));
+		for (int i = 0; i < 16; i++) {
+			orig[i] = x[i];
+		}
+		for (int i = 0; i < 10; i++) {
+			SSE2_QR(x[0], x[4], x[8], x[12]);
+			SSE2_QR(x[5], x[9], x[13], x[1]);
+			SSE2_QR(x[10], x[14], x[2], x[6]);
+			SSE2_QR(x[15], x[3], x[7], x[11]);
+			SSE2_QR(x[0], x[1], x[2], x[3]);
+			SSE2_QR(x[5], x[6], x[7], x[4]);
+			SSE2_QR(x[10], x[11], x[8], x[9]);
+			SSE2_QR(x[15], x[12], x[13], x[14]);
+		}
+		// Transpose so that ks[block*4 + group] holds 16 keystream bytes.
+		__m128i ks[16];
+		for (int g = 0; g < 4; g++) {
+			__m128i a = _mm_add_epi32(x[4*g], orig[4*g]);
+			__m128i b = _mm_add_epi32(x[4*g+1], orig[4*g+1]);
+			__m128i c = _mm_add_epi32(x[4*g+2], orig[4*g+2]);
+			__m128i d = _mm_add_epi32(x[4*g+3], orig[4*g+3]);
+			__m128i t0 = _mm_unpacklo_epi32(a, b);
+			__m128i t1 = _mm_unpacklo_epi32(c, d);
+			__m128i t2 = _mm_unpackhi_epi32(a, b);
+			__m128i t3 = _mm_unpackhi_epi32(c, d);
+			ks[0*4 + g] = _mm_unpacklo_epi64(t0, t1);
+			ks[1*4 + g] = _mm_unpackhi_epi64(t0, t1);
+			ks[2*4 + g] = _mm_unpacklo_epi64(t2, t3);
+			ks[3*4 + g] = _mm_unpackhi_epi64(t2, t3);
+		}
+		for (int i = 0; i < 16; i++) {
+			ks[i] = _mm_xor_si128(ks[i], _mm_loadu_si128((const __m128i*)(in + done + 16*i)));
+		}
+		for (int i = 0; i < 16; i++) {
+			_mm_storeu_si128((__m128i*)(out + done + 16*i), ks[i]);
+		}
+		increment_counter(input, 4);
+		done += 256;
+	}
+	return done;
+}
+
+#define AVX2_ROTL(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32-(n)))
+
+#define AVX2_QR(a, b, c, d)                                         \
+	b = _mm256_xor_si256(b, AVX2_ROTL(_mm256_add_epi32(a, d), 7));  \
+	c = _mm256_xor_si256(c, AVX2_ROTL(_mm256_add_epi32(b, a), 9));  \
+	d = _mm256_xor_si256(d, AVX2_ROTL(_mm256_add_epi32(c, b), 13)); \
+	a = _mm256_xor_si256(a, AVX2_ROTL(_mm256_add_epi32(d, c), 18));
+
+// Processes eight blocks at a time and returns the number of bytes processed.
+// Same aliasing rules as salsa20_xor_sse2.
+__attribute__((target("avx2")))
+uint64_t
+salsa20_xor_avx2(uint8_t* out, const uint8_t* in, uint64_t len, uint32_t input[16]) {
+	uint64_t done = 0;
+	while (len - done >= 512 && input[8] <= 0xffffffff - 8) {
+		__m256i x[16];
+		__m256i orig[16];
+		for (int i = 0; i < 16; i++) {
+			x[i] = _mm256_set1_epi32(input[i]);
+		}
+		x[8] = _mm256_add_epi32(x[8], _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+		for (int i = 0; i < 16; i++) {
+			orig[i] = x[i];
+		}
+		for (int i = 0; i < 10; i++) {
+			AVX2_QR(x[0], x[4], x[8], x[12]);
+			AVX2_QR(x[5], x[9], x[13], x[1]);
+			AVX2_QR(x[10], x[14], x[2], x[6]);
+			AVX2_QR(x[15], x[3], x[7], x[11]);
+			AVX2_QR(x[0], x[1], x[2], x[3]);
+			AVX2_QR(x[5], x[6], x[7], x[4]);
+			AVX2_QR(x[10], x[11], x[8], x[9]);
+			AVX2_QR(x[15], x[12], x[13], x[14]);
+		}
+		// Transpose within 128-bit lanes. r[g*4 + b] holds words 4g..4g+3
+		// of block b in the low lane and of block b+4 in the high lane.
+		__m256i r[16];
+		for (int g = 0; g < 4; g++) {
+			__m256i a = _mm256_add_epi32(x[4*g], orig[4*g]);
+			__m256i b = _mm256_add_epi32(x[4*g+1], orig[4*g+1]);
+			__m256i c = _mm256_add_epi32(x[4*g+2], orig[4*g+2]);
+			__m256i d = _mm256_add_epi32(x[4*g+3], orig[4*g+3]);
+			__m256i t0 = _mm256_unpacklo_epi32(a, b);
+			__m256i t1 = _mm256_unpacklo_epi32(c, d);
+			__m256i t2 = _mm256_unpackhi_epi32(a, b);
+			__m256i t3 = _mm256_unpackhi_epi32(c, d);
+			r[g*4 + 0] = _mm256_unpacklo_epi64(t0, t1);
+			r[g*4 + 1] = _mm256_unpackhi_epi64(t0, t1);
+			r[g*4 + 2] = _mm256_unpacklo_epi64(t2, t3);
+			r[g*4 + 3] = _mm256_unpackhi_epi64(t2, t3);
+		}
+		// ks[block*2 + half] holds 32 keystream bytes.
+		__m256i ks[16];
+		for (int b = 0; b < 4; b++) {
+			ks[b*2 + 0] = _mm256_permute2x128_si256(r[0*4 + b], r[1*4 + b], 0x20);
+			ks[b*2 + 1] = _mm256_permute2x128_si256(r[2*4 + b], r[3*4 + b], 0x20);
+			ks[(b+4)*2 + 0] = _mm256_permute2x128_si256(r[0*4 + b], r[1*4 + b], 0x31);
+			ks[(b+4)*2 + 1] = _mm256_permute2x128_si256(r[2*4 + b], r[3*4 + b], 0x31);
+		}
+		for (int i = 0; i < 16; i++) {
+			ks[i] = _mm256_xor_si256(ks[i],
+				_mm256_loadu_si256((const __m256i*)(in + done + 32*i)));
+		}
+		for (int i = 0; i < 16; i++) {
+			_mm256_storeu_si256((__m256i*)(out + done + 32*i), ks[i]);
+		}
+		increment_counter(input, 8);
+		done += 512;
+	}
+	return done;
+}
+
+#endif // SECRETBOX_X86
+
+void
+salsa20_xor(uint8_t* out, const uint8_t* in, uint64_t len, uint32_t input[16]) {
+	uint64_t done = 0;
+#ifdef SECRETBOX_X86
+	if (backend() == BACKEND_AVX2) {
+		done += salsa20_xor_avx2(out, in, len, input);
+	}
+	if (backend() >= BACKEND_SSE2) {
+		done += salsa20_xor_sse2(out + done, in + done, len - done, input);
+	}
+#endif
+	salsa20_xor_scalar(out + done, in + done, len - done, input);
+}
+
+#ifdef __SIZEOF_INT128__
+
+typedef unsigned __int128 uint128_t;
+
+const uint64_t MASK44 = 0xfffffffffff;
+const uint64_t MASK42 = 0x3ffffffffff;
+
+void
+poly1305_blocks(uint64_t h[3], const uint64_t r[3], const uint8_t* m, uint64_t len,
+	uint64_t hibit) {
+	uint64_t s1 = r[1] * (5 << 2);
+	uint64_t s2 = r[2] * (5 << 2);
+	uint64_t h0 = h[0], h1 = h[1], h2 = h[2];
+	while (len >= 16) {
+		uint64_t t0 = read64le((uint8_t*)m);
+		uint64_t t1 = read64le((uint8_t*)m+8);
+		h0 += t0 & MASK44;
+		h1 += ((t0 >> 44) | (t1 << 20)) & MASK44;
+		h2 += ((t1 >> 24) & MASK42) | hibit;
+
+		uint128_t d0 = (uint128_t)h0*r[0] + (uint128_t)h1*s2 + (uint128_t)h2*s1;
+		uint128_t d1 = (uint128_t)h0*r[1] + (uint128_t)h1*r[0] + (uint128_t)h2*s2;
+		uint128_t d2 = (uint128_t)h0*r[2] + (uint128_t)h1*r[1] + (uint128_t)h2*r[0];
+
+		uint64_t c = (uint64_t)(d0 >> 44);
+		h0 = (uint64_t)d0 & MASK44;
+		d1 += c;
+		c = (uint64_t)(d1 >> 44);
+		h1 = (uint64_t)d1 & MASK44;
+		d2 += c;
+		c = (uint64_t)(d2 >> 42);
+		h2 = (uint64_t)d2 & MASK42;
+		h0 += c * 5;
+		c = h0 >> 44;
+		h0 &= MASK44;
+		h1 += c;
+
+		m += 16;
+		len -= 16;
+	}
+	h[0] = h0;
+	h[1] = h1;
+	h[2] = h2;
+}
+
+void
+poly1305(uint8_t mac[16], const uint8_t* m, uint64_t len, const uint8_t key[32]) {
+	uint64_t t0 = read64le((uint8_t*)key);
+	uint64_t t1 = read64le((uint8_t*)key+8);
+	uint64_t r[3] = {
+		t0 & 0xffc0fffffff,
+		((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffff,
+		(t1 >> 24) & 0x00ffffffc0f
+	};
+	uint64_t h[3] = {0, 0, 0};
+
+	uint64_t full = len & ~(uint64_t)15;
+	poly1305_blocks(h, r, m, full, (uint64_t)1 << 40);
+	if (len > full) {
+		uint8_t last[16] = {0};
+		memcpy(last, m + full, len - full);
+		last[len - full] = 1;
+		poly1305_blocks(h, r, last, 16, 0);
+	}
+
+	// Fully carry h.
+	uint64_t h0 = h[0], h1 = h[1], h2 = h[2];
+	uint64_t c = h1 >> 44;
+	h1 &= MASK44;
+	h2 += c;
+	c = h2 >> 42;
+	h2 &= MASK42;
+	h0 += c * 5;
+	c = h0 >> 44;
+	h0 &= MASK44;
+	h1 += c;
+	c = h1 >> 44;
+	h1 &= MASK44;
+	h2 += c;
+	c = h2 >> 42;
+	h2 &= MASK42;
+	h0 += c * 5;
+	c = h0 >> 44;
+	h0 &= MASK44;
+	h1 += c;
+
+	// Compute h - p and select it if h >= p.
+	uint64_t g0 = h0 + 5;
+	c = g0 >> 44;
+	g0 &= MASK44;
+	uint64_t g1 = h1 + c;
+	c = g1 >> 44;
+	g1 &= MASK44;
+	uint64_t g2 = h2 + c - ((uint64_t)1 << 42);
+	c = (g2 >> 63) - 1;
+	g0 &= c;
+	g1 &= c;
+	g2 &= c;
+	c = ~c;
+	h0 = (h0 & c) | g0;
+	h1 = (h1 & c) | g1;
+	h2 = (h2 & c) | g2;
+
+	// h += s
+	t0 = read64le((uint8_t*)key+16);
+	t1 = read64le((uint8_t*)key+24);
+	h0 += t0 & MASK44;
+	c = h0 >> 44;
+	h0 &= MASK44;
+	h1 += (((t0 >> 44) | (t1 << 20)) & MASK44) + c;
+	c = h1 >> 44;
+	h1 &= MASK44;
+	h2 += ((t1 >> 24) & MASK42) + c;
+	h2 &= MASK42;
+
+	write64le(h0 | (h1 << 44), mac);
+	write64le((h1 >> 20) | (h2 << 24), mac+8);
+}
+
+#else
+
+void
+poly1305(uint8_t mac[16], const uint8_t* m, uint64_t len, const uint8_t key[32]) {
+	crypto_onetimeauth(mac, m, len, key);
+}
+
+#endif // __SIZEOF_INT128__
+
+// Returns 0 if the MACs match, in constant time.
+int
+verify16(const uint8_t* a, const uint8_t* b) {
+	uint32_t diff = 0;
+	for (int i = 0; i < 16; i++) {
+		diff |= a[i] ^ b[i];
+	}
+	return (1 & ((diff - 1) >> 8)) - 1;
+}
+
+// Sets up the XSalsa20 stream and returns the first keystream block.
+// The first 32 bytes of the block are the Poly1305 key.
+void
+xsalsa20_setup(uint32_t input[16], uint8_t block0[64], const uint8_t* n, const uint8_t* k) {
+	uint8_t subkey[32];
+	hsalsa20(subkey, n, k);
+	salsa20_init(input, subkey, n+16, 8, 0);
+	salsa20_block(block0, input);
+	memset(subkey, 0, sizeof(subkey));
+}
+
+// Encrypts or decrypts with the keystream after the Poly1305 key.
+void
+xsalsa20_xor(uint8_t* out, const uint8_t* in, uint64_t len, uint32_t input[16],
+	const uint8_t block0[64]) {
+	uint64_t head = len < 32 ? len : 32;
+	for (uint64_t i = 0; i < head; i++) {
+		out[i] = in[i] ^ block0[32+i];
+	}
+	salsa20_xor(out + head, in + head, len - head, input);
+}
+
+} // namespace
+
+void
+secretbox_detached(uint8_t* out, uint8_t* mac, const uint8_t* in, uint64_t len,
+	const uint8_t* n, const uint8_t* k) {
+	uint32_t input[16];
+	uint8_t block0[64];
+	xsalsa20_setup(input, block0, n, k);
+	xsalsa20_xor(out, in, len, input, block0);
+	poly1305(mac, out, len, block0);
+	memset(block0, 0, sizeof(block0));
+	memset(input, 0, sizeof(input));
+}
+
+int
+secretbox_open_detached(uint8_t* out, const uint8_t* in, const uint8_t* mac, uint64_t len,
+	const uint8_t* n, const uint8_t* k) {
+	uint32_t input[16];
+	uint8_t block0[64];
+	uint8_t computed[16];
+	xsalsa20_setup(input, block0, n, k);
+	poly1305(computed, in, len, block0);
+	int status = verify16(computed, mac);
+	if (status == 0) {
+		xsalsa20_xor(out, in, len, input, block0);
+	}
+	memset(block0, 0, sizeof(block0));
+	memset(input, 0, sizeof(input));
+	return status;
+}
+
+int
+secretbox(uint8_t* c, const uint8_t* m, uint64_t mlen, const uint8_t* n, const uint8_t* k) {
+	if (mlen < SECRETBOX_ZEROBYTES) {
+		return -1;
+	}
+	secretbox_detached(c + SECRETBOX_ZEROBYTES, c + SECRETBOX_BOXZEROBYTES,
+		m + SECRETBOX_ZEROBYTES, mlen - SECRETBOX_ZEROBYTES, n, k);
+	memset(c, 0, SECRETBOX_BOXZEROBYTES);
+	return 0;
+}
+
+int
+secretbox_open(uint8_t* m, const uint8_t* c, uint64_t clen, const uint8_t* n, const uint8_t* k) {
+	if (clen < SECRETBOX_ZEROBYTES) {
+		return -1;
+	}
+	if (secretbox_open_detached(m + SECRETBOX_ZEROBYTES, c + SECRETBOX_ZEROBYTES,
+		c + SECRETBOX_BOXZEROBYTES, clen - SECRETBOX_ZEROBYTES, n, k) < 0) {
+		return -1;
+	}
+	memset(m, 0, SECRETBOX_ZEROBYTES);
+	return 0;
+}
+
+const char*
+secretbox_backend(void) {
+	switch (backend()) {
+	case BACKEND_AVX2:
+		return "avx2";
+	case BACKEND_SSE2:
+		return "sse2";
+	}
+	return "scalar";
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// XSalsa20-Poly1305 secretbox, compatible with NaCl's crypto_secretbox.
+// The fastest implementation supported by the CPU is selected at runtime.
+
+#define SECRETBOX_KEYBYTES 32
+#define SECRETBOX_NONCEBYTES 24
+#define SECRETBOX_MACBYTES 16
+#define SECRETBOX_ZEROBYTES 32
+#define SECRETBOX_BOXZEROBYTES 16
+
+// secretbox and secretbox_open follow the NaCl zero-padding convention:
+// the first SECRETBOX_ZEROBYTES of m and SECRETBOX_BOXZEROBYTES of c are zero.
+int secretbox(uint8_t* c, const uint8_t* m, uint64_t mlen,
+	const uint8_t* n, const uint8_t* k);
+int secretbox_open(uint8_t* m, const uint8_t* c, uint64_t clen,
+	const uint8_t* n, const uint8_t* k);
+
+// The detached variants keep the MAC separate from the data.
+// out may be equal to in or precede it in the same buffer.
+void secretbox_detached(uint8_t* out, uint8_t* mac, const uint8_t* in, uint64_t len,
+	const uint8_t* n, const uint8_t* k);
+int secretbox_open_detached(uint8_t* out, const uint8_t* in, const uint8_t* mac, uint64_t len,
+	const uint8_t* n, const uint8_t* k);
+
+// secretbox_backend returns the name of the selected implementation.
+const char* secretbox_backend(void);
+
+#ifdef __cplusplus
+}
+#endif
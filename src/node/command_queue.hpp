@@ -0,0 +1,131 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <cstdint>
+
+#include "ab.h"
+
+// Content buffers up to this capacity stay with their slot for reuse.
+// Larger ones are released after their command is consumed.
+const size_t COMMAND_CONTENT_KEEP = 64*1024;
+
+enum COMMAND_TYPE : uint8_t
+{
+	// Node::append
+	CMD_APPEND,
+	// Node::confirm_append
+	CMD_CONFIRM_APPEND
+};
+
+struct Command
+{
+	COMMAND_TYPE type;
+	std::string  content;
+	ab_append_cb cb;
+	void*        data;
+	uint64_t     round;
+}; // Command
+
+// CommandQueue is a bounded, lock-free multi-producer single-consumer queue
+// of preallocated commands. Any thread may push; only the event loop thread
+// may consume. Slots are reused, so a command's content buffer is only
+// reallocated when it grows, up to COMMAND_CONTENT_KEEP.
+class CommandQueue
+{
+	struct Slot
+	{
+		std::atomic<size_t> seq;
+		Command             cmd;
+	};
+
+public:
+	// capacity is rounded up to a power of two.
+	CommandQueue(size_t capacity)
+	: m_mask(1)
+	, m_head(0)
+	, m_tail(0)
+	{
+		while (m_mask < capacity) {
+			m_mask <<= 1;
+		}
+		m_slots = std::unique_ptr<Slot[]>(new Slot[m_mask]);
+		for (size_t i = 0; i < m_mask; i++) {
+			m_slots[i].seq.store(i, std::memory_order_relaxed);
+		}
+		m_mask--;
+	}
+
+	// push enqueues a command. It returns false if the queue is full.
+	bool
+	push(COMMAND_TYPE type, const std::string& content, ab_append_cb cb, void* data,
+		uint64_t round)
+	{
+		size_t pos = m_tail.load(std::memory_order_relaxed);
+		Slot* slot;
+		while (true) {
+			slot = &m_slots[pos & m_mask];
+			size_t seq = slot->seq.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0) {
+				// Slot is free. Try to claim it.
+				if (m_tail.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (diff < 0) {
+				// Full.
+				return false;
+			} else {
+				// Another producer claimed it first.
+				pos = m_tail.load(std::memory_order_relaxed);
+			}
+		}
+		slot->cmd.type = type;
+		slot->cmd.content.assign(content);
+		slot->cmd.cb = cb;
+		slot->cmd.data = data;
+		slot->cmd.round = round;
+		slot->seq.store(pos+1, std::memory_order_release);
+		return true;
+	}
+
+	// consume calls f for up to max commands in FIFO order and returns
+	// the number of commands consumed. Commands are only valid during f.
+	template <typename F>
+	size_t
+	consume(size_t max, F f)
+	{
+		size_t n = 0;
+		while (n < max) {
+			Slot& slot = m_slots[m_head & m_mask];
+			size_t seq = slot.seq.load(std::memory_order_acquire);
+			if ((intptr_t)seq - (intptr_t)(m_head+1) < 0) {
+				// Empty.
+				break;
+			}
+			f(slot.cmd);
+			if (slot.cmd.content.capacity() > COMMAND_CONTENT_KEEP) {
+				// Don't hold on to a large append's buffer.
+				std::string().swap(slot.cmd.content);
+			}
+			slot.seq.store(m_head + m_mask + 1, std::memory_order_release);
+			m_head++;
+			n++;
+		}
+		return n;
+	}
+
+	size_t
+	capacity() const
+	{
+		return m_mask+1;
+	}
+
+private:
+	std::unique_ptr<Slot[]> m_slots;
+	size_t                  m_mask;
+	// Only touched by the consumer.
+	size_t                  m_head;
+	std::atomic<size_t>     m_tail;
+}; // CommandQueue
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+// Default suspicion level at which a leader is considered failed.
+// A phi of 8 means the chance that the leader is alive but late is 1e-8,
+// assuming normally distributed heartbeat intervals.
+const double DEFAULT_PHI_THRESHOLD = 8;
+
+// FailureDetector is a phi-accrual failure detector (Hayashibara et al.).
+// It learns the distribution of heartbeat inter-arrival times and turns
+// the time since the last heartbeat into a suspicion level, phi, instead
+// of a yes/no timeout. Intervals are modeled as a normal distribution
+// with the logistic approximation of its tail that Cassandra and Akka use.
+class FailureDetector
+{
+public:
+	// Number of recent intervals the distribution is estimated from.
+	static const int WINDOW = 128;
+	// Intervals needed before the estimate is trusted.
+	static const int MIN_SAMPLES = 8;
+
+	FailureDetector()
+	: m_threshold(-1)
+	, m_threshold_y(0)
+	{
+		reset();
+	}
+
+	void
+	reset()
+	{
+		m_last = 0;
+		m_count = 0;
+		m_next = 0;
+		m_sum = 0;
+		m_sum_sq = 0;
+	}
+
+	// heartbeat records that the monitored node was heard from at ts.
+	void
+	heartbeat(uint64_t ts)
+	{
+		if (m_last != 0 && ts > m_last) {
+			add_interval((double)(ts - m_last));
+		}
+		m_last = ts;
+	}
+
+	uint64_t
+	last() const
+	{
+		return m_last;
+	}
+
+	// ready reports whether enough intervals were seen to use phi.
+	bool
+	ready() const
+	{
+		return m_count >= MIN_SAMPLES;
+	}
+
+	double
+	mean() const
+	{
+		return m_count > 0 ? m_sum / m_count : 0;
+	}
+
+	double
+	stddev(double min_stddev) const
+	{
+		double variance = 0;
+		if (m_count > 0) {
+			double m = mean();
+			variance = std::max(0.0, m_sum_sq / m_count - m*m);
+		}
+		return std::max(std::sqrt(variance), min_stddev);
+	}
+
+	// phi returns the suspicion level at ts. The standard deviation is
+	// floored at min_stddev so a very regular sender isn't suspected the
+	// moment it's slightly late.
+	double
+	phi(uint64_t ts, double min_stddev) const
+	{
+		double elapsed = ts > m_last ? (double)(ts - m_last) : 0;
+		return phi_of((elapsed - mean()) / stddev(min_stddev));
+	}
+
+	// suspect_after returns how long after the last heartbeat phi reaches
+	// threshold. The detector must be ready.
+	uint64_t
+	suspect_after(double threshold, double min_stddev) const
+	{
+		if (threshold != m_threshold) {
+			m_threshold = threshold;
+			m_threshold_y = solve(threshold);
+		}
+		double after = mean() + m_threshold_y * stddev(min_stddev);
+		return after > 0 ? (uint64_t)std::ceil(after) : 0;
+	}
+
+private:
+	void
+	add_interval(double interval)
+	{
+		if (m_count == WINDOW) {
+			double old = m_intervals[m_next];
+			m_sum -= old;
+			m_sum_sq -= old*old;
+		} else {
+			m_count++;
+		}
+		m_intervals[m_next] = interval;
+		m_sum += interval;
+		m_sum_sq += interval*interval;
+		m_next = (m_next + 1) % WINDOW;
+		if (m_next == 0) {
+			// Recompute the sums once per window so rounding errors
+			// don't accumulate.
+			m_sum = 0;
+			m_sum_sq = 0;
+			for (int i = 0; i < m_count; i++) {
+				m_sum += m_intervals[i];
+				m_sum_sq += m_intervals[i]*m_intervals[i];
+			}
+		}
+	}
+
+	// phi_of returns phi for an interval y standard deviations above the
+	// mean.
+	static double
+	phi_of(double y)
+	{
+		double e = std::exp(-y * (1.5976 + 0.070566*y*y));
+		if (y > 0) {
+			return -std::log10(e / (1.0 + e));
+		}
+		return -std::log10(1.0 - 1.0/(1.0 + e));
+	}
+
+	// solve returns the y at which phi_of(y) reaches phi. phi_of is
+	// increasing, so bisect.
+	static double
+	solve(double phi)
+	{
+		double lo = -10, hi = 100;
+		for (int i = 0; i < 100; i++) {
+			double mid = (lo + hi) / 2;
+			if (phi_of(mid) < phi) {
+				lo = mid;
+			} else {
+				hi = mid;
+			}
+		}
+		return hi;
+	}
+
+private:
+	uint64_t m_last;
+	int      m_count;
+	int      m_next;
+	double   m_sum;
+	double   m_sum_sq;
+	double   m_intervals[WINDOW];
+	// The last threshold and its solution.
+	mutable double m_threshold;
+	mutable double m_threshold_y;
+}; // FailureDetector
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Histogram is a log-linear histogram of nanosecond durations, in the
+// style of HdrHistogram. Each power of two is split into 2^SUB_BITS
+// linear buckets, so recorded values keep a relative error below 1/32.
+// Values below 2^SUB_BITS are exact.
+//
+// Only one thread records, but any thread may read or reset. Buckets are
+// relaxed atomics, so a reset racing with record may drop or keep the
+// concurrent samples, and a read may see a partially applied record.
+class Histogram
+{
+public:
+	static const int SUB_BITS = 5;
+	static const int SUB_BUCKETS = 1 << SUB_BITS;
+	static const int BUCKETS = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+	Histogram()
+	{
+		reset();
+	}
+
+	static int
+	bucket_index(uint64_t v)
+	{
+		if (v < SUB_BUCKETS) {
+			return (int)v;
+		}
+		int msb = 63 - __builtin_clzll(v);
+		int group = msb - SUB_BITS + 1;
+		int sub = (int)((v >> (msb - SUB_BITS)) & (SUB_BUCKETS-1));
+		return group * SUB_BUCKETS + sub;
+	}
+
+	// bucket_upper returns the largest value that maps to bucket i.
+	static uint64_t
+	bucket_upper(int i)
+	{
+		int group = i / SUB_BUCKETS;
+		uint64_t sub = i % SUB_BUCKETS;
+		if (group == 0) {
+			return sub;
+		}
+		uint64_t lower = (SUB_BUCKETS + sub) << (group-1);
+		return lower + ((uint64_t)1 << (group-1)) - 1;
+	}
+
+	void
+	record(uint64_t v)
+	{
+		m_buckets[bucket_index(v)].fetch_add(1, std::memory_order_relaxed);
+		m_count.fetch_add(1, std::memory_order_relaxed);
+		m_sum.fetch_add(v, std::memory_order_relaxed);
+		if (v > m_max.load(std::memory_order_relaxed)) {
+			m_max.store(v, std::memory_order_relaxed);
+		}
+		if (v < m_min.load(std::memory_order_relaxed)) {
+			m_min.store(v, std::memory_order_relaxed);
+		}
+	}
+
+	void
+	reset()
+	{
+		for (int i = 0; i < BUCKETS; i++) {
+			m_buckets[i].store(0, std::memory_order_relaxed);
+		}
+		m_count.store(0, std::memory_order_relaxed);
+		m_sum.store(0, std::memory_order_relaxed);
+		m_max.store(0, std::memory_order_relaxed);
+		m_min.store(UINT64_MAX, std::memory_order_relaxed);
+	}
+
+	uint64_t
+	count() const
+	{
+		return m_count.load(std::memory_order_relaxed);
+	}
+
+	uint64_t
+	sum() const
+	{
+		return m_sum.load(std::memory_order_relaxed);
+	}
+
+	uint64_t
+	max() const
+	{
+		return m_max.load(std::memory_order_relaxed);
+	}
+
+	uint64_t
+	min() const
+	{
+		auto v = m_min.load(std::memory_order_relaxed);
+		return v == UINT64_MAX ? 0 : v;
+	}
+
+	// percentile returns the value at or below which p percent of the
+	// recorded values fall, rounded up to its bucket's upper bound and
+	// capped at the maximum. p is in [0, 100]. 0 is returned if the
+	// histogram is empty.
+	uint64_t
+	percentile(double p) const
+	{
+		// Sum the buckets instead of trusting m_count, which may be
+		// out of step with them while recording.
+		uint64_t total = 0;
+		for (int i = 0; i < BUCKETS; i++) {
+			total += m_buckets[i].load(std::memory_order_relaxed);
+		}
+		if (total == 0) {
+			return 0;
+		}
+		if (p < 0) {
+			p = 0;
+		} else if (p > 100) {
+			p = 100;
+		}
+		uint64_t rank = (uint64_t)(p / 100.0 * total + 0.5);
+		if (rank < 1) {
+			rank = 1;
+		}
+		uint64_t seen = 0;
+		for (int i = 0; i < BUCKETS; i++) {
+			seen += m_buckets[i].load(std::memory_order_relaxed);
+			if (seen >= rank) {
+				auto upper = bucket_upper(i);
+				auto highest = max();
+				return upper < highest ? upper : highest;
+			}
+		}
+		return max();
+	}
+
+private:
+	std::atomic<uint64_t> m_buckets[BUCKETS];
+	std::atomic<uint64_t> m_count;
+	std::atomic<uint64_t> m_sum;
+	std::atomic<uint64_t> m_max;
+	std::atomic<uint64_t> m_min;
+}; // Histogram
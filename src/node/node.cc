@@ -7,6 +7,17 @@ Node :: start(std::string address) {
 	if (uv_loop_init(m_uv_loop.get()) < 0) {
 		return -1;
 	}
+	m_wheel.advance(uv_now(m_uv_loop.get()));
+
+	// Set up the command queue wakeup handle.
+	if (uv_async_init(m_uv_loop.get(), &m_command_async, [](uv_async_t* handle) {
+		auto self = (Node*)handle->data;
+		self->process_commands();
+	}) < 0) {
+		return -1;
+	}
+	m_command_async.data = this;
+	m_started = true;
 
 	// Parse address string.
 	struct sockaddr_storage sockaddr;
@@ -44,7 +55,7 @@ Node :: connect_to_peer(cpl::net::SockAddr& addr) {
 	}
 
 	IdentityMessage ident_msg(m_id, m_listen_address);
-	auto peer = std::make_shared<Peer>(m_codec, [=](const Message* m) {
+	auto peer = std::make_shared<Peer>(m_codec, m_stats, m_wheel, [=](const Message* m) {
 		handle_message(m);
 	}, addr, std::move(handle), ident_msg);
 	m_peer_registry->register_peer(++m_index_counter, peer);
@@ -55,14 +66,30 @@ Node :: connect_to_peer(cpl::net::SockAddr& addr) {
 int
 Node :: run() {
 	std::lock_guard<std::mutex> lock(*m_mutex);
+	m_loop_thread = uv_thread_self();
+	m_running = true;
 	m_timer = std::make_unique<uv_timer_t>();
 	uv_timer_init(m_uv_loop.get(), m_timer.get());
 	m_timer->data = this;
-	uv_timer_start(m_timer.get(), [](uv_timer_t* timer) {
-		auto self = (Node*)timer->data;
-		self->periodic();
-	},
-	50, 50);
+
+	m_role_timer.set_callback([this]() {
+		periodic();
+	});
+	// Clean up closed peers and flush the frames queued by peers at
+	// the end of every loop iteration, right before the loop blocks for I/O, and sleep
+	// until the next deadline. Whatever ran in this iteration may
+	// have moved the role's deadline.
+	m_prepare = std::make_unique<uv_prepare_t>();
+	uv_prepare_init(m_uv_loop.get(), m_prepare.get());
+	m_prepare->data = this;
+	uv_prepare_start(m_prepare.get(), [](uv_prepare_t* prepare) {
+		auto self = (Node*)prepare->data;
+		self->sync_wal();
+		self->m_peer_registry->cleanup();
+		self->m_peer_registry->flush();
+		self->schedule_role_timer();
+		self->arm_timer();
+	});
 	return uv_run(m_uv_loop.get(), UV_RUN_DEFAULT);
 }
 
@@ -76,7 +103,7 @@ Node ::	on_connect(uv_stream_t* server, int status) {
 	uv_tcp_init(server->loop, client.get());
 	uv_accept(server, (uv_stream_t*)client.get());
 	IdentityMessage ident_msg(self->m_id, self->m_listen_address);
-	auto peer = std::make_shared<Peer>(self->m_codec, [=](const Message* m) {
+	auto peer = std::make_shared<Peer>(self->m_codec, self->m_stats, self->m_wheel, [=](const Message* m) {
 		self->handle_message(m);
 	}, std::move(client), ident_msg);
 	self->m_peer_registry->register_peer(++self->m_index_counter, peer);
@@ -85,10 +112,193 @@ Node ::	on_connect(uv_stream_t* server, int status) {
 
 void
 Node :: periodic() {
-	// Clean up the registry
-	m_peer_registry->cleanup();
 	uint64_t now = uv_hrtime();
 	m_role->periodic(now);
+	// Only a leader has followers to report. A former leader publishes
+	// once more to clear its stats.
+	if (m_role->state() == Leader || m_peer_stats_published) {
+		publish_peer_stats(now);
+	}
+	update_stats();
+}
+
+void
+Node :: schedule_role_timer() {
+	// The role keeps time in ns and the wheel in loop ms. Round up so
+	// the timer doesn't fire before the deadline.
+	uv_update_time(m_uv_loop.get());
+	uint64_t now = uv_hrtime();
+	uint64_t deadline = m_role->next_deadline();
+	uint64_t at = uv_now(m_uv_loop.get());
+	if (deadline > now) {
+		at += (deadline - now + 999999) / 1000000;
+	}
+	if (!m_role_timer.scheduled() || m_role_timer.deadline() != at) {
+		m_wheel.schedule(&m_role_timer, at);
+	}
+}
+
+void
+Node :: arm_timer() {
+	auto next = m_wheel.next_deadline();
+	if (next == m_timer_deadline) {
+		return;
+	}
+	m_timer_deadline = next;
+	if (next == UINT64_MAX) {
+		uv_timer_stop(m_timer.get());
+		return;
+	}
+	auto now = uv_now(m_uv_loop.get());
+	uv_timer_start(m_timer.get(), [](uv_timer_t* timer) {
+		auto self = (Node*)timer->data;
+		self->m_timer_deadline = UINT64_MAX;
+		self->m_wheel.advance(uv_now(self->m_uv_loop.get()));
+	}, next > now ? next - now : 0, 0);
+}
+
+const char*
+Node :: store(uint64_t round, const std::string& content) {
+	uint64_t record;
+	auto data = m_wal->append(round, content.data(), content.size(), record);
+	if (data == nullptr) {
+		// The round is never confirmed.
+		Stats::add(m_stats->wal_errors);
+		return nullptr;
+	}
+	// A new leader resends rounds from where the logs diverged. Records
+	// from the old leader for those rounds may still be unsynced, and
+	// must not confirm the new ones.
+	for (auto it = m_wal_unsynced.rbegin(); it != m_wal_unsynced.rend(); ++it) {
+		if (it->m_replaced) {
+			continue;
+		}
+		if (it->m_round < round) {
+			break;
+		}
+		it->m_replaced = true;
+	}
+	m_wal_unsynced.push_back(WalRecord{record, round, false});
+	Stats::add(m_stats->wal_records);
+	Stats::add(m_stats->wal_bytes, content.size());
+	return data;
+}
+
+void
+Node :: sync_wal() {
+	if (m_wal == nullptr || m_wal_syncing || !m_wal->pending()) {
+		return;
+	}
+	m_wal_syncing = true;
+	m_wal_work.data = this;
+	uv_queue_work(m_uv_loop.get(), &m_wal_work, [](uv_work_t* work) {
+		auto self = (Node*)work->data;
+		// Give entries arriving within the window a chance to share
+		// this sync. Entries staged while it runs share the next one.
+		if (self->m_wal_window_us > 0) {
+			std::this_thread::sleep_for(std::chrono::microseconds(self->m_wal_window_us));
+		}
+		self->m_wal_status = self->m_wal->sync(self->m_wal_synced);
+	}, [](uv_work_t* work, int status) {
+		auto self = (Node*)work->data;
+		self->m_wal_syncing = false;
+		self->wal_synced();
+	});
+}
+
+void
+Node :: wal_synced() {
+	if (m_wal_status < 0) {
+		// The log stays failed, so nothing else will be confirmed.
+		Stats::add(m_stats->wal_errors);
+		m_wal_unsynced.clear();
+		if (m_peer_registry != nullptr) {
+			m_role->wal_failed();
+		}
+		return;
+	}
+	Stats::add(m_stats->wal_syncs);
+	if (m_peer_registry == nullptr) {
+		// Shutting down.
+		return;
+	}
+	uint64_t now = uv_hrtime();
+	while (!m_wal_unsynced.empty() && m_wal_unsynced.front().m_record <= m_wal_synced) {
+		auto& record = m_wal_unsynced.front();
+		if (!record.m_replaced) {
+			m_role->client_confirm_append(now, record.m_round);
+		}
+		m_wal_unsynced.pop_front();
+	}
+	update_stats();
+}
+
+int
+Node :: push_command(COMMAND_TYPE type, const std::string& content, ab_append_cb cb, void* data,
+	uint64_t round) {
+	if (!m_started) {
+		// There is no loop to wake up yet.
+		return -1;
+	}
+	uv_thread_t self = uv_thread_self();
+	bool loop_thread = m_running && uv_thread_equal(&self, &m_loop_thread);
+	if (loop_thread && !m_command_overflow.empty()) {
+		// Stay behind the commands that overflowed.
+		m_command_overflow.push_back(Command{type, content, cb, data, round});
+	} else {
+		while (!m_commands.push(type, content, cb, data, round)) {
+			if (loop_thread) {
+				// Nobody drains the queue while a callback runs on the
+				// loop, so waiting would hang. Keep it for later.
+				m_command_overflow.push_back(Command{type, content, cb, data, round});
+				break;
+			}
+			// Queue is full. Make sure the loop is draining it and retry.
+			uv_async_send(&m_command_async);
+			std::this_thread::yield();
+		}
+	}
+	// uv_async_send coalesces wakeups, so a burst of commands
+	// is drained by a single callback.
+	uv_async_send(&m_command_async);
+	return 0;
+}
+
+void
+Node :: run_command(uint64_t now, Command& cmd) {
+	switch (cmd.type) {
+	case CMD_APPEND:
+		m_role->send_append(now, cmd.content, cmd.cb, cmd.data);
+		break;
+	case CMD_CONFIRM_APPEND:
+		// With a log, rounds are confirmed once they're synced.
+		if (m_wal == nullptr) {
+			m_role->client_confirm_append(now, cmd.round);
+		}
+		break;
+	}
+}
+
+void
+Node :: process_commands() {
+	uint64_t now = uv_hrtime();
+	auto n = m_commands.consume(m_commands.capacity(), [&](Command& cmd) {
+		run_command(now, cmd);
+	});
+	// Commands from the loop thread that didn't fit come after the
+	// queue. Commands they trigger go to the queue again.
+	auto overflow = std::move(m_command_overflow);
+	m_command_overflow.clear();
+	for (auto& cmd : overflow) {
+		run_command(now, cmd);
+	}
+	// Appends queued by this batch of commands share a group commit.
+	m_role->flush_due_appends(now);
+	update_stats();
+	if (n == m_commands.capacity()) {
+		// There may be more. Yield to the rest of the loop first.
+		uv_async_send(&m_command_async);
+	}
 }
 
 void
@@ -100,11 +310,13 @@ Node :: handle_message(const Message* msg) {
 	case MSG_IDENT:
 		ident_msg = static_cast<const IdentityMessage&>(*msg);
 		m_peer_registry->set_identity(ident_msg.source, ident_msg.id, ident_msg.address);
+		m_role->add_peer(ident_msg.id);
 		break;
 	case MSG_IDENT_REQUEST:
 		ident_req_msg = static_cast<const IdentityRequest&>(*msg);
 		m_peer_registry->send_to_index(msg->source, &ident_msg);
 		m_peer_registry->set_identity(ident_req_msg.source, ident_req_msg.id, ident_req_msg.address);
+		m_role->add_peer(ident_req_msg.id);
 		break;
 	case MSG_LEADER_ACTIVE:
 		m_role->handle_leader_active(now, static_cast<const LeaderActiveMessage&>(*msg));
@@ -112,5 +324,32 @@ Node :: handle_message(const Message* msg) {
 	case MSG_LEADER_ACTIVE_ACK:
 		m_role->handle_leader_active_ack(now, static_cast<const LeaderActiveAck&>(*msg));
 		break;
+	case MSG_SNAPSHOT_CHUNK:
+		m_role->handle_snapshot_chunk(static_cast<const SnapshotChunk&>(*msg));
+		break;
+	case MSG_SNAPSHOT_ACK:
+		m_role->handle_snapshot_ack(now, static_cast<const SnapshotAck&>(*msg));
+		break;
+	}
+	update_stats();
+}
+
+void
+Node :: update_stats() {
+	Stats::set(m_stats->round, m_role->round());
+	Stats::set(m_stats->seq, m_role->seq());
+	Stats::set(m_stats->state, m_role->state());
+}
+
+void
+Node :: publish_peer_stats(uint64_t ts) {
+	m_peer_stats_scratch.clear();
+	m_role->follower_progress(ts, m_peer_stats_scratch);
+	// Never block the loop on a reader. If the lock is busy,
+	// publish on the next tick instead.
+	std::unique_lock<std::mutex> lock(m_peer_stats_mutex, std::try_to_lock);
+	if (lock.owns_lock()) {
+		m_peer_stats.swap(m_peer_stats_scratch);
+		m_peer_stats_published = !m_peer_stats.empty();
 	}
 }
@@ -1,10 +1,12 @@
 #pragma once
 
 #include <mutex>
+#include <deque>
+#include <atomic>
+#include <chrono>
 #include <thread>
 #include <memory>
 #include <cerrno>
-#include <future>
 #include <iostream>
 
 #include <uv.h>
@@ -12,12 +14,16 @@
 
 #include "ab.h"
 #include "role.hpp"
+#include "stats.hpp"
+#include "timer_wheel.hpp"
+#include "command_queue.hpp"
 #include "peer/peer.hpp"
 #include "peer_registry.hpp"
 #include "message/codec.hpp"
 #include "message/message.hpp"
+#include "log/wal.hpp"
 
-const uint64_t leader_timeout_ns = 1e9;
+const int COMMAND_QUEUE_SIZE = 4096;
 
 class Node
 {
@@ -25,14 +31,28 @@ public:
 	Node(uint64_t id, int cluster_size)
 	: m_id(id)
 	, m_cluster_size(cluster_size)
-	, m_peer_registry(std::make_unique<PeerRegistry>(id))
 	, m_codec(std::make_shared<Codec>())
+	, m_stats(std::make_shared<Stats>())
+	, m_timer_deadline(UINT64_MAX)
+	, m_reconnect_delay(DEFAULT_RECONNECT_DELAY_MS)
+	, m_wal_syncing(false)
+	, m_wal_status(0)
+	, m_wal_window_us(0)
+	, m_wal_synced(0)
+	, m_peer_registry(std::make_unique<PeerRegistry>(id, m_codec, m_stats))
 	, m_index_counter(0)
 	, m_trusted_peer(0)
-	, m_last_leader_active(uv_hrtime())
 	, m_role(std::make_unique<Role>(*m_peer_registry, id, cluster_size))
 	, m_mutex(std::make_unique<std::mutex>())
+	, m_peer_stats_published(false)
+	, m_commands(COMMAND_QUEUE_SIZE)
+	, m_started(false)
+	, m_running(false)
 	{
+		m_role->set_stats(m_stats);
+		m_peer_registry->set_on_departure([this](uint64_t peer_id) {
+			m_role->remove_peer(peer_id);
+		});
 	}
 
 	void
@@ -41,6 +61,12 @@ public:
 		m_role->set_callbacks(callbacks, callbacks_data);
 	}
 
+	void
+	set_snapshot_callbacks(ab_snapshot_callbacks_t callbacks, void* callbacks_data)
+	{
+		m_role->set_snapshot_callbacks(callbacks, callbacks_data);
+	}
+
 	// start starts a node listening at address.
 	// A negative value is returned for errors.
 	int
@@ -57,48 +83,21 @@ public:
 	void
 	connect_to_peer(cpl::net::SockAddr&);
 
-	void
+	// append queues an append for the event loop thread.
+	// It is safe to call from any thread once the node is started.
+	// -1 is returned, without calling cb, before start.
+	int
 	append(std::string content, ab_append_cb cb, void* data)
 	{
-		auto async = new uv_async_t;
-		auto task = new std::packaged_task<void()>([=]() {
-			m_role->send_append(content, cb, data);
-			uv_close((uv_handle_t*)async, [](uv_handle_t* handle) {
-				// delete packaged_task
-				auto func = reinterpret_cast<std::packaged_task<void()>*>(handle->data);
-				delete func;
-				// delete async
-				delete handle;
-			});
-		});
-		async->data = task;
-		uv_async_init(m_uv_loop.get(), async, [](uv_async_t* handle) {
-			auto func = reinterpret_cast<std::packaged_task<void()>*>(handle->data);
-			(*func)();
-		});
-		uv_async_send(async);
+		return push_command(CMD_APPEND, content, cb, data, 0);
 	}
 
-	void
+	// confirm_append queues an append confirmation for the event loop thread.
+	// It is safe to call from any thread once the node is started.
+	int
 	confirm_append(uint64_t round)
 	{
-		auto async = new uv_async_t;
-		auto task = new std::packaged_task<void()>([=]() {
-			m_role->client_confirm_append(round);
-			uv_close((uv_handle_t*)async, [](uv_handle_t* handle) {
-				// delete packaged_task
-				auto func = reinterpret_cast<std::packaged_task<void()>*>(handle->data);
-				delete func;
-				// delete async
-				delete handle;
-			});
-		});
-		async->data = task;
-		uv_async_init(m_uv_loop.get(), async, [](uv_async_t* handle) {
-			auto func = reinterpret_cast<std::packaged_task<void()>*>(handle->data);
-			(*func)();
-		});
-		uv_async_send(async);
+		return push_command(CMD_CONFIRM_APPEND, "", nullptr, nullptr, round);
 	}
 
 	int
@@ -107,6 +106,141 @@ public:
 		return m_codec->set_key(key);
 	}
 
+	int
+	set_checksum(int checksum)
+	{
+		return m_codec->set_checksum(checksum);
+	}
+
+	int
+	set_batching(int max_entries, int max_bytes, uint64_t linger_ns)
+	{
+		return m_role->set_batching(max_entries, max_bytes, linger_ns);
+	}
+
+	int
+	set_retention(int max_entries, int max_bytes)
+	{
+		return m_role->set_retention(max_entries, max_bytes);
+	}
+
+	int
+	set_append_window(int window)
+	{
+		return m_role->set_append_window(window);
+	}
+
+	void
+	get_timing(ab_timing_t* timing)
+	{
+		auto& role_timing = m_role->timing();
+		timing->heartbeat_ms = role_timing.m_heartbeat_interval / 1000000;
+		timing->leadership_loss_ms = role_timing.m_leadership_loss / 1000000;
+		timing->follower_timeout_ms = role_timing.m_follower_timeout / 1000000;
+		timing->reconnect_ms = m_reconnect_delay;
+		timing->phi_threshold = role_timing.m_phi_threshold;
+	}
+
+	int
+	set_timing(const ab_timing_t& timing)
+	{
+		if (timing.heartbeat_ms <= 0 || timing.leadership_loss_ms <= 0 ||
+			timing.follower_timeout_ms <= 0 || timing.reconnect_ms <= 0) {
+			return -1;
+		}
+		Timing role_timing;
+		role_timing.m_heartbeat_interval = (uint64_t)timing.heartbeat_ms * 1000000;
+		role_timing.m_leadership_loss = (uint64_t)timing.leadership_loss_ms * 1000000;
+		role_timing.m_follower_timeout = (uint64_t)timing.follower_timeout_ms * 1000000;
+		role_timing.m_phi_threshold = timing.phi_threshold;
+		if (m_role->set_timing(role_timing) < 0) {
+			return -1;
+		}
+		m_reconnect_delay = timing.reconnect_ms;
+		m_peer_registry->set_reconnect_delay(m_reconnect_delay);
+		return 0;
+	}
+
+	// set_wal makes the node store entries in a write-ahead log in dir
+	// and confirm them itself once they're synced. It must be called
+	// before run.
+	int
+	set_wal(const std::string& dir, uint64_t segment_size, uint64_t window_us)
+	{
+		auto wal = std::make_unique<Wal>();
+		if (m_wal != nullptr || wal->open(dir, segment_size) < 0) {
+			return -1;
+		}
+		m_wal = std::move(wal);
+		m_wal_window_us = window_us;
+		m_role->set_received(m_wal->last_round());
+		m_role->set_store([this](uint64_t round, const std::string& content) {
+			return store(round, content);
+		});
+		// An installed snapshot covers the entries up to its round.
+		m_role->set_truncate([this](uint64_t round) {
+			m_wal->truncate(round);
+		});
+		return 0;
+	}
+
+	// replay_wal calls fn with every synced entry in the write-ahead
+	// log. It is safe to call from any thread.
+	int
+	replay_wal(std::function<void(uint64_t, const char*, size_t)> fn)
+	{
+		if (m_wal == nullptr) {
+			return -1;
+		}
+		return m_wal->replay(fn);
+	}
+
+	// truncate_wal lets the write-ahead log drop entries up to round.
+	// It is safe to call from any thread.
+	int
+	truncate_wal(uint64_t round)
+	{
+		if (m_wal == nullptr) {
+			return -1;
+		}
+		m_wal->truncate(round);
+		return 0;
+	}
+
+	// get_stats copies the node's counters. It is safe to call from any thread.
+	void
+	get_stats(ab_stats_t* stats)
+	{
+		m_stats->snapshot(stats);
+	}
+
+	// get_peer_stats copies the last published per-follower stats.
+	// It is safe to call from any thread.
+	int
+	get_peer_stats(ab_peer_stats_t* peers, int max)
+	{
+		std::lock_guard<std::mutex> lock(m_peer_stats_mutex);
+		int n = (int)m_peer_stats.size();
+		for (int i = 0; i < n && i < max; i++) {
+			peers[i] = m_peer_stats[i];
+		}
+		return n;
+	}
+
+	// latency returns a latency histogram, or nullptr if which is invalid.
+	// The histograms may be read and reset from any thread.
+	Histogram*
+	latency(int which)
+	{
+		switch (which) {
+		case AB_LATENCY_COMMIT:
+			return &m_stats->commit_latency;
+		case AB_LATENCY_CONFIRM:
+			return &m_stats->confirm_latency;
+		}
+		return nullptr;
+	}
+
 	// shutdown shuts down the Node's event loop and cleans up resources.
 	void
 	shutdown()
@@ -115,6 +249,7 @@ public:
 			auto self = (Node*)(handle->data);
 			auto timer = self->m_timer.get();
 			uv_timer_stop(timer);
+			uv_prepare_stop(self->m_prepare.get());
 
 			uv_close((uv_handle_t*)timer, [](uv_handle_t* handle) {
 				auto self = (Node*)(handle->data);
@@ -153,26 +288,116 @@ private:
 	std::unique_ptr<uv_loop_t>    m_uv_loop;
 	std::unique_ptr<uv_tcp_t>     m_tcp;
 	std::unique_ptr<uv_timer_t>   m_timer;
-	std::unique_ptr<PeerRegistry> m_peer_registry;
+	std::unique_ptr<uv_prepare_t> m_prepare;
 	std::shared_ptr<Codec>        m_codec;
+	std::shared_ptr<Stats>        m_stats;
+	// All of the node's timers run on m_wheel, which m_timer wakes
+	// the loop for. Peers schedule on it too, so it outlives them.
+	TimerWheel                    m_wheel;
+	// Fires at the role's next deadline.
+	WheelTimer                    m_role_timer;
+	uint64_t                      m_timer_deadline;
+	uint64_t                      m_reconnect_delay;
+	// A record in the write-ahead log waiting for a sync. It isn't
+	// confirmed once a later record replaced its round.
+	struct WalRecord
+	{
+		uint64_t m_record;
+		uint64_t m_round;
+		bool     m_replaced;
+	}; // WalRecord
+
+	// Optional write-ahead log. Syncs run on the libuv thread pool,
+	// one at a time, and report the last record they made durable in
+	// m_wal_synced.
+	std::unique_ptr<Wal>          m_wal;
+	uv_work_t                     m_wal_work;
+	bool                          m_wal_syncing;
+	int                           m_wal_status;
+	uint64_t                      m_wal_window_us;
+	uint64_t                      m_wal_synced;
+	std::deque<WalRecord>         m_wal_unsynced;
+	std::unique_ptr<PeerRegistry> m_peer_registry;
 	int                           m_index_counter;
 	int                           m_cluster_size;
 	ab_callbacks_t*               m_client_callbacks;
 	void*                         m_client_callbacks_data;
 
 	uint64_t                      m_trusted_peer;
-	uint64_t                      m_last_leader_active;
 	std::unique_ptr<Role>         m_role;
 
 	std::unique_ptr<std::mutex>   m_mutex;
 	uv_async_t                    m_async;
 
+	// Per-follower stats published for other threads.
+	std::mutex                    m_peer_stats_mutex;
+	std::vector<ab_peer_stats_t>  m_peer_stats;
+	std::vector<ab_peer_stats_t>  m_peer_stats_scratch;
+	// Loop thread only. Set while m_peer_stats isn't empty.
+	bool                          m_peer_stats_published;
+
+	// Commands from other threads, drained by m_command_async.
+	CommandQueue                  m_commands;
+	uv_async_t                    m_command_async;
+	// Commands from the loop thread that found the queue full, such as
+	// confirmations from on_append during a large batch. Only the loop
+	// thread touches it.
+	std::deque<Command>           m_command_overflow;
+	// Set once m_command_async is initialized.
+	std::atomic<bool>             m_started;
+	// Set once run has recorded the loop thread.
+	std::atomic<bool>             m_running;
+	uv_thread_t                   m_loop_thread;
+
 	void
 	periodic();
 
+	// schedule_role_timer moves m_role_timer to the role's next deadline.
+	void
+	schedule_role_timer();
+
+	// arm_timer points m_timer at the wheel's next deadline.
+	void
+	arm_timer();
+
+	// store writes an entry to the write-ahead log and returns where
+	// the log mapped it.
+	const char*
+	store(uint64_t round, const std::string& content);
+
+	// sync_wal starts syncing the write-ahead log unless a sync is
+	// running or nothing is staged.
+	void
+	sync_wal();
+
+	// wal_synced confirms the records of a finished sync, or reports
+	// that the log failed.
+	void
+	wal_synced();
+
+	// push_command queues a command for the loop. It never blocks
+	// the loop thread itself.
+	int
+	push_command(COMMAND_TYPE type, const std::string& content, ab_append_cb cb, void* data,
+		uint64_t round);
+
+	void
+	run_command(uint64_t now, Command& cmd);
+
+	void
+	process_commands();
+
 	static void
 	on_connect(uv_stream_t* server, int status);
 
 	void
 	handle_message(const Message*);
+
+	// update_stats publishes the role's current round, seq and state.
+	void
+	update_stats();
+
+	// publish_peer_stats publishes the role's per-follower stats.
+	void
+	publish_peer_stats(uint64_t ts);
 }; // Node
@@ -4,6 +4,7 @@
 #include <unordered_map>
 #include <memory>
 #include <atomic>
+#include <functional>
 
 #include "peer/peer.hpp"
 #include "node/registry.hpp"
@@ -13,8 +14,12 @@ class PeerRegistry : public Registry
 	using shared_peer = std::shared_ptr<Peer>;
 
 public:
-	PeerRegistry(uint64_t id)
+	PeerRegistry(uint64_t id, std::shared_ptr<Codec> codec, std::shared_ptr<Stats> stats)
 	: m_id(id)
+	, m_codec(codec)
+	, m_stats(stats)
+	, m_reconnect_delay(DEFAULT_RECONNECT_DELAY_MS)
+	, m_cleanup_due(false)
 	{
 	}
 
@@ -22,9 +27,35 @@ public:
 	register_peer(int index, shared_peer peer)
 	{
 		peer->set_index(index);
+		peer->set_reconnect_delay(m_reconnect_delay);
+		// A closed connection may leave a peer with nothing to
+		// reconnect to.
+		peer->set_on_close([this]() {
+			m_cleanup_due = true;
+		});
 		m_peers[index] = peer;
 	}
 
+	// set_reconnect_delay sets the reconnect delay of current and
+	// future peers.
+	void
+	set_reconnect_delay(uint64_t delay_ms)
+	{
+		m_reconnect_delay = delay_ms;
+		for (auto i = std::begin(m_peers); i != std::end(m_peers); ++i) {
+			i->second->set_reconnect_delay(delay_ms);
+		}
+	}
+
+	// set_on_departure sets a callback for node IDs that no peer has
+	// anymore, either because their peers were cleaned up or because
+	// they came back under another ID.
+	void
+	set_on_departure(std::function<void(uint64_t)> on_departure)
+	{
+		m_on_departure = on_departure;
+	}
+
 	void
 	set_identity(const int index, const uint64_t id, const std::string& address)
 	{
@@ -35,16 +66,22 @@ public:
 		} catch (...) {
 			return;
 		}
+		uint64_t old_id = peer->id();
+		uint64_t replaced_id = 0;
 		peer->set_identity(id, address);
 		// Check if another index has the same ID or address. If so,
 		// update the other one.
 		for (auto i = std::begin(m_peers); i != std::end(m_peers); ++i) {
 			auto p = i->second;
 			if (i->first < index && (p->id() == id || p->address() == address)) {
+				replaced_id = p->id();
 				*p = std::move(*peer);
+				m_cleanup_due = true;
 				break;
 			}
 		}
+		departed(old_id);
+		departed(replaced_id);
 	}
 
 	void
@@ -69,29 +106,86 @@ public:
 	void
 	broadcast(const Message* msg)
 	{
+		// All peers share a key, so the message is packed and
+		// sealed once and the frame is shared by every peer.
+		std::shared_ptr<const Frame> frame;
 		for (auto i = std::begin(m_peers); i != std::end(m_peers); ++i) {
 			if (i->second->id() < m_id) {
 				// TODO: Don't broadcast to nodes more authoritative.
 			}
-			i->second->send(msg);
+			if (!i->second->active()) {
+				continue;
+			}
+			if (frame == nullptr) {
+				frame = m_codec->pack_frame(msg);
+				if (frame == nullptr) {
+					Stats::add(m_stats->encode_failures);
+					return;
+				}
+			}
+			m_stats->sent(msg->type, frame->size());
+			i->second->send_frame(frame);
+		}
+	}
+
+	// flush writes out every peer's queued frames.
+	void
+	flush()
+	{
+		for (auto i = std::begin(m_peers); i != std::end(m_peers); ++i) {
+			i->second->flush();
 		}
 	}
 
+	// cleanup removes the peers that were closed for good or merged
+	// into another one. It does nothing unless a peer was closed or
+	// merged since the last cleanup, so it's cheap to call often.
+	// Peers are only removed here, outside of their own callbacks.
 	void
 	cleanup()
 	{
+		if (!m_cleanup_due) {
+			return;
+		}
+		m_cleanup_due = false;
+		std::vector<uint64_t> removed;
 		for (auto i = std::begin(m_peers); i != std::end(m_peers); ) {
 			if (i->second == nullptr) {
 				i = m_peers.erase(i);
 			} else if (i->second->done()) {
+				removed.push_back(i->second->id());
 				i = m_peers.erase(i);
 			} else {
 				++i;
 			}
 		}
+		for (auto id : removed) {
+			departed(id);
+		}
 	}
 
 private:
+	// departed reports id unless it's unset, this node's own, or
+	// another peer still has it.
+	void
+	departed(uint64_t id)
+	{
+		if (id == 0 || id == m_id || m_on_departure == nullptr) {
+			return;
+		}
+		for (auto i = std::begin(m_peers); i != std::end(m_peers); ++i) {
+			if (i->second != nullptr && i->second->id() == id) {
+				return;
+			}
+		}
+		m_on_departure(id);
+	}
+
 	uint64_t                             m_id;
+	std::shared_ptr<Codec>               m_codec;
+	std::shared_ptr<Stats>               m_stats;
+	uint64_t                             m_reconnect_delay;
+	bool                                 m_cleanup_due;
 	std::unordered_map<int, shared_peer> m_peers;
+	std::function<void(uint64_t)>        m_on_departure;
 }; // PeerRegistry
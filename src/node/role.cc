@@ -1,3 +1,5 @@
+#include <algorithm>
+
 #include "role.hpp"
 
 void
@@ -17,31 +19,59 @@ Role :: periodic(uint64_t ts) {
 
 void
 Role :: periodic_leader(uint64_t ts) {
-	if (m_leader_data->m_pending_round == 0) {
-		// No pending round.
-		if (ts - m_leader_data->m_last_broadcast < 50e6) {
+	flush_due_appends(ts);
+
+	auto& pending = m_leader_data->m_pending_rounds;
+
+	// Commit pending rounds in round order for as long as a majority acked them.
+	auto committed = m_round;
+	while (!pending.empty()) {
+		auto it = pending.begin();
+		if (!stored_by_majority(it->second.m_acks)) {
+			break;
+		}
+		auto callback = it->second.m_callback;
+		auto callback_data = it->second.m_callback_data;
+		m_stats->commit_latency.record(ts - it->second.m_submit_ts);
+		m_round = it->first;
+		pending.erase(it);
+		Stats::add(m_stats->appends_committed);
+		callback(0, callback_data);
+	}
+	if (m_round > committed) {
+		notify_commit();
+	}
+
+	if (pending.empty()) {
+		// No pending round. The last commits reach the followers with
+		// the next message, so don't wait for the heartbeat interval
+		// if there won't be another append.
+		if (m_round == committed &&
+			ts - m_leader_data->m_last_broadcast < m_timing.m_heartbeat_interval) {
 			// Not enough time has passed to send a regular heartbeat.
 			return;
 		}
 
 		// Do we have a majority of votes?
-		if (m_leader_data->m_acks.size() >= m_cluster_size/2 /* assume a vote for ourselves */) {
+		if (has_quorum(m_leader_data->m_acks)) {
 			// Send another heartbeat.
 			LeaderActiveMessage msg(m_id, ++m_seq, m_round);
 			m_registry.broadcast(&msg);
 			m_leader_data->m_last_broadcast = ts;
-			m_leader_data->m_acks.clear();
+			m_leader_data->m_acks = 0;
+			record_broadcast(ts, m_seq);
 			return;
 		} else {
 			// Did we lose leadership?
-			if (ts - m_leader_data->m_last_broadcast > 300e6) {
-				// Yes. Forfeit leadership.
+			if (ts - m_leader_data->m_last_broadcast > m_timing.m_leadership_loss) {
+				// Yes. Cancel queued appends and forfeit leadership.
+				cancel_appends();
+				Stats::add(m_stats->leadership_lost);
 				if (m_client_callbacks.lost_leadership != nullptr) {
 					m_client_callbacks.lost_leadership(m_client_callbacks_data);
 				}
 				m_leader_data = nullptr;
-				m_state = PotentialLeader;
-				m_potential_leader_data = std::make_unique<PotentialLeaderData>();
+				become_potential_leader();
 				return;
 			} else {
 				// Not yet. Wait.
@@ -50,49 +80,33 @@ Role :: periodic_leader(uint64_t ts) {
 		}
 	}
 
-	// We have a pending round. Did a majority ack it?
-	auto pending_round_votes = 0;
-	for (auto it = m_leader_data->m_acks.begin(); it != m_leader_data->m_acks.end(); ++it) {
-		if (it->second == m_leader_data->m_pending_round) {
-			pending_round_votes++;
-		}
-	}
-	if (pending_round_votes >= m_cluster_size/2) {
-		// Yes.
-		m_leader_data->m_callback(0, m_leader_data->m_callback_data);
-		m_leader_data->m_callback = nullptr;
-		m_leader_data->m_callback_data = nullptr;
-		m_round = m_leader_data->m_pending_round;
-		m_leader_data->m_pending_round = 0;
-		return;
-	} else {
-		// No. Did we wait long enough?
-		if (ts - m_leader_data->m_last_broadcast > 300e6) {
-			// Yes. Cancel append and forfeit leadership.
-			cancel_append();
-			if (m_client_callbacks.lost_leadership != nullptr) {
-				m_client_callbacks.lost_leadership(m_client_callbacks_data);
-			}
-			m_leader_data = nullptr;
-			m_state = PotentialLeader;
-			m_potential_leader_data = std::make_unique<PotentialLeaderData>();
-		} else {
-			// Not yet. Wait.
-			return;
+	// The oldest pending round doesn't have a majority yet.
+	// Did we wait long enough?
+	if (ts - pending.begin()->second.m_broadcast_ts > m_timing.m_leadership_loss) {
+		// Yes. Cancel appends and forfeit leadership.
+		cancel_appends();
+		Stats::add(m_stats->leadership_lost);
+		if (m_client_callbacks.lost_leadership != nullptr) {
+			m_client_callbacks.lost_leadership(m_client_callbacks_data);
 		}
+		m_leader_data = nullptr;
+		become_potential_leader();
 	}
 }
 
 void
 Role :: periodic_potential_leader(uint64_t ts) {
-	if (ts - m_potential_leader_data->m_last_broadcast > 300e6) {
+	if (ts - m_potential_leader_data->m_last_broadcast > m_timing.m_leadership_loss) {
 		// It's been over 300 ms since the last broadcast.
-		if (m_potential_leader_data->m_acks.size() >= m_cluster_size/2) {
+		if (has_quorum(m_potential_leader_data->m_acks)) {
 			// Got a majority. We're now a leader.
+			Stats::add(m_stats->leadership_gained);
 			if (m_client_callbacks.gained_leadership != nullptr) {
 				m_client_callbacks.gained_leadership(m_client_callbacks_data);
 			}
-			m_leader_data = std::make_unique<LeaderData>();
+			m_leader_data = std::make_unique<LeaderData>(m_round);
+			// Rounds after the last commit will be reused.
+			truncate_retained(m_round);
 			m_leader_data->m_last_broadcast = m_potential_leader_data->m_last_broadcast;
 			m_leader_data->m_acks = m_potential_leader_data->m_acks;
 			m_potential_leader_data = nullptr;
@@ -102,7 +116,7 @@ Role :: periodic_potential_leader(uint64_t ts) {
 
 		// Try again.
 		++m_seq;
-		m_potential_leader_data->m_acks.clear();
+		m_potential_leader_data->m_acks = 0;
 		LeaderActiveMessage msg(m_id, m_seq, m_round);
 		m_registry.broadcast(&msg);
 		m_potential_leader_data->m_last_broadcast = ts;
@@ -117,18 +131,51 @@ Role :: periodic_follower(uint64_t ts) {
 		return;
 	}
 
-	if (ts - m_follower_data->m_last_leader_active > 1000e6) {
+	if (ts - m_follower_data->m_last_leader_active > follower_timeout()) {
 		auto previous_leader = m_follower_data->m_current_leader;
 		// Leader hasn't been active for over 1000 ms
 		m_follower_data = nullptr;
-		m_state = PotentialLeader;
-		m_potential_leader_data = std::make_unique<PotentialLeaderData>();
-		if (m_client_callbacks.on_leader_change != nullptr &&
-			// Only invoke callback if there was a previous leader.
-			previous_leader != 0) {
-			m_client_callbacks.on_leader_change(0, m_client_callbacks_data);
+		become_potential_leader();
+		// Only invoke callback if there was a previous leader.
+		if (previous_leader != 0) {
+			leader_changed(0);
+		}
+	}
+}
+
+uint64_t
+Role :: next_deadline() const {
+	// Each deadline mirrors a check in the matching periodic_* method.
+	switch (m_state) {
+	case Leader: {
+		uint64_t deadline;
+		auto& pending = m_leader_data->m_pending_rounds;
+		if (!pending.empty()) {
+			auto& oldest = pending.begin()->second;
+			if (stored_by_majority(oldest.m_acks)) {
+				// A confirmation completed the majority. Commit now.
+				return 0;
+			}
+			deadline = oldest.m_broadcast_ts + m_timing.m_leadership_loss + 1;
+		} else if (has_quorum(m_leader_data->m_acks)) {
+			deadline = m_leader_data->m_last_broadcast + m_timing.m_heartbeat_interval;
+		} else {
+			deadline = m_leader_data->m_last_broadcast + m_timing.m_leadership_loss + 1;
+		}
+		if (!m_leader_data->m_batch.empty()) {
+			deadline = std::min(deadline, m_leader_data->m_batch_start + m_batch_linger);
+		}
+		return deadline;
+	}
+	case PotentialLeader:
+		return m_potential_leader_data->m_last_broadcast + m_timing.m_leadership_loss + 1;
+	case Follower:
+		if (m_follower_data->m_last_leader_active == 0) {
+			return 0;
 		}
+		return m_follower_data->m_last_leader_active + follower_timeout() + 1;
 	}
+	return 0;
 }
 
 void
@@ -143,8 +190,9 @@ Role :: handle_leader_active(uint64_t ts, const LeaderActiveMessage& msg) {
 		if (msg.id < m_id) {
 			// Other node has more authority. Drop down to follower state.
 			if (m_state == Leader) {
-				// Cancel append if we have one.
-				cancel_append();
+				// Cancel appends if we have any.
+				cancel_appends();
+				Stats::add(m_stats->leadership_lost);
 				if (m_client_callbacks.lost_leadership != nullptr) {
 					m_client_callbacks.lost_leadership(m_client_callbacks_data);
 				}
@@ -152,6 +200,7 @@ Role :: handle_leader_active(uint64_t ts, const LeaderActiveMessage& msg) {
 			}
 			auto new_leader_id = msg.id;
 			drop_leadership(new_leader_id);
+			truncate_retained(msg.round);
 		}
 	}
 
@@ -161,24 +210,21 @@ Role :: handle_leader_active(uint64_t ts, const LeaderActiveMessage& msg) {
 		return;
 	}
 
-	if (m_follower_data->m_pending_round != 0) {
-		// We haven't confirmed a previous append.
-		if (msg.round >= m_follower_data->m_pending_round) {
-			// Leader has moved on. Drop our pending append.
-			m_follower_data->m_pending_round = 0;
-		} else {
-			// Still valid. Ignore everything until we confirm.
-			return;
-		}
-	}
+	// Drop pending appends the leader has moved past.
+	auto& pending = m_follower_data->m_pending_rounds;
+	pending.erase(pending.begin(), pending.upper_bound(msg.round));
 
 	if (m_follower_data->m_current_leader > msg.id || m_follower_data->m_current_leader == 0) {
 		// Our current leader is less authoritative. Replace.
 		m_follower_data->m_current_leader = msg.id;
-		if (m_client_callbacks.on_leader_change != nullptr) {
-			m_client_callbacks.on_leader_change(msg.id, m_client_callbacks_data);
-		}
-		m_follower_data->m_pending_round = 0;
+		leader_changed(msg.id);
+		m_follower_data->m_pending_rounds.clear();
+		m_follower_data->m_detector.reset();
+		m_follower_data->m_snapshot_round = 0;
+		m_follower_data->m_snapshot_offset = 0;
+		m_follower_data->m_snapshot_installed = false;
+		// Uncommitted rounds from the old leader may be reused.
+		truncate_retained(msg.round);
 	} else if (m_follower_data->m_current_leader < msg.id) {
 		// Less authoritative than the current leader.
 		// Ignore this message.
@@ -189,28 +235,39 @@ Role :: handle_leader_active(uint64_t ts, const LeaderActiveMessage& msg) {
 		m_round = msg.round;
 	}
 
-	if (msg.next != 0) {
-		// Append message
-		if (m_client_callbacks.on_append != nullptr) {
-			m_client_callbacks.on_append(msg.next, msg.next_content.c_str(),
-				msg.next_content.size(), m_client_callbacks_data);
-			m_follower_data->m_last_leader_active = ts;
-			m_follower_data->m_pending_round = msg.next;
+	if (m_client_callbacks.on_append == nullptr && m_store == nullptr) {
+		// Nothing is delivered, so nothing can be missing either.
+		m_received = std::max(m_received, m_round);
+		if (msg.entries() > 0) {
+			m_received = std::max(m_received, msg.next + msg.entries() - 1);
+		}
+	} else if (msg.next != 0) {
+		// Append message, possibly batched. Each entry gets its own round.
+		leader_active(ts);
+		bool delivered = deliver(ts, msg);
+		notify_commit();
+		if (delivered && !(msg.flags & MSG_FLAG_CATCH_UP)) {
+			// Acks are sent as the rounds are confirmed.
 			return;
 		}
+		// Rounds are missing, or this was catch-up. Tell the leader
+		// how far we got.
+		LeaderActiveAck ack(m_id, m_seq, m_round, m_received);
+		m_registry.send_to_id(msg.id, &ack);
+		return;
 	}
 
+	notify_commit();
+
 	// Normal heartbeat
 	// Send ack
-	LeaderActiveAck ack(m_id, m_seq, m_round);
+	LeaderActiveAck ack(m_id, m_seq, m_round, m_received);
 	m_registry.send_to_id(msg.id, &ack);
 	if (m_follower_data->m_current_leader != msg.id) {
-		if (m_client_callbacks.on_leader_change != nullptr) {
-			m_client_callbacks.on_leader_change(msg.id, m_client_callbacks_data);
-		}
+		leader_changed(msg.id);
 	}
 	m_follower_data->m_current_leader = msg.id;
-	m_follower_data->m_last_leader_active = ts;
+	leader_active(ts);
 }
 
 void
@@ -220,15 +277,461 @@ Role :: handle_leader_active_ack(uint64_t ts, const LeaderActiveAck& msg) {
 		return;
 	}
 
-	if (msg.seq != m_seq) {
-		// message is too old
+	int slot = m_slots.find(msg.id);
+	if (slot < 0) {
+		// Only nodes that identified themselves count.
 		return;
 	}
 
 	if (m_state == Leader) {
-		m_leader_data->m_acks[msg.id] = msg.round;
+		update_follower_progress(ts, slot, msg);
+		send_catch_up(ts, slot);
+		// Each round is acked independently, so acks for earlier rounds
+		// may carry a newer seq than the round was broadcast with.
+		auto pending = m_leader_data->m_pending_rounds.find(msg.round);
+		if (pending != m_leader_data->m_pending_rounds.end() &&
+			msg.seq >= pending->second.m_seq) {
+			pending->second.m_acks |= slot_bit(slot);
+		}
+		if (msg.seq == m_seq) {
+			m_leader_data->m_acks |= slot_bit(slot);
+		}
 		periodic_leader(ts);
+		return;
+	}
+
+	if (msg.seq != m_seq) {
+		// message is too old
+		return;
+	}
+	m_potential_leader_data->m_acks |= slot_bit(slot);
+}
+
+int
+Role :: add_peer(uint64_t id) {
+	if (id == m_id) {
+		return -1;
+	}
+	bool reused;
+	int slot = m_slots.slot(id, &reused);
+	if (slot < 0) {
+		return -1;
+	}
+	if (reused) {
+		clear_slot(slot);
+	}
+	return 0;
+}
+
+void
+Role :: remove_peer(uint64_t id) {
+	if (id != m_id) {
+		m_slots.release(id);
+	}
+}
+
+void
+Role :: clear_slot(int slot) {
+	auto bit = slot_bit(slot);
+	if (m_leader_data != nullptr) {
+		for (auto& pending : m_leader_data->m_pending_rounds) {
+			pending.second.m_acks &= ~bit;
+		}
+		m_leader_data->m_acks &= ~bit;
+		m_leader_data->m_known_followers &= ~bit;
+		m_leader_data->m_followers[slot] = FollowerProgress();
+	}
+	if (m_potential_leader_data != nullptr) {
+		m_potential_leader_data->m_acks &= ~bit;
+	}
+}
+
+void
+Role :: become_potential_leader() {
+	Stats::add(m_stats->elections_started);
+	m_state = PotentialLeader;
+	m_potential_leader_data = std::make_unique<PotentialLeaderData>();
+}
+
+void
+Role :: leader_active(uint64_t ts) {
+	m_follower_data->m_last_leader_active = ts;
+	m_follower_data->m_detector.heartbeat(ts);
+}
+
+uint64_t
+Role :: follower_timeout() const {
+	auto& detector = m_follower_data->m_detector;
+	if (m_timing.m_phi_threshold == 0 || !detector.ready()) {
+		return m_timing.m_follower_timeout;
+	}
+	// A leader waiting on a slow quorum may go quiet for up to its
+	// leadership loss window, so suspecting it earlier would only cause
+	// spurious elections.
+	uint64_t timeout = detector.suspect_after(m_timing.m_phi_threshold,
+		m_timing.m_heartbeat_interval/4.0);
+	return std::min(std::max(timeout, m_timing.m_leadership_loss), m_timing.m_follower_timeout);
+}
+
+void
+Role :: notify_commit() {
+	// Followers only report rounds they have passed to on_append.
+	auto committed = std::min(m_round, m_received);
+	if (committed <= m_commit_notified) {
+		return;
+	}
+	m_commit_notified = committed;
+	if (m_client_callbacks.on_commit != nullptr) {
+		m_client_callbacks.on_commit(committed, m_client_callbacks_data);
+	}
+}
+
+void
+Role :: leader_changed(uint64_t leader_id) {
+	Stats::add(m_stats->leader_changes);
+	if (m_client_callbacks.on_leader_change != nullptr) {
+		m_client_callbacks.on_leader_change(leader_id, m_client_callbacks_data);
+	}
+}
+
+void
+Role :: record_broadcast(uint64_t ts, uint64_t seq) {
+	auto& history = m_leader_data->m_broadcast_ts;
+	history[seq] = ts;
+	if (history.size() > BROADCAST_HISTORY) {
+		history.erase(history.begin());
+	}
+}
+
+void
+Role :: update_follower_progress(uint64_t ts, int slot, const LeaderActiveAck& msg) {
+	auto& progress = m_leader_data->m_followers[slot];
+	m_leader_data->m_known_followers |= slot_bit(slot);
+	progress.m_acks++;
+	progress.m_last_ack = ts;
+	if (msg.round > progress.m_acked_round) {
+		progress.m_acked_round = msg.round;
+	}
+
+	// Forget the catch-up frames the follower received.
+	progress.m_received = msg.received;
+	int done = 0;
+	while (done < progress.m_catch_up_frames &&
+		progress.m_catch_up[done].m_end <= msg.received) {
+		done++;
+	}
+	std::copy(progress.m_catch_up + done, progress.m_catch_up + progress.m_catch_up_frames,
+		progress.m_catch_up);
+	progress.m_catch_up_frames -= done;
+	if (progress.m_catch_up_frames > 0 &&
+		ts - progress.m_catch_up[0].m_sent_ts > m_timing.m_leadership_loss) {
+		// The frame was lost with a connection. Start over from what
+		// the follower has.
+		progress.m_catch_up_frames = 0;
+		progress.m_catch_up_next = msg.received+1;
+	}
+	if (progress.m_catch_up_next == 0 && progress.m_catch_up_frames == 0 &&
+		msg.received < msg.round) {
+		// The follower is missing rounds we committed, which it will
+		// never get from broadcasts.
+		progress.m_catch_up_next = msg.received+1;
+	}
+	auto sent = m_leader_data->m_broadcast_ts.find(msg.seq);
+	if (sent == m_leader_data->m_broadcast_ts.end() || ts < sent->second) {
+		// Too old to time.
+		return;
+	}
+	uint64_t rtt = ts - sent->second;
+	if (progress.m_rtt_ewma == 0) {
+		progress.m_rtt_ewma = rtt;
 	} else {
-		m_potential_leader_data->m_acks[msg.id] = msg.round;
+		// Same gain as TCP's smoothed RTT.
+		progress.m_rtt_ewma = progress.m_rtt_ewma - progress.m_rtt_ewma/8 + rtt/8;
+	}
+	if (rtt > progress.m_rtt_max) {
+		progress.m_rtt_max = rtt;
+	}
+}
+
+bool
+Role :: deliver(uint64_t ts, const LeaderActiveMessage& msg) {
+	if ((msg.flags & MSG_FLAG_CATCH_UP) && msg.next > m_received+1) {
+		// The leader no longer has the rounds in between.
+		Stats::add(m_stats->catch_up_skipped, msg.next-1 - m_received);
+		m_received = msg.next-1;
+	}
+	if (msg.next > m_received+1) {
+		return false;
+	}
+	for (size_t i = 0; i < msg.entries(); i++) {
+		uint64_t round = msg.next+i;
+		if (round <= m_received) {
+			// Delivered already.
+			continue;
+		}
+		auto& content = msg.entry(i);
+		if (round > msg.round) {
+			// Track the round before the callback in case it confirms right away.
+			// Committed rounds don't need acks.
+			m_follower_data->m_pending_rounds[round] = ts;
+		}
+		auto data = store(round, content);
+		if (m_client_callbacks.on_append != nullptr) {
+			m_client_callbacks.on_append(round, data, content.size(), m_client_callbacks_data);
+		}
+		retain(round, content);
+		m_received = round;
+	}
+	return true;
+}
+
+void
+Role :: retain(uint64_t round, std::string content) {
+	if (m_retain_entries == 0) {
+		return;
+	}
+	if (!m_retained.empty() && m_retained.back().m_round+1 != round) {
+		// Keep the rounds contiguous.
+		m_retained.clear();
+		m_retained_bytes = 0;
+	}
+	m_retained_bytes += content.size();
+	m_retained.push_back(RetainedEntry{round, std::move(content)});
+	trim_retained();
+}
+
+void
+Role :: trim_retained() {
+	while (!m_retained.empty() &&
+		(m_retained.size() > m_retain_entries || m_retained_bytes > m_retain_bytes)) {
+		m_retained_bytes -= m_retained.front().m_content.size();
+		m_retained.pop_front();
+	}
+}
+
+void
+Role :: truncate_retained(uint64_t round) {
+	while (!m_retained.empty() && m_retained.back().m_round > round) {
+		m_retained_bytes -= m_retained.back().m_content.size();
+		m_retained.pop_back();
+	}
+	m_received = std::min(m_received, round);
+}
+
+void
+Role :: send_catch_up(uint64_t ts, int slot) {
+	auto& progress = m_leader_data->m_followers[slot];
+	if (progress.m_snapshot != nullptr) {
+		if (send_snapshot(ts, slot)) {
+			return;
+		}
+		// Skip the rounds instead.
+		progress.m_snapshot = nullptr;
+		progress.m_snapshot_failed = true;
+	}
+
+	auto last_round = m_leader_data->m_last_round;
+	while (progress.m_catch_up_next != 0 &&
+		progress.m_catch_up_frames < CATCH_UP_FRAMES_IN_FLIGHT) {
+		if (progress.m_catch_up_next > last_round) {
+			// Caught up. Later rounds are broadcast after this point.
+			progress.m_catch_up_next = 0;
+			return;
+		}
+
+		// Resume at the oldest retained round if the follower needs
+		// older ones, or skip everything if none are retained.
+		uint64_t next = progress.m_catch_up_next;
+		if (m_retained.empty() || next > m_retained.back().m_round) {
+			next = last_round+1;
+		} else if (next < m_retained.front().m_round) {
+			next = m_retained.front().m_round;
+		}
+		if (next > progress.m_catch_up_next && start_snapshot(ts, slot)) {
+			return;
+		}
+		std::vector<std::string> contents;
+		size_t bytes = 0;
+		if (next <= last_round) {
+			for (size_t i = next - m_retained.front().m_round;
+				i < m_retained.size() && bytes < CATCH_UP_FRAME_BYTES; i++) {
+				contents.push_back(m_retained[i].m_content);
+				bytes += m_retained[i].m_content.size();
+			}
+		}
+		uint64_t end = next + contents.size() - 1;
+		Stats::add(m_stats->catch_up_frames);
+		Stats::add(m_stats->catch_up_entries, contents.size());
+
+		LeaderActiveMessage msg(m_id, m_seq, m_round, next, std::move(contents));
+		msg.flags |= MSG_FLAG_CATCH_UP;
+		m_registry.send_to_id(m_slots.id(slot), &msg);
+		progress.m_catch_up[progress.m_catch_up_frames++] = CatchUpFrame{end, ts};
+		progress.m_catch_up_next = end+1;
+	}
+}
+
+bool
+Role :: start_snapshot(uint64_t ts, int slot) {
+	auto& progress = m_leader_data->m_followers[slot];
+	auto& callbacks = m_snapshot_callbacks;
+	if (callbacks.open_snapshot == nullptr || progress.m_snapshot_failed) {
+		return false;
+	}
+	uint64_t round = 0;
+	void* handle = callbacks.open_snapshot(&round, m_snapshot_callbacks_data);
+	if (handle == nullptr) {
+		return false;
+	}
+	auto data = m_snapshot_callbacks_data;
+	auto close = callbacks.close_snapshot;
+	auto transfer = std::make_unique<SnapshotTransfer>();
+	transfer->m_handle = std::unique_ptr<void, std::function<void(void*)>>(handle,
+		[close, data](void* handle) {
+			if (close != nullptr) {
+				close(handle, data);
+			}
+		});
+	if (round < progress.m_catch_up_next || round > m_leader_data->m_last_round) {
+		// Too old to help, or ahead of us.
+		return false;
+	}
+	transfer->m_round = round;
+	transfer->m_progress_ts = ts;
+	progress.m_snapshot = std::move(transfer);
+	if (!send_snapshot(ts, slot)) {
+		progress.m_snapshot = nullptr;
+		progress.m_snapshot_failed = true;
+		return false;
+	}
+	return true;
+}
+
+bool
+Role :: send_snapshot(uint64_t ts, int slot) {
+	auto& transfer = *m_leader_data->m_followers[slot].m_snapshot;
+	if ((transfer.m_sent > transfer.m_acked || transfer.m_ended) &&
+		ts - transfer.m_progress_ts > m_timing.m_leadership_loss) {
+		// Chunks were lost with a connection. Resend from what the
+		// follower has.
+		transfer.m_sent = transfer.m_acked;
+		transfer.m_ended = false;
+		transfer.m_progress_ts = ts;
+	}
+
+	std::string chunk;
+	while (!transfer.m_ended &&
+		transfer.m_sent - transfer.m_acked < SNAPSHOT_CHUNKS_IN_FLIGHT*SNAPSHOT_CHUNK_BYTES) {
+		chunk.resize(SNAPSHOT_CHUNK_BYTES);
+		int n = m_snapshot_callbacks.read_snapshot(transfer.m_handle.get(), transfer.m_sent,
+			&chunk[0], chunk.size(), m_snapshot_callbacks_data);
+		if (n < 0) {
+			return false;
+		}
+		chunk.resize(n);
+		SnapshotChunk msg(m_id, transfer.m_round, transfer.m_sent, std::move(chunk));
+		if (n == 0) {
+			msg.flags |= MSG_FLAG_SNAPSHOT_END;
+			transfer.m_ended = true;
+		}
+		m_registry.send_to_id(m_slots.id(slot), &msg);
+		Stats::add(m_stats->snapshot_bytes, n);
+		transfer.m_sent += n;
+	}
+	return true;
+}
+
+void
+Role :: handle_snapshot_chunk(const SnapshotChunk& msg) {
+	if (m_state != Follower || msg.id != m_follower_data->m_current_leader) {
+		return;
+	}
+	auto& data = *m_follower_data;
+	auto& callbacks = m_snapshot_callbacks;
+	if (msg.offset == 0 && (msg.round != data.m_snapshot_round || !data.m_snapshot_installed)) {
+		// A new snapshot, or the leader started over.
+		data.m_snapshot_round = msg.round;
+		data.m_snapshot_offset = 0;
+		data.m_snapshot_installed = false;
+	}
+
+	SnapshotAck ack(m_id, msg.round, data.m_snapshot_offset);
+	if (msg.round != data.m_snapshot_round || msg.offset != data.m_snapshot_offset ||
+		data.m_snapshot_installed) {
+		// Out of order or already received. Say where we are.
+		if (data.m_snapshot_installed && msg.round == data.m_snapshot_round) {
+			ack.flags |= MSG_FLAG_SNAPSHOT_END;
+		}
+		m_registry.send_to_id(msg.id, &ack);
+		return;
+	}
+
+	int status = -1;
+	if (callbacks.on_snapshot_chunk != nullptr && callbacks.on_snapshot != nullptr) {
+		status = 0;
+		if (!msg.data.empty()) {
+			status = callbacks.on_snapshot_chunk(msg.round, msg.offset, msg.data.c_str(),
+				msg.data.size(), m_snapshot_callbacks_data);
+		}
+		data.m_snapshot_offset += msg.data.size();
+		if (status == 0 && (msg.flags & MSG_FLAG_SNAPSHOT_END)) {
+			status = callbacks.on_snapshot(msg.round, data.m_snapshot_offset,
+				m_snapshot_callbacks_data);
+			if (status == 0) {
+				Stats::add(m_stats->snapshots_installed);
+				data.m_snapshot_installed = true;
+				// Rounds up to the snapshot's are part of it.
+				m_received = std::max(m_received, msg.round);
+				auto& pending = data.m_pending_rounds;
+				pending.erase(pending.begin(), pending.upper_bound(msg.round));
+				ack.flags |= MSG_FLAG_SNAPSHOT_END;
+				if (m_truncate != nullptr) {
+					m_truncate(msg.round);
+				}
+				notify_commit();
+			}
+		}
+	}
+	if (status != 0) {
+		ack.flags |= MSG_FLAG_SNAPSHOT_FAILED;
+		data.m_snapshot_round = 0;
+		data.m_snapshot_offset = 0;
+	}
+	ack.offset = data.m_snapshot_offset;
+	m_registry.send_to_id(msg.id, &ack);
+}
+
+void
+Role :: handle_snapshot_ack(uint64_t ts, const SnapshotAck& msg) {
+	if (m_state != Leader) {
+		return;
+	}
+	int slot = m_slots.find(msg.id);
+	if (slot < 0) {
+		return;
+	}
+	auto& progress = m_leader_data->m_followers[slot];
+	auto& transfer = progress.m_snapshot;
+	if (transfer == nullptr || msg.round != transfer->m_round) {
+		// Not for the current transfer.
+		return;
+	}
+
+	if (msg.flags & MSG_FLAG_SNAPSHOT_FAILED) {
+		// Skip the rounds instead.
+		transfer = nullptr;
+		progress.m_snapshot_failed = true;
+	} else if (msg.flags & MSG_FLAG_SNAPSHOT_END) {
+		// Continue with the rounds after the snapshot.
+		Stats::add(m_stats->snapshots_sent);
+		progress.m_catch_up_next = transfer->m_round+1;
+		transfer = nullptr;
+	} else if (msg.offset > transfer->m_acked) {
+		transfer->m_acked = msg.offset;
+		transfer->m_progress_ts = ts;
+		if (transfer->m_sent < transfer->m_acked) {
+			transfer->m_sent = transfer->m_acked;
+		}
 	}
+	send_catch_up(ts, slot);
 }
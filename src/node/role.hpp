@@ -1,14 +1,17 @@
 #pragma once
 
 #include <map>
+#include <deque>
 #include <memory>
 #include <functional>
-#include <unordered_map>
 
 #include "ab.h"
 #include "message/message.hpp"
 #include "peer_registry.hpp"
 #include "registry.hpp"
+#include "stats.hpp"
+#include "failure_detector.hpp"
+#include "slot_map.hpp"
 
 enum State
 {
@@ -17,29 +20,220 @@ enum State
 	Follower
 };
 
+// Default number of append rounds a leader keeps in flight.
+const int DEFAULT_APPEND_WINDOW = 32;
+// Default group commit policy: every append is broadcast on its own.
+const int DEFAULT_BATCH_MAX_ENTRIES = 1;
+const int DEFAULT_BATCH_MAX_BYTES = 1024*1024;
+// Largest append, and largest batch size limit. A batch or catch-up
+// frame overshoots its limit by at most one append, so both stay well
+// within MAX_FRAME_SIZE.
+const size_t MAX_APPEND_SIZE = MAX_FRAME_SIZE/4;
+
+// Default number and total size of recent entries a role retains so a
+// leader can resend them to lagging followers.
+const size_t DEFAULT_RETAIN_ENTRIES = 65536;
+const size_t DEFAULT_RETAIN_BYTES = 64*1024*1024;
+// Catch-up frames carry about this much content.
+const size_t CATCH_UP_FRAME_BYTES = 256*1024;
+// Catch-up frames a leader streams to a follower before the follower
+// reports having received them. Heartbeats and appends queue behind at
+// most this much catch-up data.
+const int CATCH_UP_FRAMES_IN_FLIGHT = 4;
+// Snapshots are streamed in chunks of this size, with this many
+// chunks in flight.
+const size_t SNAPSHOT_CHUNK_BYTES = 64*1024;
+const size_t SNAPSHOT_CHUNKS_IN_FLIGHT = 4;
+
+// An idle leader sends a heartbeat this often.
+const uint64_t DEFAULT_HEARTBEAT_INTERVAL_NS = 50e6;
+// A leader or potential leader without a majority for this long gives up.
+const uint64_t DEFAULT_LEADERSHIP_LOSS_NS = 300e6;
+// A follower that hasn't heard from the leader for this long starts an election.
+const uint64_t DEFAULT_FOLLOWER_TIMEOUT_NS = 1000e6;
+
+// Timing holds a role's protocol timeouts, in ns.
+struct Timing
+{
+	Timing()
+	: m_heartbeat_interval(DEFAULT_HEARTBEAT_INTERVAL_NS)
+	, m_leadership_loss(DEFAULT_LEADERSHIP_LOSS_NS)
+	, m_follower_timeout(DEFAULT_FOLLOWER_TIMEOUT_NS)
+	, m_phi_threshold(DEFAULT_PHI_THRESHOLD)
+	{
+	}
+
+	// valid reports whether the timeouts work together. A leader has to
+	// heartbeat within its own loss window, and it has to give up before
+	// its followers time out and elect another leader.
+	bool
+	valid() const
+	{
+		return m_heartbeat_interval > 0 &&
+			m_heartbeat_interval < m_leadership_loss &&
+			m_leadership_loss < m_follower_timeout &&
+			m_phi_threshold >= 0 && std::isfinite(m_phi_threshold);
+	}
+
+	uint64_t m_heartbeat_interval;
+	uint64_t m_leadership_loss;
+	// With a phi threshold, followers suspect the leader once the
+	// failure detector reaches it, but never before the leadership loss
+	// window or after the follower timeout. Zero disables the detector.
+	uint64_t m_follower_timeout;
+	double   m_phi_threshold;
+}; // Timing
+
+struct PendingRound
+{
+	PendingRound()
+	: m_seq(0)
+	, m_callback_data(nullptr)
+	, m_submit_ts(0)
+	, m_broadcast_ts(0)
+	, m_acks(0)
+	{
+	}
+
+	// Sequence number the round was broadcast with.
+	uint64_t                        m_seq;
+	std::function<void(int, void*)> m_callback;
+	void*                           m_callback_data;
+	uint64_t                        m_submit_ts;
+	uint64_t                        m_broadcast_ts;
+	// Slots of the nodes that confirmed this round.
+	SlotSet                         m_acks;
+}; // PendingRound
+
+struct QueuedAppend
+{
+	std::string                     m_content;
+	std::function<void(int, void*)> m_callback;
+	void*                           m_callback_data;
+	uint64_t                        m_submit_ts;
+}; // QueuedAppend
+
+struct RetainedEntry
+{
+	uint64_t    m_round;
+	std::string m_content;
+}; // RetainedEntry
+
+// A catch-up frame that a follower hasn't reported receiving yet.
+struct CatchUpFrame
+{
+	// Last round in the frame.
+	uint64_t m_end;
+	// When it was sent. A frame not received within the leadership
+	// loss timeout was lost with a connection.
+	uint64_t m_sent_ts;
+}; // CatchUpFrame
+
+// A snapshot being streamed to a follower. The handle is closed when
+// the transfer ends, including when leadership is lost.
+struct SnapshotTransfer
+{
+	SnapshotTransfer()
+	: m_round(0)
+	, m_sent(0)
+	, m_acked(0)
+	, m_ended(false)
+	, m_progress_ts(0)
+	{
+	}
+
+	std::unique_ptr<void, std::function<void(void*)>> m_handle;
+	// Last round the snapshot includes.
+	uint64_t m_round;
+	// Bytes sent and bytes the follower reported receiving.
+	uint64_t m_sent;
+	uint64_t m_acked;
+	// Whether the last chunk was sent.
+	bool     m_ended;
+	// When the follower last made progress.
+	uint64_t m_progress_ts;
+}; // SnapshotTransfer
+
+// Number of recent broadcasts whose send time a leader remembers.
+const size_t BROADCAST_HISTORY = 1024;
+
+// What a leader knows about one follower.
+struct FollowerProgress
+{
+	FollowerProgress()
+	: m_rtt_ewma(0)
+	, m_rtt_max(0)
+	, m_acked_round(0)
+	, m_last_ack(0)
+	, m_acks(0)
+	, m_received(0)
+	, m_catch_up_next(0)
+	, m_catch_up_frames(0)
+	, m_snapshot_failed(false)
+	{
+	}
+
+	// Time from broadcasting a seq to receiving an ack for it, in ns.
+	// Append acks include the follower's confirmation time.
+	uint64_t m_rtt_ewma;
+	uint64_t m_rtt_max;
+	// Highest round the follower acked.
+	uint64_t m_acked_round;
+	uint64_t m_last_ack;
+	uint64_t m_acks;
+	// Last round the follower received in order.
+	uint64_t m_received;
+	// Next round to stream to the follower, or 0 if it isn't lagging.
+	uint64_t m_catch_up_next;
+	// Frames in flight, oldest first.
+	CatchUpFrame m_catch_up[CATCH_UP_FRAMES_IN_FLIGHT];
+	int          m_catch_up_frames;
+	// Snapshot being sent, if any. Once one fails, the follower skips
+	// rounds instead.
+	std::unique_ptr<SnapshotTransfer> m_snapshot;
+	bool         m_snapshot_failed;
+}; // FollowerProgress
+
 struct LeaderData
 {
-	LeaderData()
+	LeaderData(uint64_t round)
 	: m_last_broadcast(0)
-	, m_pending_round(0)
+	, m_last_round(round)
+	, m_acks(0)
+	, m_batch_start(0)
+	, m_batch_bytes(0)
+	, m_known_followers(0)
 	{
 	}
 
 	uint64_t                               m_last_broadcast;
-	std::function<void(int, void*)>        m_callback;
-	void*                                  m_callback_data;
-	uint64_t                               m_pending_round;
-	std::unordered_map<uint64_t, uint64_t> m_acks;
+	// Last round handed out to an append.
+	uint64_t                               m_last_round;
+	// Rounds that were broadcast but not committed yet, in round order.
+	std::map<uint64_t, PendingRound>       m_pending_rounds;
+	// Slots that acked the latest broadcast.
+	SlotSet                                m_acks;
+	// Appends waiting to be broadcast together.
+	std::vector<QueuedAppend>              m_batch;
+	uint64_t                               m_batch_start;
+	size_t                                 m_batch_bytes;
+	// Broadcast time of recent seqs.
+	std::map<uint64_t, uint64_t>           m_broadcast_ts;
+	// Progress by slot, for the slots in m_known_followers.
+	FollowerProgress                       m_followers[MAX_CLUSTER_SIZE];
+	SlotSet                                m_known_followers;
 }; // LeaderData
 
 struct PotentialLeaderData
 {
 	PotentialLeaderData()
-	: m_last_broadcast(0)
+	: m_acks(0)
+	, m_last_broadcast(0)
 	{
 	}
 
-	std::unordered_map<uint64_t, uint64_t> m_acks;
+	// Slots that acked the latest broadcast.
+	SlotSet                                m_acks;
 	uint64_t                               m_last_broadcast;
 }; // PotentialLeaderData
 
@@ -48,13 +242,24 @@ struct FollowerData
 	FollowerData()
 	: m_current_leader(0)
 	, m_last_leader_active(0)
-	, m_pending_round(0)
+	, m_snapshot_round(0)
+	, m_snapshot_offset(0)
+	, m_snapshot_installed(false)
 	{
 	}
 
-	uint64_t m_current_leader;
-	uint64_t m_last_leader_active;
-	uint64_t m_pending_round;
+	uint64_t                     m_current_leader;
+	uint64_t                     m_last_leader_active;
+	// Heartbeat arrivals from the current leader.
+	FailureDetector              m_detector;
+	// Rounds passed to on_append that haven't been confirmed yet,
+	// and when they were passed.
+	std::map<uint64_t, uint64_t> m_pending_rounds;
+	// Snapshot being received from the leader, if any, and how much
+	// of it arrived.
+	uint64_t                     m_snapshot_round;
+	uint64_t                     m_snapshot_offset;
+	bool                         m_snapshot_installed;
 }; // FollowerData
 
 class Role
@@ -68,19 +273,46 @@ public:
 	, m_seq(0)
 	, m_cluster_size(cluster_size)
 	, m_round(0)
+	, m_append_window(DEFAULT_APPEND_WINDOW)
+	, m_batch_max_entries(DEFAULT_BATCH_MAX_ENTRIES)
+	, m_batch_max_bytes(DEFAULT_BATCH_MAX_BYTES)
+	, m_batch_linger(0)
+	, m_received(0)
+	, m_commit_notified(0)
+	, m_retained_bytes(0)
+	, m_retain_entries(DEFAULT_RETAIN_ENTRIES)
+	, m_retain_bytes(DEFAULT_RETAIN_BYTES)
 	, m_client_callbacks({
 		.on_append = nullptr,
 		.gained_leadership = nullptr,
 		.lost_leadership = nullptr,
-		.on_leader_change = nullptr
+		.on_leader_change = nullptr,
+		.on_commit = nullptr,
+		.on_wal_failed = nullptr
 	})
 	, m_client_callbacks_data(nullptr)
+	, m_snapshot_callbacks({
+		.open_snapshot = nullptr,
+		.read_snapshot = nullptr,
+		.close_snapshot = nullptr,
+		.on_snapshot_chunk = nullptr,
+		.on_snapshot = nullptr
+	})
+	, m_snapshot_callbacks_data(nullptr)
+	, m_stats(std::make_shared<Stats>())
 	{
+		m_slots.slot(id);
 	}
 
 	void
 	periodic(uint64_t ts);
 
+	// next_deadline returns the earliest time periodic has something to
+	// do. It may be in the past, in which case periodic is due now. It
+	// changes whenever the role handles a message or a client call.
+	uint64_t
+	next_deadline() const;
+
 	void
 	handle_leader_active(uint64_t ts, const LeaderActiveMessage& msg);
 
@@ -88,72 +320,244 @@ public:
 	handle_leader_active_ack(uint64_t ts, const LeaderActiveAck& msg);
 
 	void
-	client_confirm_append(uint64_t round)
+	handle_snapshot_chunk(const SnapshotChunk& msg);
+
+	void
+	handle_snapshot_ack(uint64_t ts, const SnapshotAck& msg);
+
+	void
+	client_confirm_append(uint64_t ts, uint64_t round)
 	{
 		if (m_state != Follower) {
 			if (m_state == Leader) {
-				if (m_leader_data->m_pending_round != 0) {
-					m_leader_data->m_acks[m_id] = round;
+				auto pending = m_leader_data->m_pending_rounds.find(round);
+				auto self = slot_bit(m_slots.find(m_id));
+				if (pending != m_leader_data->m_pending_rounds.end() &&
+					(pending->second.m_acks & self) == 0) {
+					pending->second.m_acks |= self;
+					m_stats->confirm_latency.record(ts - pending->second.m_broadcast_ts);
 				}
 			}
 			return;
 		}
 
-		if (m_follower_data->m_pending_round != round) {
-			return;
-		}
-
-		if (m_follower_data->m_pending_round != round) {
+		auto pending = m_follower_data->m_pending_rounds.find(round);
+		if (pending == m_follower_data->m_pending_rounds.end()) {
+			// Not pending.
 			return;
 		}
+		m_stats->confirm_latency.record(ts - pending->second);
+		m_follower_data->m_pending_rounds.erase(pending);
 
 		// Send ack.
 		LeaderActiveAck ack(m_id, m_seq, round);
 		m_registry.send_to_id(m_follower_data->m_current_leader, &ack);
-		m_follower_data->m_pending_round = 0;
 	}
 
 	void
-	send_append(std::string append_content, std::function<void(int, void*)> cb, void* data)
+	send_append(uint64_t ts, std::string append_content, std::function<void(int, void*)> cb,
+		void* data)
 	{
+		Stats::add(m_stats->appends_submitted);
 		if (m_state != Leader) {
 			// Not a leader so this is an invalid operation.
+			Stats::add(m_stats->appends_rejected_not_leader);
 			cb(-1, data);
 			return;
 		}
-		if (m_leader_data->m_callback != nullptr) {
-			// There's already a pending append.
+		auto& batch = m_leader_data->m_batch;
+		if (m_leader_data->m_pending_rounds.size() + batch.size() >= m_append_window) {
+			// The append window is full.
+			Stats::add(m_stats->appends_rejected_window);
 			cb(-2, data);
 			return;
 		}
-		// Set up callbacks for the append.
-		m_leader_data->m_callback = cb;
-		m_leader_data->m_callback_data = data;
-		m_leader_data->m_pending_round = m_round+1;
+		if (append_content.size() > MAX_APPEND_SIZE) {
+			// Too big to send.
+			Stats::add(m_stats->appends_rejected_size);
+			cb(-3, data);
+			return;
+		}
+		// Queue the append for the next batch.
+		if (batch.empty()) {
+			m_leader_data->m_batch_start = ts;
+		}
+		m_leader_data->m_batch_bytes += append_content.size();
+		batch.push_back(QueuedAppend{std::move(append_content), cb, data, ts});
+		if (batch.size() >= m_batch_max_entries ||
+			m_leader_data->m_batch_bytes >= m_batch_max_bytes) {
+			flush_appends(ts);
+		}
+	}
+
+	// flush_appends broadcasts queued appends as one batch.
+	void
+	flush_appends(uint64_t ts)
+	{
+		if (m_state != Leader || m_leader_data->m_batch.empty()) {
+			return;
+		}
+		auto batch = std::move(m_leader_data->m_batch);
+		m_leader_data->m_batch.clear();
+		m_leader_data->m_batch_bytes = 0;
+
+		// Set up callbacks for each append.
+		auto seq = ++m_seq;
+		auto first_round = m_leader_data->m_last_round+1;
+		for (auto& append : batch) {
+			auto& pending = m_leader_data->m_pending_rounds[++m_leader_data->m_last_round];
+			pending.m_seq = seq;
+			pending.m_callback = append.m_callback;
+			pending.m_callback_data = append.m_callback_data;
+			pending.m_submit_ts = append.m_submit_ts;
+			pending.m_broadcast_ts = ts;
+		}
 
 		// Broadcast it.
-		LeaderActiveMessage msg(m_id, ++m_seq, m_round, m_leader_data->m_pending_round, append_content);
-		m_registry.broadcast(&msg);
-		m_leader_data->m_last_broadcast = uv_hrtime();
-		m_leader_data->m_acks.clear();
+		if (batch.size() == 1) {
+			LeaderActiveMessage msg(m_id, seq, m_round, first_round, batch[0].m_content);
+			m_registry.broadcast(&msg);
+		} else {
+			std::vector<std::string> contents;
+			contents.reserve(batch.size());
+			for (auto& append : batch) {
+				contents.push_back(std::move(append.m_content));
+			}
+			LeaderActiveMessage msg(m_id, seq, m_round, first_round, std::move(contents));
+			m_registry.broadcast(&msg);
+			for (size_t i = 0; i < batch.size(); i++) {
+				batch[i].m_content = std::move(msg.next_batch[i]);
+			}
+		}
+		m_leader_data->m_last_broadcast = ts;
+		m_leader_data->m_acks = 0;
+		record_broadcast(ts, seq);
+
+		// Send callbacks to ourselves.
+		for (size_t i = 0; i < batch.size(); i++) {
+			auto data = store(first_round+i, batch[i].m_content);
+			if (m_client_callbacks.on_append != nullptr) {
+				m_client_callbacks.on_append(first_round+i, data,
+					batch[i].m_content.size(), m_client_callbacks_data);
+			}
+			retain(first_round+i, std::move(batch[i].m_content));
+		}
+		m_received = m_leader_data->m_last_round;
+	}
 
-		// Send a callback to ourselves.
-		if (m_client_callbacks.on_append != nullptr) {
-			m_client_callbacks.on_append(m_leader_data->m_pending_round, append_content.c_str(),
-				append_content.size(), m_client_callbacks_data);
+	// flush_due_appends broadcasts queued appends once the linger time
+	// of the batch has passed.
+	void
+	flush_due_appends(uint64_t ts)
+	{
+		if (m_state != Leader || m_leader_data->m_batch.empty()) {
+			return;
+		}
+		if (ts - m_leader_data->m_batch_start >= m_batch_linger) {
+			flush_appends(ts);
 		}
 	}
 
 	void
-	cancel_append()
+	cancel_appends()
+	{
+		// Fail pending rounds in round order.
+		auto pending = std::move(m_leader_data->m_pending_rounds);
+		m_leader_data->m_pending_rounds.clear();
+		m_leader_data->m_last_round = m_round;
+		// The cancelled rounds will be reused.
+		truncate_retained(m_round);
+		auto batch = std::move(m_leader_data->m_batch);
+		m_leader_data->m_batch.clear();
+		m_leader_data->m_batch_bytes = 0;
+		Stats::add(m_stats->appends_cancelled, pending.size() + batch.size());
+		for (auto& it : pending) {
+			if (it.second.m_callback != nullptr) {
+				it.second.m_callback(-1, it.second.m_callback_data);
+			}
+		}
+		for (auto& append : batch) {
+			if (append.m_callback != nullptr) {
+				append.m_callback(-1, append.m_callback_data);
+			}
+		}
+	}
+
+	// set_batching sets the group commit policy. Appends are queued and
+	// broadcast together once max_entries or max_bytes is reached or
+	// linger_ns has passed since the first queued append. A batch can't
+	// hold more appends than the append window lets into flight.
+	int
+	set_batching(int max_entries, int max_bytes, uint64_t linger_ns)
 	{
-		if (m_leader_data->m_callback != nullptr) {
-			m_leader_data->m_callback(-1, m_leader_data->m_callback_data);
-			m_leader_data->m_callback = nullptr;
-			m_leader_data->m_callback_data = nullptr;
+		if (max_entries < 1 || max_bytes < 1 || (size_t)max_bytes > MAX_APPEND_SIZE) {
+			return -1;
+		}
+		if (max_entries > m_append_window) {
+			return -1;
 		}
+		m_batch_max_entries = max_entries;
+		m_batch_max_bytes = max_bytes;
+		m_batch_linger = linger_ns;
+		return 0;
 	}
 
+	// set_timing sets the protocol timeouts. It fails if they are
+	// inconsistent.
+	int
+	set_timing(const Timing& timing)
+	{
+		if (!timing.valid()) {
+			return -1;
+		}
+		m_timing = timing;
+		return 0;
+	}
+
+	const Timing&
+	timing() const
+	{
+		return m_timing;
+	}
+
+	// set_retention sets how many recent entries, and how many bytes of
+	// them, are kept for lagging followers. Zero disables catch-up.
+	int
+	set_retention(int max_entries, int max_bytes)
+	{
+		if (max_entries < 0 || max_bytes < 0) {
+			return -1;
+		}
+		m_retain_entries = max_entries;
+		m_retain_bytes = max_bytes;
+		trim_retained();
+		return 0;
+	}
+
+	// set_append_window sets the maximum number of append rounds
+	// a leader keeps in flight. It can't be smaller than a batch.
+	int
+	set_append_window(int window)
+	{
+		if (window < 1 || window < m_batch_max_entries) {
+			return -1;
+		}
+		m_append_window = window;
+		return 0;
+	}
+
+	// add_peer gives a node that identified itself a slot, so its acks
+	// count. Acks from other IDs are ignored. It returns -1 if every
+	// slot belongs to a connected node.
+	int
+	add_peer(uint64_t id);
+
+	// remove_peer tells the role that no connection to a node is left.
+	// Its slot keeps the node's state in case it comes back, until a
+	// new ID needs the slot.
+	void
+	remove_peer(uint64_t id);
+
 	void
 	drop_leadership(uint64_t new_leader_id)
 	{
@@ -162,9 +566,7 @@ public:
 		m_follower_data = std::make_unique<FollowerData>();
 		m_state = Follower;
 		m_follower_data->m_current_leader = new_leader_id;
-		if (m_client_callbacks.on_leader_change != nullptr) {
-			m_client_callbacks.on_leader_change(new_leader_id, m_client_callbacks_data);
-		}
+		leader_changed(new_leader_id);
 	}
 
 	void
@@ -174,6 +576,22 @@ public:
 		m_client_callbacks_data = callbacks_data;
 	}
 
+	// wal_failed tells the client that the write-ahead log failed.
+	void
+	wal_failed()
+	{
+		if (m_client_callbacks.on_wal_failed != nullptr) {
+			m_client_callbacks.on_wal_failed(m_client_callbacks_data);
+		}
+	}
+
+	void
+	set_snapshot_callbacks(ab_snapshot_callbacks_t callbacks, void* callbacks_data)
+	{
+		m_snapshot_callbacks = callbacks;
+		m_snapshot_callbacks_data = callbacks_data;
+	}
+
 	State
 	state() const
 	{
@@ -186,6 +604,79 @@ public:
 		return m_round;
 	}
 
+	uint64_t
+	seq() const
+	{
+		return m_seq;
+	}
+
+	// received returns the last round delivered in order.
+	uint64_t
+	received() const
+	{
+		return m_received;
+	}
+
+	// set_received sets the last round already delivered, such as the
+	// end of a log kept across restarts, so catch-up starts after it.
+	void
+	set_received(uint64_t round)
+	{
+		m_received = round;
+	}
+
+	// follower_progress appends the leader's view of each follower
+	// to out. Nothing is added unless this role is the leader.
+	void
+	follower_progress(uint64_t ts, std::vector<ab_peer_stats_t>& out) const
+	{
+		if (m_state != Leader) {
+			return;
+		}
+		for (auto known = m_leader_data->m_known_followers; known != 0; known &= known-1) {
+			int slot = __builtin_ctzll(known);
+			auto& progress = m_leader_data->m_followers[slot];
+			ab_peer_stats_t peer = {};
+			peer.id = m_slots.id(slot);
+			peer.rtt_ewma_ns = progress.m_rtt_ewma;
+			peer.rtt_max_ns = progress.m_rtt_max;
+			peer.acked_round = progress.m_acked_round;
+			if (m_leader_data->m_last_round > progress.m_acked_round) {
+				peer.round_lag = m_leader_data->m_last_round - progress.m_acked_round;
+			}
+			peer.last_ack_age_ns = ts - progress.m_last_ack;
+			peer.acks = progress.m_acks;
+			out.push_back(peer);
+		}
+	}
+
+	// set_store sets a function that stores every entry, on the leader
+	// and on followers, before on_append sees it. The store confirms
+	// each round with client_confirm_append once the entry is durable.
+	// It returns the stored copy, which on_append is given instead of
+	// the message, or nullptr.
+	void
+	set_store(std::function<const char*(uint64_t, const std::string&)> store)
+	{
+		m_store = store;
+	}
+
+	// set_truncate sets a function that's called with a snapshot's round
+	// once the snapshot is installed. The store no longer needs entries
+	// up to it.
+	void
+	set_truncate(std::function<void(uint64_t)> truncate)
+	{
+		m_truncate = truncate;
+	}
+
+	// set_stats sets the counters updated by this role.
+	void
+	set_stats(std::shared_ptr<Stats> stats)
+	{
+		m_stats = stats;
+	}
+
 	uint64_t
 	current_leader() const
 	{
@@ -205,6 +696,100 @@ private:
 	void
 	periodic_follower(uint64_t ts);
 
+	void
+	become_potential_leader();
+
+	// leader_active records that the current leader was heard from.
+	void
+	leader_active(uint64_t ts);
+
+	// follower_timeout returns how long a follower waits for the leader.
+	uint64_t
+	follower_timeout() const;
+
+	// record_broadcast remembers when a seq was broadcast so acks
+	// for it can be timed.
+	void
+	record_broadcast(uint64_t ts, uint64_t seq);
+
+	void
+	update_follower_progress(uint64_t ts, int slot, const LeaderActiveAck& msg);
+
+	// clear_slot forgets the acks and progress of a slot's previous ID.
+	void
+	clear_slot(int slot);
+
+	// deliver passes the entries of an append message that follow the
+	// last received round to the store and on_append. It returns false
+	// if rounds are missing before them.
+	bool
+	deliver(uint64_t ts, const LeaderActiveMessage& msg);
+
+	// retain keeps an entry for catch-up. Rounds are kept contiguous.
+	void
+	retain(uint64_t round, std::string content);
+
+	void
+	trim_retained();
+
+	// truncate_retained forgets entries after round, which a new
+	// leader may reuse.
+	void
+	truncate_retained(uint64_t round);
+
+	// send_catch_up streams retained entries to a lagging follower.
+	void
+	send_catch_up(uint64_t ts, int slot);
+
+	// start_snapshot opens a snapshot for a follower that needs rounds
+	// older than the retained ones. It returns false if there is no
+	// snapshot that gets the follower any further.
+	bool
+	start_snapshot(uint64_t ts, int slot);
+
+	// send_snapshot streams the next chunks of a follower's snapshot.
+	// It returns false if the snapshot could not be read.
+	bool
+	send_snapshot(uint64_t ts, int slot);
+
+	// has_quorum reports whether acks plus our own vote are a majority.
+	bool
+	has_quorum(SlotSet acks) const
+	{
+		return slot_count(acks) >= m_cluster_size/2;
+	}
+
+	// stored_by_majority reports whether the confirmations of a round,
+	// which include our own, are a majority. Unlike a vote, the leader
+	// only counts once it stored the round itself.
+	bool
+	stored_by_majority(SlotSet acks) const
+	{
+		return slot_count(acks) >= m_cluster_size/2 + 1;
+	}
+
+	void
+	leader_changed(uint64_t leader_id);
+
+	// notify_commit calls on_commit if rounds that were delivered
+	// have been committed since the last call.
+	void
+	notify_commit();
+
+	// store passes an entry to the store, if there is one, and returns
+	// the data to give on_append.
+	const char*
+	store(uint64_t round, const std::string& content)
+	{
+		if (m_store != nullptr) {
+			auto stored = m_store(round, content);
+			if (stored != nullptr) {
+				return stored;
+			}
+		}
+		return content.c_str();
+	}
+
 private:
 	Registry&     m_registry;
 	uint64_t      m_id;
@@ -212,6 +797,22 @@ private:
 	int           m_cluster_size;
 	State         m_state;
 	uint64_t      m_round;
+	size_t        m_append_window;
+	size_t        m_batch_max_entries;
+	size_t        m_batch_max_bytes;
+	uint64_t      m_batch_linger;
+	Timing        m_timing;
+	SlotMap       m_slots;
+	// Last round delivered with every round before it.
+	uint64_t      m_received;
+	// Last round passed to on_commit.
+	uint64_t      m_commit_notified;
+
+	// Recent entries in round order, for lagging followers.
+	std::deque<RetainedEntry> m_retained;
+	size_t        m_retained_bytes;
+	size_t        m_retain_entries;
+	size_t        m_retain_bytes;
 
 	// Per-state data
 	std::unique_ptr<LeaderData>          m_leader_data;
@@ -220,4 +821,10 @@ private:
 
 	ab_callbacks_t  m_client_callbacks;
 	void*           m_client_callbacks_data;
+	ab_snapshot_callbacks_t m_snapshot_callbacks;
+	void*           m_snapshot_callbacks_data;
+	std::function<const char*(uint64_t, const std::string&)> m_store;
+	std::function<void(uint64_t)> m_truncate;
+
+	std::shared_ptr<Stats> m_stats;
 }; // Role
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+
+// Largest supported cluster. Sets of nodes are 64-bit masks.
+const int MAX_CLUSTER_SIZE = 64;
+
+// SlotSet is a set of node slots, one bit per slot.
+typedef uint64_t SlotSet;
+
+inline SlotSet
+slot_bit(int slot)
+{
+	return ((SlotSet)1) << slot;
+}
+
+inline int
+slot_count(SlotSet set)
+{
+	return __builtin_popcountll(set);
+}
+
+// SlotMap assigns node IDs dense slots in the order they are first seen,
+// so per-node state can live in fixed arrays and sets of nodes in a
+// SlotSet. A released slot keeps its ID, so a node that comes back gets
+// it again, until every slot is taken and a new ID reuses it. Clusters
+// are small, so IDs are found with a linear scan over one or two cache
+// lines.
+class SlotMap
+{
+public:
+	SlotMap()
+	: m_size(0)
+	, m_released(0)
+	{
+	}
+
+	// find returns the slot of id, or -1 if it has none.
+	int
+	find(uint64_t id) const
+	{
+		for (int i = 0; i < m_size; i++) {
+			if (m_ids[i] == id) {
+				return i;
+			}
+		}
+		return -1;
+	}
+
+	// slot returns the slot of id, assigning one if needed. A new ID
+	// gets an unused slot, or else a released one. It returns
+	// -1 if all slots are taken. reused is set if the slot belonged to
+	// another ID, whose state the caller has to clear.
+	int
+	slot(uint64_t id, bool* reused = nullptr)
+	{
+		if (reused != nullptr) {
+			*reused = false;
+		}
+		int i = find(id);
+		if (i >= 0) {
+			m_released &= ~slot_bit(i);
+			return i;
+		}
+		if (m_size < MAX_CLUSTER_SIZE) {
+			m_ids[m_size] = id;
+			return m_size++;
+		}
+		if (m_released == 0) {
+			return -1;
+		}
+		i = __builtin_ctzll(m_released);
+		m_released &= ~slot_bit(i);
+		m_ids[i] = id;
+		if (reused != nullptr) {
+			*reused = true;
+		}
+		return i;
+	}
+
+	// release makes the slot of id available to new IDs.
+	void
+	release(uint64_t id)
+	{
+		int i = find(id);
+		if (i >= 0) {
+			m_released |= slot_bit(i);
+		}
+	}
+
+	uint64_t
+	id(int slot) const
+	{
+		return m_ids[slot];
+	}
+
+	int
+	size() const
+	{
+		return m_size;
+	}
+
+private:
+	uint64_t m_ids[MAX_CLUSTER_SIZE];
+	int      m_size;
+	SlotSet  m_released;
+}; // SlotMap
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "ab.h"
+#include "histogram.hpp"
+
+// Stats holds a node's counters. They are only written by the event loop
+// thread and may be read from any thread, so relaxed atomics are enough:
+// updates are plain increments with no locking or fences.
+struct Stats
+{
+	typedef std::atomic<uint64_t> Counter;
+
+	Stats()
+	{
+		for (int i = 0; i < AB_MSG_TYPES; i++) {
+			messages_sent[i] = 0;
+			bytes_sent[i] = 0;
+			messages_received[i] = 0;
+			bytes_received[i] = 0;
+		}
+	}
+
+	static void
+	add(Counter& c, uint64_t n = 1)
+	{
+		c.fetch_add(n, std::memory_order_relaxed);
+	}
+
+	static void
+	set(Counter& c, uint64_t v)
+	{
+		c.store(v, std::memory_order_relaxed);
+	}
+
+	static int
+	type_index(uint8_t type)
+	{
+		return type < AB_MSG_TYPES ? type : 0;
+	}
+
+	void
+	sent(uint8_t type, uint64_t bytes)
+	{
+		add(messages_sent[type_index(type)]);
+		add(bytes_sent[type_index(type)], bytes);
+	}
+
+	void
+	received(uint8_t type, uint64_t bytes)
+	{
+		add(messages_received[type_index(type)]);
+		add(bytes_received[type_index(type)], bytes);
+	}
+
+	// snapshot copies the counters into s. Each counter is read
+	// atomically, but not all of them at the same instant.
+	void
+	snapshot(ab_stats_t* s) const
+	{
+		for (int i = 0; i < AB_MSG_TYPES; i++) {
+			s->messages_sent[i] = messages_sent[i].load(std::memory_order_relaxed);
+			s->bytes_sent[i] = bytes_sent[i].load(std::memory_order_relaxed);
+			s->messages_received[i] = messages_received[i].load(std::memory_order_relaxed);
+			s->bytes_received[i] = bytes_received[i].load(std::memory_order_relaxed);
+		}
+		s->encode_failures = encode_failures.load(std::memory_order_relaxed);
+		s->decode_failures = decode_failures.load(std::memory_order_relaxed);
+		s->appends_submitted = appends_submitted.load(std::memory_order_relaxed);
+		s->appends_committed = appends_committed.load(std::memory_order_relaxed);
+		s->appends_rejected_not_leader =
+			appends_rejected_not_leader.load(std::memory_order_relaxed);
+		s->appends_rejected_window = appends_rejected_window.load(std::memory_order_relaxed);
+		s->appends_rejected_size = appends_rejected_size.load(std::memory_order_relaxed);
+		s->appends_cancelled = appends_cancelled.load(std::memory_order_relaxed);
+		s->elections_started = elections_started.load(std::memory_order_relaxed);
+		s->leadership_gained = leadership_gained.load(std::memory_order_relaxed);
+		s->leadership_lost = leadership_lost.load(std::memory_order_relaxed);
+		s->leader_changes = leader_changes.load(std::memory_order_relaxed);
+		s->reconnects = reconnects.load(std::memory_order_relaxed);
+		s->wal_records = wal_records.load(std::memory_order_relaxed);
+		s->wal_bytes = wal_bytes.load(std::memory_order_relaxed);
+		s->wal_syncs = wal_syncs.load(std::memory_order_relaxed);
+		s->wal_errors = wal_errors.load(std::memory_order_relaxed);
+		s->catch_up_frames = catch_up_frames.load(std::memory_order_relaxed);
+		s->catch_up_entries = catch_up_entries.load(std::memory_order_relaxed);
+		s->catch_up_skipped = catch_up_skipped.load(std::memory_order_relaxed);
+		s->snapshots_sent = snapshots_sent.load(std::memory_order_relaxed);
+		s->snapshot_bytes = snapshot_bytes.load(std::memory_order_relaxed);
+		s->snapshots_installed = snapshots_installed.load(std::memory_order_relaxed);
+		s->round = round.load(std::memory_order_relaxed);
+		s->seq = seq.load(std::memory_order_relaxed);
+		s->state = (int)state.load(std::memory_order_relaxed);
+	}
+
+	// Indexed by message type.
+	Counter messages_sent[AB_MSG_TYPES];
+	Counter bytes_sent[AB_MSG_TYPES];
+	Counter messages_received[AB_MSG_TYPES];
+	Counter bytes_received[AB_MSG_TYPES];
+
+	Counter encode_failures{0};
+	Counter decode_failures{0};
+
+	Counter appends_submitted{0};
+	Counter appends_committed{0};
+	Counter appends_rejected_not_leader{0};
+	Counter appends_rejected_window{0};
+	Counter appends_rejected_size{0};
+	Counter appends_cancelled{0};
+
+	Counter elections_started{0};
+	Counter leadership_gained{0};
+	Counter leadership_lost{0};
+	Counter leader_changes{0};
+	Counter reconnects{0};
+
+	Counter wal_records{0};
+	Counter wal_bytes{0};
+	Counter wal_syncs{0};
+	Counter wal_errors{0};
+
+	Counter catch_up_frames{0};
+	Counter catch_up_entries{0};
+	Counter catch_up_skipped{0};
+
+	Counter snapshots_sent{0};
+	Counter snapshot_bytes{0};
+	Counter snapshots_installed{0};
+
+	Counter round{0};
+	Counter seq{0};
+	Counter state{AB_STATE_FOLLOWER};
+
+	// Leader: from Role::send_append to commit by a majority.
+	Histogram commit_latency;
+	// Any node: from on_append to the matching confirmation.
+	Histogram confirm_latency;
+}; // Stats
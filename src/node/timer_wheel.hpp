@@ -0,0 +1,294 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+
+class TimerWheel;
+
+// WheelTimer is a timer scheduled on a TimerWheel. Timers are intrusive, so
+// scheduling and cancelling never allocate. A timer must be cancelled (or
+// have fired) before it is destroyed.
+class WheelTimer
+{
+	friend class TimerWheel;
+
+public:
+	WheelTimer()
+	: m_deadline(0)
+	, m_level(0)
+	, m_slot(0)
+	, m_scheduled(false)
+	, m_prev(nullptr)
+	, m_next(nullptr)
+	{
+	}
+
+	WheelTimer(std::function<void()> callback)
+	: WheelTimer()
+	{
+		m_callback = callback;
+	}
+
+	// Timers are linked into the wheel by address.
+	WheelTimer(const WheelTimer&) = delete;
+	WheelTimer& operator =(const WheelTimer&) = delete;
+
+	void
+	set_callback(std::function<void()> callback)
+	{
+		m_callback = callback;
+	}
+
+	bool
+	scheduled() const
+	{
+		return m_scheduled;
+	}
+
+	uint64_t
+	deadline() const
+	{
+		return m_deadline;
+	}
+
+private:
+	std::function<void()> m_callback;
+	uint64_t              m_deadline;
+	int                   m_level;
+	int                   m_slot;
+	bool                  m_scheduled;
+	WheelTimer*           m_prev;
+	WheelTimer*           m_next;
+}; // WheelTimer
+
+// TimerWheel is a hierarchical timing wheel with millisecond ticks.
+// Each level has 64 slots, and a slot at level L covers 64^L ticks, so
+// scheduling and cancelling are O(1) and a timer is moved down at most
+// LEVELS-1 times before it fires. Each level keeps a bitmap of occupied
+// slots, which makes finding the next deadline cheap. The levels span
+// 2^36 ticks. A deadline past the end of the current top level span
+// waits in an overflow list until the wheel gets there, which takes at
+// most one span since delays are clamped to MAX_DELAY.
+//
+// The wheel doesn't read a clock. The owner calls advance with the
+// current time and asks next_deadline how long it may sleep.
+class TimerWheel
+{
+public:
+	static const int SLOT_BITS = 6;
+	static const int SLOTS = 1 << SLOT_BITS;
+	static const int LEVELS = 6;
+	// Deadlines further out than this are clamped.
+	static const uint64_t MAX_DELAY = ((uint64_t)1 << (SLOT_BITS*LEVELS)) - 1;
+	// Ticks within a top level span.
+	static const uint64_t SPAN_MASK = MAX_DELAY;
+
+	TimerWheel(uint64_t now = 0)
+	: m_now(now)
+	, m_overflow(nullptr)
+	{
+		for (int level = 0; level < LEVELS; level++) {
+			m_occupied[level] = 0;
+			for (int slot = 0; slot < SLOTS; slot++) {
+				m_slots[level][slot] = nullptr;
+			}
+		}
+	}
+
+	// now returns the last time the wheel was advanced to.
+	uint64_t
+	now() const
+	{
+		return m_now;
+	}
+
+	// schedule (re)schedules timer to fire at deadline. Deadlines that
+	// have already passed fire on the next tick.
+	void
+	schedule(WheelTimer* timer, uint64_t deadline)
+	{
+		cancel(timer);
+		if (deadline <= m_now) {
+			deadline = m_now + 1;
+		} else if (deadline - m_now > MAX_DELAY) {
+			deadline = m_now + MAX_DELAY;
+		}
+		timer->m_deadline = deadline;
+		timer->m_scheduled = true;
+		insert(timer);
+	}
+
+	void
+	cancel(WheelTimer* timer)
+	{
+		if (!timer->m_scheduled) {
+			return;
+		}
+		unlink(timer);
+		timer->m_scheduled = false;
+	}
+
+	// next_deadline returns the earliest time advance has work to do, or
+	// UINT64_MAX if nothing is scheduled. That's either the deadline of a
+	// timer due within the next 64 ticks or the time a higher level slot
+	// or the overflow list has to be cascaded, so it may be earlier than
+	// any timer's deadline.
+	uint64_t
+	next_deadline() const
+	{
+		uint64_t next = UINT64_MAX;
+		if (m_overflow != nullptr) {
+			next = (m_now | SPAN_MASK) + 1;
+		}
+		for (int level = 0; level < LEVELS; level++) {
+			if (m_occupied[level] == 0) {
+				continue;
+			}
+			int shift = level * SLOT_BITS;
+			// Timers only ever sit in slots ahead of the current one,
+			// within the same span of the level above.
+			int current = (int)((m_now >> shift) & (SLOTS-1));
+			int slot = first_occupied(level, current + 1);
+			uint64_t base = m_now & ~((((uint64_t)1) << (shift + SLOT_BITS)) - 1);
+			uint64_t t = base + ((uint64_t)slot << shift);
+			if (t < next) {
+				next = t;
+			}
+		}
+		return next;
+	}
+
+	// advance moves the wheel to now and fires every timer due by then.
+	// Callbacks may schedule and cancel timers.
+	void
+	advance(uint64_t now)
+	{
+		while (m_now < now) {
+			uint64_t next = next_deadline();
+			if (next > now) {
+				// Nothing to do in between.
+				m_now = now;
+				return;
+			}
+			// No occupied slot is passed on the way to next.
+			m_now = next - 1;
+			tick();
+		}
+	}
+
+private:
+	void
+	tick()
+	{
+		m_now++;
+		if ((m_now & SPAN_MASK) == 0) {
+			// A new top level span. Overflowed timers fit in it now.
+			WheelTimer* timer = m_overflow;
+			m_overflow = nullptr;
+			while (timer != nullptr) {
+				auto next = timer->m_next;
+				insert(timer);
+				timer = next;
+			}
+		}
+		// Cascade the slots whose span starts now, higher levels first
+		// so their timers can fall through to lower levels.
+		for (int level = LEVELS-1; level > 0; level--) {
+			int shift = level * SLOT_BITS;
+			if ((m_now & ((((uint64_t)1) << shift) - 1)) != 0) {
+				continue;
+			}
+			int slot = (int)((m_now >> shift) & (SLOTS-1));
+			WheelTimer* timer = m_slots[level][slot];
+			m_slots[level][slot] = nullptr;
+			m_occupied[level] &= ~(((uint64_t)1) << slot);
+			while (timer != nullptr) {
+				auto next = timer->m_next;
+				insert(timer);
+				timer = next;
+			}
+		}
+
+		// Fire one timer at a time, since a callback may cancel
+		// another timer in the same slot.
+		int slot = (int)(m_now & (SLOTS-1));
+		while (m_slots[0][slot] != nullptr) {
+			auto timer = m_slots[0][slot];
+			unlink(timer);
+			timer->m_scheduled = false;
+			if (timer->m_callback != nullptr) {
+				timer->m_callback();
+			}
+		}
+	}
+
+	void
+	insert(WheelTimer* timer)
+	{
+		// The level is the highest SLOT_BITS group where the deadline
+		// and now differ.
+		uint64_t diff = timer->m_deadline ^ m_now;
+		int level = diff == 0 ? 0 : (63 - __builtin_clzll(diff)) / SLOT_BITS;
+		if (level >= LEVELS) {
+			// Past the current top level span.
+			timer->m_level = LEVELS;
+			timer->m_slot = 0;
+			timer->m_prev = nullptr;
+			timer->m_next = m_overflow;
+			if (timer->m_next != nullptr) {
+				timer->m_next->m_prev = timer;
+			}
+			m_overflow = timer;
+			return;
+		}
+		int slot = (int)((timer->m_deadline >> (level * SLOT_BITS)) & (SLOTS-1));
+		timer->m_level = level;
+		timer->m_slot = slot;
+		timer->m_prev = nullptr;
+		timer->m_next = m_slots[level][slot];
+		if (timer->m_next != nullptr) {
+			timer->m_next->m_prev = timer;
+		}
+		m_slots[level][slot] = timer;
+		m_occupied[level] |= ((uint64_t)1) << slot;
+	}
+
+	void
+	unlink(WheelTimer* timer)
+	{
+		bool overflow = timer->m_level == LEVELS;
+		auto& head = overflow ? m_overflow : m_slots[timer->m_level][timer->m_slot];
+		if (timer->m_prev != nullptr) {
+			timer->m_prev->m_next = timer->m_next;
+		} else {
+			head = timer->m_next;
+		}
+		if (timer->m_next != nullptr) {
+			timer->m_next->m_prev = timer->m_prev;
+		}
+		if (!overflow && head == nullptr) {
+			m_occupied[timer->m_level] &= ~(((uint64_t)1) << timer->m_slot);
+		}
+		timer->m_prev = nullptr;
+		timer->m_next = nullptr;
+	}
+
+	// first_occupied returns the first occupied slot at or after from.
+	// The level must have one.
+	int
+	first_occupied(int level, int from) const
+	{
+		uint64_t bits = m_occupied[level];
+		if (from > 0) {
+			bits &= ~((uint64_t)0) << from;
+		}
+		return __builtin_ctzll(bits);
+	}
+
+private:
+	uint64_t    m_now;
+	WheelTimer* m_slots[LEVELS][SLOTS];
+	uint64_t    m_occupied[LEVELS];
+	// Timers due after the current top level span.
+	WheelTimer* m_overflow;
+}; // TimerWheel
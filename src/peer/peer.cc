@@ -1,55 +1,72 @@
 #include "peer.hpp"
 
+void
+Peer :: close_stream(uv_stream_t* stream)
+{
+	uv_close((uv_handle_t*)stream, [](uv_handle_t* handle) {
+		auto self = (Peer*)handle->data;
+		self->m_active = false;
+		self->m_tcp = nullptr;
+		self->m_write_queue.clear();
+		self->schedule_reconnect();
+		if (self->m_on_close != nullptr) {
+			self->m_on_close();
+		}
+	});
+}
+
 void
 Peer :: run() {
-	m_last_reconnect = uv_hrtime();
+	// Every message is small and latency bound, and frames are already
+	// coalesced into one write per loop iteration, so don't let Nagle's
+	// algorithm hold them back.
+	uv_tcp_nodelay(m_tcp.get(), 1);
 	uv_read_start((uv_stream_t*)m_tcp.get(),
 		// Buffer allocation callback
 		[](uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
-			buf->base = ((Peer*)handle->data)->m_alloc_buf;
-			buf->len = READ_BUFFER_SIZE;
+			auto self = (Peer*)handle->data;
+			auto& read_buf = self->m_read_buf;
+			size_t want = READ_BUFFER_SIZE;
+			// Make room for the rest of a partially read frame.
+			auto msg_length = self->m_codec->decode_message_length(read_buf.data(),
+				read_buf.size());
+			if (msg_length > 0 && (size_t)msg_length > read_buf.size() + want) {
+				want = std::min<size_t>(msg_length, READ_RESERVE_LIMIT) - read_buf.size();
+			}
+			size_t free;
+			buf->base = (char*)read_buf.reserve(want, &free);
+			buf->len = free;
 		},
 
 		// On read callback
 		[](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
 			auto peer = (Peer*)stream->data;
 			if (nread < 0) {
-				uv_close((uv_handle_t*)stream, [](uv_handle_t* handle) {
-					auto self = (Peer*)handle->data;
-					self->m_active = false;
-					self->m_tcp = nullptr;
-					// Make sure our reconnect time is at least a few seconds
-					// after now.
-					self->m_last_reconnect = uv_hrtime();
-				});
+				close_stream(stream);
 				return;
 			}
-			for (int i = 0; i < nread; i++) {
-				peer->m_read_buf.push_back(buf->base[i]);
-				peer->m_pending_msg_size++;
-			}
+			peer->m_read_buf.commit(nread);
 			while (true) {
-				auto msg_length = peer->m_codec->decode_message_length(peer->m_read_buf.data(),
-					peer->m_read_buf.size());
-				if (msg_length > 0 && peer->m_pending_msg_size >= msg_length) {
-					peer->process_message_data(peer->m_read_buf.data(), msg_length);
-					// Trim the buffer.
-					std::vector<uint8_t> replacement;
-					for (auto& i : peer->m_read_buf) {
-						if (msg_length > 0) {
-							msg_length--;
-							continue;
-						}
-						replacement.push_back(i);
-					}
-					//peer->m_read_buf.erase(peer->m_read_buf.begin(),
-					//	peer->m_read_buf.begin()+msg_length);
-					peer->m_read_buf = std::move(replacement);
-					//peer->m_pending_msg_size -= msg_length;
-					peer->m_pending_msg_size = peer->m_read_buf.size();
-				} else {
+				// Processing a message may move this stream and its buffer
+				// to another peer, so look the peer up for every frame.
+				peer = (Peer*)stream->data;
+				auto& read_buf = peer->m_read_buf;
+				auto msg_length = peer->m_codec->decode_message_length(read_buf.data(),
+					read_buf.size());
+				if (msg_length < -1) {
+					// Not a frame we'd accept. The stream can't be
+					// parsed past it.
+					Stats::add(peer->m_stats->decode_failures);
+					close_stream(stream);
+					return;
+				}
+				if (msg_length <= 0 || read_buf.size() < (size_t)msg_length) {
 					break;
 				}
+				// Consume the frame before processing it in place.
+				auto frame = read_buf.data();
+				read_buf.consume(msg_length);
+				peer->process_message_data(frame, msg_length);
 			}
 		}
 	);
@@ -59,11 +76,14 @@ void
 Peer :: process_message_data(uint8_t* data, int size)
 {
 	std::unique_ptr<Message> m;
-	if (m_codec->decode_message(m, data, size) >= 0) {
-		m->source = m_index;
-		if (m_send_to_node != nullptr) {
-			m_send_to_node(m.get());
-		}
+	if (m_codec->decode_message(m, data, size) < 0) {
+		Stats::add(m_stats->decode_failures);
+		return;
+	}
+	m_stats->received(m->type, size);
+	m->source = m_index;
+	if (m_send_to_node != nullptr) {
+		m_send_to_node(m.get());
 	}
 }
 
@@ -72,36 +92,28 @@ Peer :: init_loop_handles()
 {
 	m_tcp->data = this;
 	m_loop = m_tcp->loop;
-	uv_timer_init(m_loop, m_timer);
-	m_timer->data = this;
-	uv_timer_start(m_timer, [](uv_timer_t* timer) {
-		auto self = (Peer*)timer->data;
-		self->periodic();
-	}, 16, 16);
+	m_reconnect_timer.set_callback([this]() {
+		// A connection may have been accepted from the peer meanwhile.
+		if (!m_active && m_valid) {
+			reconnect();
+		}
+	});
 }
 
 void
-Peer :: periodic()
+Peer :: schedule_reconnect()
 {
-	if (!m_active) {
-		// We don't have an active connection. The only thing we can do is attempt
-		// a reconnection.
-		if (!m_valid) {
-			// Can't reconnect since we don't have a valid address.
-			return;
-		}
-		auto now = uv_hrtime();
-		if (now - m_last_reconnect > 3e9) {
-			reconnect();
-			m_last_reconnect = now;
-		}
+	if (!m_valid) {
+		// Can't reconnect since we don't have a valid address.
 		return;
 	}
+	m_wheel.schedule(&m_reconnect_timer, uv_now(m_loop) + m_reconnect_delay);
 }
 
 void
 Peer :: reconnect()
 {
+	Stats::add(m_stats->reconnects);
 	if (m_tcp == nullptr) {
 		m_tcp = std::make_unique<uv_tcp_t>();
 		if (uv_tcp_init(m_loop, m_tcp.get()) < 0) {
@@ -125,6 +137,7 @@ Peer :: reconnect()
 				uv_close((uv_handle_t*)self->m_tcp.get(), [](uv_handle_t* handle) {
 					auto self = (Peer*)handle->data;
 					self->m_tcp = nullptr;
+					self->schedule_reconnect();
 				});
 				delete req;
 				return;
@@ -132,7 +145,7 @@ Peer :: reconnect()
 			auto self = (Peer*)req->data;
 			self->run();
 			self->m_active = true;
-			self->send(&(self->m_node_ident_msg));
+			self->send(&(self->m_node_ident_msg), true);
 			delete req;
 		});
 }
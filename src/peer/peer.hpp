@@ -6,43 +6,72 @@
 #include <functional>
 #include <cpl/net/sockaddr.hpp>
 
+#include "read_buffer.hpp"
+#include "node/stats.hpp"
+#include "node/timer_wheel.hpp"
 #include "message/codec.hpp"
 
+// Minimum free space offered to each read.
 const int READ_BUFFER_SIZE = 16*1024;
+// Initial capacity of a peer's read buffer.
+const int READ_BUFFER_CAPACITY = 4*READ_BUFFER_SIZE;
+// Room for a partially read frame is reserved up front up to this size.
+// Bigger frames grow the buffer as their bytes arrive, so a length
+// prefix alone can't make a peer allocate much.
+const int READ_RESERVE_LIMIT = 1024*1024;
+// Default delay between reconnection attempts.
+const uint64_t DEFAULT_RECONNECT_DELAY_MS = 3000;
 
 class Peer
 {
+	// A vectored write and the frames it references.
+	struct WriteRequest
+	{
+		uv_write_t                                req;
+		std::vector<std::shared_ptr<const Frame>> frames;
+	};
+
 public:
 	Peer(std::shared_ptr<Codec> codec,
+		 std::shared_ptr<Stats> stats,
+		 TimerWheel& wheel,
 		 std::function<void(const Message*)> send_to_node,
 		 std::unique_ptr<uv_tcp_t> conn,
 		 IdentityMessage node_ident_msg)
 	: m_codec(codec)
+	, m_stats(stats)
+	, m_wheel(wheel)
 	, m_send_to_node(send_to_node)
 	, m_active(true)
+	, m_reconnect_delay(DEFAULT_RECONNECT_DELAY_MS)
 	, m_tcp(std::move(conn))
-	, m_timer(new uv_timer_t)
 	, m_valid(false)
+	, m_id(0)
 	, m_node_ident_msg(node_ident_msg)
-	, m_pending_msg_size(0)
+	, m_read_buf(READ_BUFFER_CAPACITY)
 	{
 		init_loop_handles();
 		run();
 	}
 
 	Peer(std::shared_ptr<Codec> codec,
+		 std::shared_ptr<Stats> stats,
+		 TimerWheel& wheel,
 		 std::function<void(const Message*)> send_to_node,
 		 cpl::net::SockAddr& addr, std::unique_ptr<uv_tcp_t> conn,
 		 IdentityMessage node_ident_msg)
 	: m_codec(codec)
+	, m_stats(stats)
+	, m_wheel(wheel)
 	, m_send_to_node(send_to_node)
 	, m_active(false)
+	, m_reconnect_delay(DEFAULT_RECONNECT_DELAY_MS)
 	, m_tcp(std::move(conn))
-	, m_timer(new uv_timer_t)
 	, m_valid(true)
+	, m_id(0)
 	, m_address(addr.str())
 	, m_node_ident_msg(node_ident_msg)
-	, m_pending_msg_size(0)
+	, m_read_buf(READ_BUFFER_CAPACITY)
 	{
 		init_loop_handles();
 
@@ -60,11 +89,12 @@ public:
 					uv_close((uv_handle_t*)tcp_handle, [](uv_handle_t* handle) {
 						delete handle;
 					});
+					self->schedule_reconnect();
 					return;
 				}
 				self->m_active = true;
 				self->run();
-				self->send(&self->m_node_ident_msg);
+				self->send(&self->m_node_ident_msg, true);
 			});
 	}
 
@@ -95,12 +125,16 @@ public:
 		}
 		m_tcp = std::move(rhs.m_tcp);
 		m_tcp->data = this;
+		// This peer is connected now, and the other one is dropped.
+		m_wheel.cancel(&m_reconnect_timer);
+		m_wheel.cancel(&rhs.m_reconnect_timer);
 		m_address = rhs.m_address;
 		m_id = rhs.m_id;
 		m_valid = true;
 		m_active = true;
 		m_read_buf = std::move(rhs.m_read_buf);
-		m_pending_msg_size = rhs.m_pending_msg_size;
+		m_write_queue = std::move(rhs.m_write_queue);
+		rhs.m_write_queue.clear();
 		rhs.m_valid = false;
 		rhs.m_active = false;
 		return *this;
@@ -114,33 +148,72 @@ public:
 		m_valid = true;
 	}
 
+	// send packs and queues a message. Queued frames are written together
+	// at the end of the event loop iteration unless flush_now is set.
 	void
-	send(const Message* msg)
+	send(const Message* msg, bool flush_now = false)
 	{
-		if (!m_active || m_tcp == nullptr) {
+		if (!active()) {
 			return;
 		}
-		int size = msg->packed_size();
-		auto buf = new uint8_t[size];
-		for (int i = 0; i < size; ++i) {
-			buf[i] = 0;
-		}
-		uv_buf_t a[] = {
-			{.base = (char*)buf, .len = (size_t)size}
-		};
-		auto ret = m_codec->pack_message(msg, buf, size);
-		if (ret < 0) {
+		auto frame = m_codec->pack_frame(msg);
+		if (frame == nullptr) {
 			// Packing failed.
-			delete[] buf;
+			Stats::add(m_stats->encode_failures);
+			return;
+		}
+		m_stats->sent(msg->type, frame->size());
+		send_frame(frame, flush_now);
+	}
+
+	// send_frame queues an already packed frame. The frame is
+	// kept alive until its write completes. It isn't counted in the
+	// stats, since the message type of a sealed frame is unknown.
+	void
+	send_frame(std::shared_ptr<const Frame> frame, bool flush_now = false)
+	{
+		if (!active()) {
+			return;
+		}
+		m_write_queue.push_back(std::move(frame));
+		if (flush_now) {
+			flush();
+		}
+	}
+
+	// flush writes all queued frames with a single vectored write.
+	void
+	flush()
+	{
+		if (m_write_queue.empty()) {
+			return;
+		}
+		if (!active()) {
+			m_write_queue.clear();
 			return;
 		}
-		auto req = new uv_write_t;
-		req->data = buf;
-		uv_write(req, (uv_stream_t*)m_tcp.get(), a, 1, [](uv_write_t* req, int) {
-			auto buf = (uint8_t*)(req->data);
-			delete buf;
+		m_write_bufs.clear();
+		for (auto& frame : m_write_queue) {
+			m_write_bufs.push_back({.base = (char*)frame->data(), .len = frame->size()});
+		}
+		auto req = new WriteRequest;
+		req->req.data = req;
+		req->frames.swap(m_write_queue);
+		auto status = uv_write(&req->req, (uv_stream_t*)m_tcp.get(), m_write_bufs.data(),
+			m_write_bufs.size(),
+			[](uv_write_t* req, int) {
+				delete (WriteRequest*)(req->data);
+			});
+		if (status < 0) {
+			// The callback won't run, so the frames are dropped here.
 			delete req;
-		});
+		}
+	}
+
+	bool
+	active()
+	{
+		return m_active && m_tcp != nullptr;
 	}
 
 	void
@@ -149,6 +222,22 @@ public:
 		m_index = index;
 	}
 
+	// set_reconnect_delay sets the delay between reconnection attempts,
+	// starting with the next one scheduled.
+	void
+	set_reconnect_delay(uint64_t delay_ms)
+	{
+		m_reconnect_delay = delay_ms;
+	}
+
+	// set_on_close sets a callback for when the peer's connection is
+	// closed.
+	void
+	set_on_close(std::function<void()> on_close)
+	{
+		m_on_close = on_close;
+	}
+
 	bool
 	done()
 	{
@@ -157,10 +246,7 @@ public:
 
 	~Peer()
 	{
-		uv_timer_stop(m_timer);
-		uv_close((uv_handle_t*)(m_timer), [](uv_handle_t* handle) {
-			delete handle;
-		});
+		m_wheel.cancel(&m_reconnect_timer);
 		if (m_tcp != nullptr) {
 			auto old_handle = m_tcp.release();
 			uv_close((uv_handle_t*)old_handle, [](uv_handle_t* handle) {
@@ -176,30 +262,40 @@ private:
 	void
 	init_loop_handles();
 
+	// schedule_reconnect schedules a reconnection attempt after
+	// the reconnect delay if the peer has a valid address.
 	void
-	periodic();
+	schedule_reconnect();
 
 	void
 	reconnect();
 
+	// close_stream closes a peer's connection. The peer reconnects
+	// after the reconnect delay.
+	static void
+	close_stream(uv_stream_t* stream);
+
 	void
 	process_message_data(uint8_t* data, int size);
 
 private:
 	std::shared_ptr<Codec>              m_codec;
+	std::shared_ptr<Stats>              m_stats;
+	TimerWheel&                         m_wheel;
+	WheelTimer                          m_reconnect_timer;
 	std::function<void(const Message*)> m_send_to_node;
+	std::function<void()>               m_on_close;
 	bool                                m_active;
+	uint64_t                            m_reconnect_delay;
 	bool                                m_valid;
 	std::unique_ptr<uv_tcp_t>           m_tcp;
-	uv_timer_t*                         m_timer;
 	uv_loop_t*                          m_loop;
 	int                                 m_index;
 	uint64_t                            m_id;
 	std::string                         m_address;
-	uint64_t                            m_last_reconnect;
 	IdentityMessage                     m_node_ident_msg;
 
-	char                                m_alloc_buf[READ_BUFFER_SIZE];
-	std::vector<uint8_t>                m_read_buf;
-	int                                 m_pending_msg_size;
+	ReadBuffer                          m_read_buf;
+	std::vector<std::shared_ptr<const Frame>> m_write_queue;
+	std::vector<uv_buf_t>               m_write_bufs;
 }; // Peer
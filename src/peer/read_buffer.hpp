@@ -0,0 +1,129 @@
+#pragma once
+
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+// ReadBuffer is a growable buffer for data read from a stream.
+// Reads go directly into its free space and frames are parsed in place.
+// Unread data is only moved to the front of the buffer when the free
+// space runs low. A buffer that grew for a large frame shrinks back to
+// its initial capacity once the unread data fits in it again.
+class ReadBuffer
+{
+public:
+	ReadBuffer(size_t capacity)
+	: m_data(new uint8_t[capacity])
+	, m_capacity(capacity)
+	, m_initial_capacity(capacity)
+	, m_begin(0)
+	, m_end(0)
+	{
+	}
+
+	ReadBuffer(ReadBuffer&& rhs)
+	{
+		*this = std::move(rhs);
+	}
+
+	ReadBuffer& operator =(ReadBuffer&& rhs)
+	{
+		m_data = std::move(rhs.m_data);
+		m_capacity = rhs.m_capacity;
+		m_initial_capacity = rhs.m_initial_capacity;
+		m_begin = rhs.m_begin;
+		m_end = rhs.m_end;
+		rhs.m_capacity = 0;
+		rhs.m_begin = 0;
+		rhs.m_end = 0;
+		return *this;
+	}
+
+	// Disable copying.
+	ReadBuffer(const ReadBuffer& rhs) = delete;
+	ReadBuffer& operator =(ReadBuffer& rhs) = delete;
+
+	// reserve makes at least min_free bytes available after the unread
+	// data. It returns the free space and sets free to its size.
+	uint8_t*
+	reserve(size_t min_free, size_t* free)
+	{
+		auto unread = size();
+		if (m_capacity > m_initial_capacity && unread + min_free <= m_initial_capacity) {
+			// Shrink.
+			reallocate(m_initial_capacity);
+		} else if (m_capacity - m_end < min_free) {
+			if (unread + min_free <= m_capacity) {
+				// Compact.
+				memmove(m_data.get(), m_data.get() + m_begin, unread);
+				m_begin = 0;
+				m_end = unread;
+			} else {
+				// Grow.
+				reallocate(std::max(m_capacity*2, unread + min_free));
+			}
+		}
+		*free = m_capacity - m_end;
+		return m_data.get() + m_end;
+	}
+
+	size_t
+	capacity() const
+	{
+		return m_capacity;
+	}
+
+	// commit marks n bytes of the reserved space as read.
+	void
+	commit(size_t n)
+	{
+		m_end += n;
+	}
+
+	// consume drops n bytes from the front of the unread data.
+	// The consumed bytes stay valid until the next reserve.
+	void
+	consume(size_t n)
+	{
+		m_begin += n;
+		if (m_begin == m_end) {
+			m_begin = 0;
+			m_end = 0;
+		}
+	}
+
+	uint8_t*
+	data()
+	{
+		return m_data.get() + m_begin;
+	}
+
+	size_t
+	size() const
+	{
+		return m_end - m_begin;
+	}
+
+private:
+	// reallocate moves the unread data to the front of a new buffer.
+	void
+	reallocate(size_t capacity)
+	{
+		auto unread = size();
+		std::unique_ptr<uint8_t[]> data(new uint8_t[capacity]);
+		if (unread > 0) {
+			memcpy(data.get(), m_data.get() + m_begin, unread);
+		}
+		m_data = std::move(data);
+		m_capacity = capacity;
+		m_begin = 0;
+		m_end = unread;
+	}
+
+	std::unique_ptr<uint8_t[]> m_data;
+	size_t                     m_capacity;
+	size_t                     m_initial_capacity;
+	size_t                     m_begin;
+	size_t                     m_end;
+}; // ReadBuffer
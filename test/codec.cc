@@ -0,0 +1,151 @@
+#include <catch.hpp>
+
+#include <new>
+#include <atomic>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+
+#include "message/codec.hpp"
+
+// Heap allocations can only be counted by replacing operator new for the
+// whole binary, so it only counts while a CountAllocations is in scope
+// and otherwise just allocates.
+static std::atomic<bool> counting(false);
+static std::atomic<size_t> allocations(0);
+
+struct CountAllocations
+{
+	CountAllocations()
+	{
+		allocations = 0;
+		counting = true;
+	}
+
+	~CountAllocations()
+	{
+		counting = false;
+	}
+
+	size_t
+	count() const
+	{
+		return allocations.load();
+	}
+}; // CountAllocations
+
+void*
+operator new(size_t size) {
+	if (counting) {
+		allocations++;
+	}
+	void* p = malloc(size ? size : 1);
+	if (p == nullptr) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void
+operator delete(void* p) noexcept {
+	free(p);
+}
+
+void
+operator delete(void* p, size_t) noexcept {
+	free(p);
+}
+
+static const std::string test_key = "0123456789abcdef0123456789abcdef";
+
+TEST_CASE("Codec pack_message and open_frame don't allocate") {
+	Codec codec;
+	SECTION("with a key") {
+		REQUIRE(codec.set_key(test_key) == 0);
+	}
+	SECTION("with SHA-512") {
+	}
+	SECTION("with CRC32C") {
+		REQUIRE(codec.set_checksum(CHECKSUM_CRC32C) == 0);
+	}
+
+	LeaderActiveMessage msg(1, 2, 3, 4, std::string(5000, 'x'));
+	std::vector<uint8_t> buf(msg.packed_size());
+
+	// REQUIRE allocates, so only check the results after the loop.
+	int failures = 0;
+	size_t allocated;
+	{
+		CountAllocations counter;
+		for (int i = 0; i < 100; i++) {
+			failures += codec.pack_message(&msg, buf.data(), buf.size()) != 0;
+			failures += codec.open_frame(buf.data(), buf.size()) != 0;
+		}
+		allocated = counter.count();
+	}
+	REQUIRE(failures == 0);
+	REQUIRE(allocated == 0);
+
+	// The opened frame holds the packed message.
+	std::vector<uint8_t> plain(msg.packed_size());
+	REQUIRE(msg.pack(plain.data(), plain.size()) == (int)plain.size());
+	// Skip the length, nonce or hash, type and flags.
+	const int body = 4+24+2;
+	REQUIRE(buf[body-2] == MSG_LEADER_ACTIVE);
+	REQUIRE(memcmp(buf.data()+body, plain.data()+body, plain.size()-body-16) == 0);
+
+	// Decoding allocates the message, so it isn't counted.
+	std::unique_ptr<Message> m;
+	REQUIRE(codec.pack_message(&msg, buf.data(), buf.size()) == 0);
+	REQUIRE(codec.decode_message(m, buf.data(), buf.size()) == 0);
+	auto la = (LeaderActiveMessage*)m.get();
+	REQUIRE(la->next_content == msg.next_content);
+	REQUIRE(la->round == 3);
+}
+
+TEST_CASE("Codec rejects tampered frames") {
+	Codec codec;
+	REQUIRE(codec.set_key(test_key) == 0);
+	LeaderActiveAck msg(1, 2, 3);
+	std::vector<uint8_t> buf(msg.packed_size());
+
+	for (size_t i = 4; i < buf.size(); i++) {
+		REQUIRE(codec.pack_message(&msg, buf.data(), buf.size()) == 0);
+		buf[i] ^= 0x80;
+		REQUIRE(codec.open_frame(buf.data(), buf.size()) < 0);
+	}
+
+	// Frames sealed with another key are rejected.
+	Codec other;
+	REQUIRE(other.set_key(std::string(32, 'k')) == 0);
+	REQUIRE(other.pack_message(&msg, buf.data(), buf.size()) == 0);
+	REQUIRE(codec.open_frame(buf.data(), buf.size()) < 0);
+}
+
+TEST_CASE("Codec nonces are unique") {
+	Codec codec;
+	REQUIRE(codec.set_key(test_key) == 0);
+	LeaderActiveAck msg(1, 2, 3);
+	std::vector<uint8_t> a(msg.packed_size());
+	std::vector<uint8_t> b(msg.packed_size());
+
+	REQUIRE(codec.pack_message(&msg, a.data(), a.size()) == 0);
+	REQUIRE(codec.pack_message(&msg, b.data(), b.size()) == 0);
+	// Same prefix, next counter value.
+	REQUIRE(memcmp(a.data()+4, b.data()+4, 16) == 0);
+	REQUIRE(read64le(a.data()+4+16) + 1 == read64le(b.data()+4+16));
+	REQUIRE(a != b);
+
+	// A new key gets a new prefix.
+	REQUIRE(codec.set_key(test_key) == 0);
+	REQUIRE(codec.pack_message(&msg, b.data(), b.size()) == 0);
+	REQUIRE(memcmp(a.data()+4, b.data()+4, 16) != 0);
+	REQUIRE(read64le(b.data()+4+16) == 0);
+
+	// Another codec gets its own prefix.
+	Codec other;
+	REQUIRE(other.set_key(test_key) == 0);
+	REQUIRE(other.pack_message(&msg, b.data(), b.size()) == 0);
+	REQUIRE(memcmp(a.data()+4, b.data()+4, 16) != 0);
+	REQUIRE(codec.open_frame(b.data(), b.size()) == 0);
+}
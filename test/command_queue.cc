@@ -0,0 +1,92 @@
+#include <catch.hpp>
+
+#include <thread>
+#include <vector>
+
+#include "node/command_queue.hpp"
+
+TEST_CASE( "CommandQueue is FIFO and bounded", "[command_queue]" ) {
+	CommandQueue queue(3);
+	REQUIRE( queue.capacity() == 4 );
+
+	for (uint64_t i = 0; i < 4; i++) {
+		REQUIRE( queue.push(CMD_CONFIRM_APPEND, "", nullptr, nullptr, i) );
+	}
+	REQUIRE( !queue.push(CMD_CONFIRM_APPEND, "", nullptr, nullptr, 4) );
+
+	std::vector<uint64_t> rounds;
+	auto n = queue.consume(2, [&](Command& cmd) {
+		rounds.push_back(cmd.round);
+	});
+	REQUIRE( n == 2 );
+	REQUIRE( queue.push(CMD_APPEND, "hello", nullptr, nullptr, 4) );
+
+	std::string content;
+	queue.consume(queue.capacity(), [&](Command& cmd) {
+		rounds.push_back(cmd.round);
+		if (cmd.type == CMD_APPEND) {
+			content = cmd.content;
+		}
+	});
+	REQUIRE( rounds == std::vector<uint64_t>({0, 1, 2, 3, 4}) );
+	REQUIRE( content == "hello" );
+}
+
+TEST_CASE( "CommandQueue releases large content buffers", "[command_queue]" ) {
+	CommandQueue queue(1);
+	REQUIRE( queue.capacity() == 1 );
+
+	// Small buffers are reused.
+	REQUIRE( queue.push(CMD_APPEND, std::string(100, 'x'), nullptr, nullptr, 0) );
+	queue.consume(1, [](Command& cmd) {});
+	REQUIRE( queue.push(CMD_APPEND, "", nullptr, nullptr, 0) );
+	queue.consume(1, [](Command& cmd) {
+		REQUIRE( cmd.content.capacity() >= 100 );
+	});
+
+	REQUIRE( queue.push(CMD_APPEND, std::string(1 << 20, 'x'), nullptr, nullptr, 0) );
+	queue.consume(1, [](Command& cmd) {
+		REQUIRE( cmd.content.size() == 1 << 20 );
+	});
+	REQUIRE( queue.push(CMD_APPEND, "", nullptr, nullptr, 0) );
+	queue.consume(1, [](Command& cmd) {
+		REQUIRE( cmd.content.capacity() <= COMMAND_CONTENT_KEEP );
+	});
+}
+
+TEST_CASE( "CommandQueue handles concurrent producers", "[command_queue]" ) {
+	const int producers = 4;
+	const uint64_t per_producer = 20000;
+	CommandQueue queue(64);
+
+	std::vector<std::thread> threads;
+	for (int p = 0; p < producers; p++) {
+		threads.emplace_back([&queue, p, per_producer]() {
+			for (uint64_t i = 0; i < per_producer; i++) {
+				while (!queue.push(CMD_CONFIRM_APPEND, "", nullptr, nullptr, (uint64_t(p) << 32) | i)) {
+					std::this_thread::yield();
+				}
+			}
+		});
+	}
+
+	// Commands from each producer arrive in order.
+	std::vector<uint64_t> next(producers, 0);
+	uint64_t received = 0;
+	bool ordered = true;
+	while (received < producers*per_producer) {
+		received += queue.consume(queue.capacity(), [&](Command& cmd) {
+			auto p = cmd.round >> 32;
+			auto i = cmd.round & 0xffffffff;
+			if (next[p] != i) {
+				ordered = false;
+			}
+			next[p] = i+1;
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	REQUIRE( ordered );
+	REQUIRE( received == producers*per_producer );
+}
@@ -0,0 +1,68 @@
+#include <catch.hpp>
+
+#include <random>
+#include <vector>
+#include <cstring>
+
+#include "message/crc32c.h"
+#include "message/codec.hpp"
+
+TEST_CASE("CRC32C check value") {
+	const char* s = "123456789";
+	REQUIRE(crc32c(0, (const uint8_t*)s, 9) == 0xe3069283);
+	REQUIRE(crc32c_portable(0, (const uint8_t*)s, 9) == 0xe3069283);
+
+	// 32 bytes of zeros, from RFC 3720.
+	uint8_t zeros[32] = {};
+	REQUIRE(crc32c(0, zeros, 32) == 0x8a9136aa);
+}
+
+TEST_CASE("CRC32C backends agree") {
+	std::mt19937 rng(1);
+	std::vector<uint8_t> buf(4096);
+	for (auto& b : buf) {
+		b = rng();
+	}
+	for (size_t len = 0; len < 100; len++) {
+		for (size_t offset = 0; offset < 8; offset++) {
+			REQUIRE(crc32c(0, buf.data()+offset, len) ==
+				crc32c_portable(0, buf.data()+offset, len));
+		}
+	}
+	REQUIRE(crc32c(0, buf.data(), buf.size()) == crc32c_portable(0, buf.data(), buf.size()));
+
+	// Incremental updates.
+	uint32_t crc = crc32c(0, buf.data(), 1000);
+	crc = crc32c(crc, buf.data()+1000, buf.size()-1000);
+	REQUIRE(crc == crc32c(0, buf.data(), buf.size()));
+}
+
+TEST_CASE("Codec checksums interoperate") {
+	Codec sha;
+	Codec crc;
+	REQUIRE(crc.set_checksum(CHECKSUM_CRC32C) == 0);
+	REQUIRE(crc.set_checksum(7) == -1);
+
+	LeaderActiveMessage msg(1, 2, 3, 4, "hello");
+	for (Codec* sender : {&sha, &crc}) {
+		for (Codec* receiver : {&sha, &crc}) {
+			std::vector<uint8_t> buf(msg.packed_size());
+			REQUIRE(sender->pack_message(&msg, buf.data(), buf.size()) == 0);
+
+			std::unique_ptr<Message> m;
+			REQUIRE(receiver->decode_message(m, buf.data(), buf.size()) == 0);
+			REQUIRE(m->type == MSG_LEADER_ACTIVE);
+			auto la = (LeaderActiveMessage*)m.get();
+			REQUIRE(la->next_content == "hello");
+			REQUIRE(la->round == 3);
+		}
+	}
+
+	SECTION("corruption is detected") {
+		std::vector<uint8_t> buf(msg.packed_size());
+		REQUIRE(crc.pack_message(&msg, buf.data(), buf.size()) == 0);
+		buf[buf.size()/2] ^= 1;
+		std::unique_ptr<Message> m;
+		REQUIRE(sha.decode_message(m, buf.data(), buf.size()) < 0);
+	}
+}
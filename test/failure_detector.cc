@@ -0,0 +1,61 @@
+#include <catch.hpp>
+
+#include <random>
+
+#include "node/failure_detector.hpp"
+
+TEST_CASE( "FailureDetector suspicion grows with silence", "[failure_detector]" ) {
+	FailureDetector detector;
+	uint64_t ts = 1e9;
+	detector.heartbeat(ts);
+	for (int i = 0; i < FailureDetector::MIN_SAMPLES-1; i++) {
+		ts += 50e6;
+		detector.heartbeat(ts);
+		REQUIRE( !detector.ready() );
+	}
+	ts += 50e6;
+	detector.heartbeat(ts);
+	REQUIRE( detector.ready() );
+	REQUIRE( detector.mean() == Approx(50e6) );
+
+	double min_stddev = 10e6;
+	REQUIRE( detector.phi(ts, min_stddev) < 1 );
+	REQUIRE( detector.phi(ts + 50e6, min_stddev) == Approx(0.3).epsilon(0.1) );
+	double previous = 0;
+	for (uint64_t t = ts + 50e6; t < ts + 200e6; t += 10e6) {
+		auto phi = detector.phi(t, min_stddev);
+		REQUIRE( phi > previous );
+		previous = phi;
+	}
+
+	// suspect_after is where phi crosses the threshold.
+	for (double threshold : {1.0, 3.0, 8.0, 12.0}) {
+		auto after = detector.suspect_after(threshold, min_stddev);
+		REQUIRE( detector.phi(ts + after - 1e6, min_stddev) < threshold );
+		REQUIRE( detector.phi(ts + after, min_stddev) >= threshold );
+	}
+}
+
+TEST_CASE( "FailureDetector adapts to jitter", "[failure_detector]" ) {
+	std::mt19937_64 rng(1);
+	std::normal_distribution<double> steady(50e6, 1e6);
+	std::normal_distribution<double> jittery(50e6, 20e6);
+
+	FailureDetector a, b;
+	uint64_t ta = 1e9, tb = 1e9;
+	for (int i = 0; i < 1000; i++) {
+		ta += (uint64_t)std::max(1.0, steady(rng));
+		tb += (uint64_t)std::max(1.0, jittery(rng));
+		a.heartbeat(ta);
+		b.heartbeat(tb);
+	}
+	REQUIRE( a.stddev(0) < 2e6 );
+	REQUIRE( b.stddev(0) > 10e6 );
+	REQUIRE( a.suspect_after(8, 0) < b.suspect_after(8, 0) );
+	// The floor keeps a regular sender from being suspected right away.
+	REQUIRE( a.suspect_after(8, 10e6) > a.suspect_after(8, 0) );
+
+	a.reset();
+	REQUIRE( !a.ready() );
+	REQUIRE( a.last() == 0 );
+}
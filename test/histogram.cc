@@ -0,0 +1,47 @@
+#include <catch.hpp>
+
+#include <random>
+#include <vector>
+#include <algorithm>
+
+#include "node/histogram.hpp"
+
+TEST_CASE( "Histogram buckets are contiguous", "[histogram]" ) {
+	for (int i = 0; i < Histogram::BUCKETS-1; i++) {
+		auto upper = Histogram::bucket_upper(i);
+		REQUIRE( Histogram::bucket_index(upper) == i );
+		REQUIRE( Histogram::bucket_index(upper+1) == i+1 );
+	}
+	REQUIRE( Histogram::bucket_index(UINT64_MAX) == Histogram::BUCKETS-1 );
+}
+
+TEST_CASE( "Histogram percentiles are within the bucket error", "[histogram]" ) {
+	Histogram h;
+	REQUIRE( h.percentile(50) == 0 );
+
+	std::mt19937_64 rng(1);
+	std::lognormal_distribution<double> dist(12, 2);
+	std::vector<uint64_t> values;
+	for (int i = 0; i < 100000; i++) {
+		auto v = (uint64_t)dist(rng);
+		values.push_back(v);
+		h.record(v);
+	}
+	std::sort(values.begin(), values.end());
+
+	REQUIRE( h.count() == values.size() );
+	REQUIRE( h.min() == values.front() );
+	REQUIRE( h.max() == values.back() );
+	for (double p : {1.0, 50.0, 90.0, 99.0, 99.9}) {
+		auto exact = values[(size_t)(p / 100.0 * values.size() + 0.5) - 1];
+		auto estimate = h.percentile(p);
+		REQUIRE( estimate >= exact );
+		REQUIRE( estimate <= exact + exact/32 + 1 );
+	}
+	REQUIRE( h.percentile(100) == values.back() );
+
+	h.reset();
+	REQUIRE( h.count() == 0 );
+	REQUIRE( h.percentile(99) == 0 );
+	REQUIRE( h.min() == 0 );
+}
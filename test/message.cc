@@ -0,0 +1,57 @@
+#include <catch.hpp>
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+
+#include "message/message.hpp"
+
+TEST_CASE( "SnapshotChunk rejects data sizes past the buffer", "[message]" ) {
+	SnapshotChunk chunk(1, 5, 0, "data");
+	std::vector<uint8_t> body(chunk.body_size());
+	REQUIRE( chunk.pack_body(body.data(), body.size()) == 0 );
+
+	SnapshotChunk unpacked;
+	REQUIRE( unpacked.unpack_body(body.data(), body.size()) == 0 );
+	REQUIRE( unpacked.data == "data" );
+
+	// One byte short.
+	REQUIRE( unpacked.unpack_body(body.data(), body.size() - 1) == -2 );
+
+	// A size that wraps around when the header is added to it.
+	write32le(0xFFFFFFFC, body.data() + 8+8+8);
+	REQUIRE( unpacked.unpack_body(body.data(), body.size()) == -2 );
+}
+
+// body finds where m's body starts in its packed form.
+static uint8_t*
+body(const Message& m, std::vector<uint8_t>& packed)
+{
+	std::vector<uint8_t> body(m.body_size());
+	REQUIRE( m.pack_body(body.data(), body.size()) == 0 );
+	auto it = std::search(packed.begin(), packed.end(), body.begin(), body.end());
+	REQUIRE( it != packed.end() );
+	return &*it;
+}
+
+TEST_CASE( "Messages with malformed bodies fail to unpack", "[message]" ) {
+	LeaderActiveMessage batch(1, 2, 0, 1, std::vector<std::string>({"x", "yy"}));
+	std::vector<uint8_t> buf(batch.packed_size());
+	REQUIRE( batch.pack(buf.data(), buf.size()) == batch.packed_size() );
+
+	LeaderActiveMessage unpacked;
+	REQUIRE( unpacked.unpack(buf.data(), buf.size()) == 0 );
+	REQUIRE( unpacked.entries() == 2 );
+
+	// The second entry runs past the end of the message.
+	write32le(100, body(batch, buf) + 8+8+8+8 + 4 + 4+1);
+	REQUIRE( unpacked.unpack(buf.data(), buf.size()) < 0 );
+
+	// A content size that wraps around when added to the header.
+	LeaderActiveMessage single(1, 2, 0, 1, "x");
+	buf.resize(single.packed_size());
+	REQUIRE( single.pack(buf.data(), buf.size()) == single.packed_size() );
+	write32le(0xFFFFFFFE, body(single, buf) + 8+8+8+8);
+	REQUIRE( unpacked.unpack(buf.data(), buf.size()) < 0 );
+}
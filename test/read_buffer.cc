@@ -0,0 +1,110 @@
+#include <catch.hpp>
+
+#include <string>
+#include <vector>
+#include <cstring>
+
+#include "peer/read_buffer.hpp"
+#include "message/codec.hpp"
+
+static void
+append(ReadBuffer& buf, const std::string& data)
+{
+	size_t free;
+	auto dest = buf.reserve(data.size(), &free);
+	REQUIRE( free >= data.size() );
+	memcpy(dest, data.data(), data.size());
+	buf.commit(data.size());
+}
+
+static std::string
+unread(ReadBuffer& buf)
+{
+	return std::string((const char*)buf.data(), buf.size());
+}
+
+TEST_CASE( "ReadBuffer hands out free space after the unread data", "[read_buffer]" ) {
+	ReadBuffer buf(16);
+	REQUIRE( buf.size() == 0 );
+
+	append(buf, "abcdef");
+	append(buf, "gh");
+	REQUIRE( unread(buf) == "abcdefgh" );
+
+	// Consumed bytes stay in place until the next reserve.
+	auto front = buf.data();
+	buf.consume(3);
+	REQUIRE( memcmp(front, "abc", 3) == 0 );
+	REQUIRE( unread(buf) == "defgh" );
+
+	// Consuming everything starts over at the front.
+	buf.consume(5);
+	REQUIRE( buf.size() == 0 );
+	size_t free;
+	REQUIRE( buf.reserve(1, &free) == front );
+	REQUIRE( free == 16 );
+}
+
+TEST_CASE( "ReadBuffer compacts before it grows", "[read_buffer]" ) {
+	ReadBuffer buf(16);
+	append(buf, "0123456789ab");
+	auto front = buf.data();
+	buf.consume(10);
+
+	// 2 unread bytes and 8 wanted fit once the unread bytes move.
+	size_t free;
+	REQUIRE( buf.reserve(8, &free) == front + 2 );
+	REQUIRE( free == 14 );
+	REQUIRE( buf.data() == front );
+	REQUIRE( unread(buf) == "ab" );
+
+	// More than the capacity grows the buffer and keeps the data.
+	append(buf, "cdefghijklmnop");
+	REQUIRE( buf.size() == 16 );
+	append(buf, std::string(40, 'x'));
+	REQUIRE( unread(buf) == "abcdefghijklmnop" + std::string(40, 'x') );
+	buf.consume(1);
+	REQUIRE( buf.reserve(100, &free) != nullptr );
+	REQUIRE( free >= 100 );
+	REQUIRE( unread(buf) == "bcdefghijklmnop" + std::string(40, 'x') );
+}
+
+TEST_CASE( "ReadBuffer shrinks back once a large frame is consumed", "[read_buffer]" ) {
+	ReadBuffer buf(16);
+	append(buf, "ab");
+	append(buf, std::string(100, 'x'));
+	REQUIRE( buf.capacity() > 16 );
+
+	// It stays large while the unread data doesn't fit the initial
+	// capacity.
+	buf.consume(80);
+	size_t free;
+	REQUIRE( buf.reserve(1, &free) != nullptr );
+	REQUIRE( buf.capacity() > 16 );
+
+	// Once it does, the unread data moves to a buffer of the initial
+	// capacity.
+	buf.consume(12);
+	REQUIRE( buf.reserve(4, &free) != nullptr );
+	REQUIRE( buf.capacity() == 16 );
+	REQUIRE( free == 6 );
+	REQUIRE( unread(buf) == std::string(10, 'x') );
+}
+
+TEST_CASE( "Frame lengths out of range are rejected", "[read_buffer]" ) {
+	Codec codec;
+	uint8_t header[4];
+
+	REQUIRE( codec.decode_message_length(header, 3) == -1 );
+	write32le(0x7FFFFFFF, header);
+	REQUIRE( codec.decode_message_length(header, 4) == -2 );
+	write32le(MAX_FRAME_SIZE + 1, header);
+	REQUIRE( codec.decode_message_length(header, 4) == -2 );
+	write32le(4, header);
+	REQUIRE( codec.decode_message_length(header, 4) == -2 );
+
+	LeaderActiveMessage msg(1, 1, 0);
+	auto frame = codec.pack_frame(&msg);
+	std::vector<uint8_t> copy(*frame);
+	REQUIRE( codec.decode_message_length(copy.data(), copy.size()) == (int)copy.size() );
+}
@@ -1,5 +1,9 @@
 #include <catch.hpp>
 
+#include <deque>
+#include <cstring>
+#include <algorithm>
+
 #include "node/role.hpp"
 #include "test_registry.hpp"
 
@@ -181,3 +185,885 @@ TEST_CASE( "on_leader_change is called when the current leader is lost", "[role]
 	REQUIRE( role.state() == PotentialLeader );
 	REQUIRE( role.current_leader() == 0 );
 }
+
+// Drives a role through an election in a cluster of three.
+static void
+elect_leader(Role& role, uint64_t& ts) {
+	// Nodes 2 and 3 are connected.
+	role.add_peer(2);
+	role.add_peer(3);
+	role.periodic(ts);
+	ts += 1e9;
+	role.periodic(ts);
+	ts += 1e9;
+	role.periodic(ts);
+	ts += 1e9;
+	role.periodic(ts);
+	REQUIRE( role.state() == PotentialLeader );
+
+	role.handle_leader_active_ack(ts, LeaderActiveAck(2, 1, 0));
+	ts += 400e6;
+	role.periodic(ts);
+	REQUIRE( role.state() == Leader );
+}
+
+TEST_CASE( "Leader pipelines appends and commits them in round order", "[role]" ) {
+	TestRegistry reg;
+
+	std::vector<LeaderActiveMessage> broadcasted;
+	reg.m_broadcast = std::function<void(const Message*)>([&](const Message* msg) {
+		REQUIRE( msg->type == MSG_LEADER_ACTIVE );
+		broadcasted.push_back(*static_cast<const LeaderActiveMessage*>(msg));
+	});
+
+	Role role(reg, 1, 3);
+	REQUIRE( role.set_append_window(2) == 0 );
+
+	uint64_t ts = 1e9;
+	elect_leader(role, ts);
+	broadcasted.clear();
+
+	std::vector<int> results;
+	auto cb = [&](int status, void* data) {
+		results.push_back(status);
+		results.push_back((int)(intptr_t)data);
+	};
+	role.send_append(ts, "a", cb, (void*)1);
+	role.send_append(ts, "b", cb, (void*)2);
+	role.send_append(ts, "c", cb, (void*)3);
+
+	// The third append doesn't fit in the window.
+	REQUIRE( results == std::vector<int>({-2, 3}) );
+	results.clear();
+
+	REQUIRE( broadcasted.size() == 2 );
+	REQUIRE( broadcasted[0].next == 1 );
+	REQUIRE( broadcasted[0].next_content == "a" );
+	REQUIRE( broadcasted[1].next == 2 );
+	REQUIRE( broadcasted[1].next_content == "b" );
+
+	// The leader stored both. Round 2 is acked first, but can't commit
+	// before round 1.
+	role.client_confirm_append(ts, 1);
+	role.client_confirm_append(ts, 2);
+	role.handle_leader_active_ack(ts, LeaderActiveAck(2, broadcasted[1].seq, 2));
+	REQUIRE( results.empty() );
+	REQUIRE( role.round() == 0 );
+
+	role.handle_leader_active_ack(ts, LeaderActiveAck(2, broadcasted[1].seq, 1));
+	REQUIRE( results == std::vector<int>({0, 1, 0, 2}) );
+	REQUIRE( role.round() == 2 );
+}
+
+TEST_CASE( "Leader commits once a majority including itself stored a round", "[role]" ) {
+	TestRegistry reg;
+	Role role(reg, 1, 3);
+
+	uint64_t ts = 1e9;
+	elect_leader(role, ts);
+
+	std::vector<int> results;
+	auto cb = [&](int status, void* data) {
+		results.push_back(status);
+	};
+
+	// The leader's own confirmation isn't a majority of three.
+	role.send_append(ts, "a", cb, nullptr);
+	role.client_confirm_append(ts, 1);
+	role.periodic(ts);
+	REQUIRE( results.empty() );
+	REQUIRE( role.round() == 0 );
+
+	// Neither is a follower's ack alone.
+	role.send_append(ts, "b", cb, nullptr);
+	role.handle_leader_active_ack(ts, LeaderActiveAck(2, role.seq(), 2));
+	REQUIRE( results.empty() );
+
+	// One follower and the leader are.
+	role.handle_leader_active_ack(ts, LeaderActiveAck(3, role.seq(), 1));
+	REQUIRE( results == std::vector<int>({0}) );
+	REQUIRE( role.round() == 1 );
+	role.client_confirm_append(ts, 2);
+	REQUIRE( role.next_deadline() == 0 );
+	role.periodic(ts);
+	REQUIRE( results == std::vector<int>({0, 0}) );
+	REQUIRE( role.round() == 2 );
+}
+
+TEST_CASE( "Leader doesn't commit rounds it hasn't confirmed", "[role]" ) {
+	TestRegistry reg;
+	Role role(reg, 1, 2);
+
+	uint64_t ts = 1e9;
+	elect_leader(role, ts);
+
+	std::vector<int> results;
+	auto cb = [&](int status, void* data) {
+		results.push_back(status);
+	};
+
+	// The follower stored the rounds, but the leader didn't, so they
+	// aren't stored by a majority of two.
+	role.send_append(ts, "a", cb, nullptr);
+	role.send_append(ts, "b", cb, nullptr);
+	for (uint64_t round = 1; round <= 2; round++) {
+		role.handle_leader_active_ack(ts, LeaderActiveAck(2, role.seq(), round));
+	}
+	REQUIRE( role.next_deadline() != 0 );
+	role.periodic(ts + 1000);
+	REQUIRE( results.empty() );
+	REQUIRE( role.round() == 0 );
+
+	// Its confirmation commits them.
+	role.client_confirm_append(ts + 2000, 2);
+	role.client_confirm_append(ts + 2000, 1);
+	role.periodic(ts + 2000);
+	REQUIRE( results == std::vector<int>({0, 0}) );
+	REQUIRE( role.round() == 2 );
+}
+
+TEST_CASE( "Follower acks pipelined appends independently", "[role]" ) {
+	TestRegistry reg;
+
+	std::vector<LeaderActiveAck> acks;
+	reg.m_send_to_id = std::function<void(uint64_t, const Message*)>([&](uint64_t id, const Message* msg) {
+		REQUIRE( msg->type == MSG_LEADER_ACTIVE_ACK );
+		REQUIRE( id == 1 );
+		acks.push_back(*static_cast<const LeaderActiveAck*>(msg));
+	});
+
+	Role role(reg, 2, 3);
+	ab_callbacks_t callbacks = {};
+	callbacks.on_append = [](uint64_t round, const char* data, int data_len, void* cb_data) {
+		((std::vector<uint64_t>*)cb_data)->push_back(round);
+	};
+	std::vector<uint64_t> appended;
+	role.set_callbacks(callbacks, &appended);
+
+	uint64_t ts = 1e9;
+	role.periodic(ts);
+
+	role.handle_leader_active(ts, LeaderActiveMessage(1, 1, 0, 1, "a"));
+	role.handle_leader_active(ts, LeaderActiveMessage(1, 2, 0, 2, "b"));
+	REQUIRE( appended == std::vector<uint64_t>({1, 2}) );
+	REQUIRE( acks.empty() );
+
+	role.client_confirm_append(ts, 2);
+	role.client_confirm_append(ts, 1);
+	role.client_confirm_append(ts, 1);
+	REQUIRE( acks.size() == 2 );
+	REQUIRE( acks[0].round == 2 );
+	REQUIRE( acks[0].seq == 2 );
+	REQUIRE( acks[1].round == 1 );
+}
+
+TEST_CASE( "Leader batches queued appends into one message", "[role]" ) {
+	TestRegistry reg;
+
+	std::vector<LeaderActiveMessage> broadcasted;
+	reg.m_broadcast = std::function<void(const Message*)>([&](const Message* msg) {
+		REQUIRE( msg->type == MSG_LEADER_ACTIVE );
+		broadcasted.push_back(*static_cast<const LeaderActiveMessage*>(msg));
+	});
+
+	Role role(reg, 1, 3);
+	// A batch has to fit in the append window, and the window has to
+	// hold a batch.
+	REQUIRE( role.set_batching(DEFAULT_APPEND_WINDOW + 1, 1024, 5e6) < 0 );
+	REQUIRE( role.set_batching(3, 1024, 5e6) == 0 );
+	REQUIRE( role.set_append_window(2) < 0 );
+
+	uint64_t ts = 1e9;
+	elect_leader(role, ts);
+	broadcasted.clear();
+
+	std::vector<int> results;
+	auto cb = [&](int status, void* data) {
+		REQUIRE( status == 0 );
+		results.push_back((int)(intptr_t)data);
+	};
+	role.send_append(ts, "a", cb, (void*)1);
+	role.send_append(ts, "b", cb, (void*)2);
+
+	// Still lingering.
+	role.flush_due_appends(ts + 1e6);
+	REQUIRE( broadcasted.empty() );
+
+	ts += 5e6;
+	role.flush_due_appends(ts);
+	REQUIRE( broadcasted.size() == 1 );
+	REQUIRE( broadcasted[0].next == 1 );
+	REQUIRE( broadcasted[0].entries() == 2 );
+	REQUIRE( broadcasted[0].entry(0) == "a" );
+	REQUIRE( broadcasted[0].entry(1) == "b" );
+
+	// A full batch is sent right away.
+	role.send_append(ts, "c", cb, (void*)3);
+	role.send_append(ts, "d", cb, (void*)4);
+	role.send_append(ts, "e", cb, (void*)5);
+	REQUIRE( broadcasted.size() == 2 );
+	REQUIRE( broadcasted[1].next == 3 );
+	REQUIRE( broadcasted[1].entries() == 3 );
+
+	// Each entry commits on its own.
+	for (uint64_t round = 1; round <= 5; round++) {
+		role.client_confirm_append(ts, round);
+	}
+	role.handle_leader_active_ack(ts, LeaderActiveAck(2, broadcasted[1].seq, 1));
+	role.handle_leader_active_ack(ts, LeaderActiveAck(2, broadcasted[1].seq, 2));
+	role.handle_leader_active_ack(ts, LeaderActiveAck(2, broadcasted[1].seq, 3));
+	REQUIRE( results == std::vector<int>({1, 2, 3}) );
+	REQUIRE( role.round() == 3 );
+}
+
+TEST_CASE( "Follower delivers batched appends with distinct rounds", "[role]" ) {
+	TestRegistry reg;
+
+	Role role(reg, 2, 3);
+	ab_callbacks_t callbacks = {};
+	callbacks.on_append = [](uint64_t round, const char* data, int data_len, void* cb_data) {
+		auto appended = (std::vector<std::pair<uint64_t, std::string>>*)cb_data;
+		appended->push_back({round, std::string(data, data_len)});
+	};
+	std::vector<std::pair<uint64_t, std::string>> appended;
+	role.set_callbacks(callbacks, &appended);
+
+	uint64_t ts = 1e9;
+	role.periodic(ts);
+
+	LeaderActiveMessage msg(1, 1, 0, 1, std::vector<std::string>({"x", "yy"}));
+
+	// Round trip through the wire format.
+	uint8_t buf[256] = {};
+	REQUIRE( msg.pack(buf, sizeof(buf)) == msg.packed_size() );
+	LeaderActiveMessage unpacked;
+	REQUIRE( unpacked.unpack(buf, sizeof(buf)) == 0 );
+
+	role.handle_leader_active(ts, unpacked);
+	REQUIRE( appended.size() == 2 );
+	REQUIRE( appended[0].first == 1 );
+	REQUIRE( appended[0].second == "x" );
+	REQUIRE( appended[1].first == 2 );
+	REQUIRE( appended[1].second == "yy" );
+}
+
+TEST_CASE( "Follower stores entries before acking them", "[role]" ) {
+	TestRegistry reg;
+
+	std::vector<LeaderActiveAck> acks;
+	reg.m_send_to_id = std::function<void(uint64_t, const Message*)>([&](uint64_t id, const Message* msg) {
+		acks.push_back(*static_cast<const LeaderActiveAck*>(msg));
+	});
+
+	// No on_append callback, only a store.
+	Role role(reg, 2, 3);
+	std::vector<std::pair<uint64_t, std::string>> stored;
+	role.set_store([&](uint64_t round, const std::string& content) {
+		stored.push_back({round, content});
+		return nullptr;
+	});
+
+	uint64_t ts = 1e9;
+	role.periodic(ts);
+
+	role.handle_leader_active(ts, LeaderActiveMessage(1, 1, 0, 1,
+		std::vector<std::string>({"a", "b"})));
+	REQUIRE( stored.size() == 2 );
+	REQUIRE( stored[1].first == 2 );
+	REQUIRE( stored[1].second == "b" );
+	REQUIRE( acks.empty() );
+
+	// The store confirms once the entries are durable.
+	role.client_confirm_append(ts, 1);
+	role.client_confirm_append(ts, 2);
+	REQUIRE( acks.size() == 2 );
+	REQUIRE( acks[1].round == 2 );
+}
+
+TEST_CASE( "Leader streams retained rounds to a lagging follower", "[role]" ) {
+	TestRegistry reg;
+
+	std::vector<LeaderActiveMessage> frames;
+	reg.m_send_to_id = std::function<void(uint64_t, const Message*)>([&](uint64_t id, const Message* msg) {
+		REQUIRE( id == 3 );
+		REQUIRE( msg->type == MSG_LEADER_ACTIVE );
+		frames.push_back(*static_cast<const LeaderActiveMessage*>(msg));
+	});
+
+	Role role(reg, 1, 3);
+	REQUIRE( role.set_retention(3, 1024) == 0 );
+	uint64_t ts = 1e9;
+	elect_leader(role, ts);
+
+	for (int i = 0; i < 5; i++) {
+		role.send_append(ts, std::string(1, 'a'+i), [](int, void*) {}, nullptr);
+		role.client_confirm_append(ts, i+1);
+		role.handle_leader_active_ack(ts, LeaderActiveAck(2, role.seq(), i+1));
+	}
+	REQUIRE( role.round() == 5 );
+	REQUIRE( frames.empty() );
+
+	// Node 3 comes back with only round 1. Rounds 2 and older are gone,
+	// so the first frame starts at 3.
+	role.handle_leader_active_ack(ts, LeaderActiveAck(3, role.seq(), 5, 1));
+	REQUIRE( frames.size() == 1 );
+	REQUIRE( (frames[0].flags & MSG_FLAG_CATCH_UP) );
+	REQUIRE( frames[0].next == 3 );
+	REQUIRE( frames[0].entries() == 3 );
+	REQUIRE( frames[0].entry(2) == "e" );
+
+	// Nothing more to send once the follower has it all.
+	role.handle_leader_active_ack(ts, LeaderActiveAck(3, role.seq(), 5, 5));
+	REQUIRE( frames.size() == 1 );
+}
+
+TEST_CASE( "Follower asks for missing rounds and skips what is gone", "[role]" ) {
+	TestRegistry reg;
+	auto stats = std::make_shared<Stats>();
+
+	std::vector<LeaderActiveAck> acks;
+	reg.m_send_to_id = std::function<void(uint64_t, const Message*)>([&](uint64_t id, const Message* msg) {
+		acks.push_back(*static_cast<const LeaderActiveAck*>(msg));
+	});
+
+	Role role(reg, 2, 3);
+	role.set_stats(stats);
+	std::vector<uint64_t> appended;
+	ab_callbacks_t callbacks = {};
+	callbacks.on_append = [](uint64_t round, const char*, int, void* cb_data) {
+		((std::vector<uint64_t>*)cb_data)->push_back(round);
+	};
+	role.set_callbacks(callbacks, &appended);
+
+	uint64_t ts = 1e9;
+	role.periodic(ts);
+
+	// A live append past a gap isn't delivered.
+	role.handle_leader_active(ts, LeaderActiveMessage(1, 1, 5, 7, "g"));
+	REQUIRE( appended.empty() );
+	REQUIRE( acks.size() == 1 );
+	REQUIRE( acks[0].received == 0 );
+
+	// The leader only had rounds from 4 on.
+	LeaderActiveMessage frame(1, 1, 5, 4, std::vector<std::string>({"d", "e", "f", "g"}));
+	frame.flags |= MSG_FLAG_CATCH_UP;
+	role.handle_leader_active(ts, frame);
+	REQUIRE( appended == std::vector<uint64_t>({4, 5, 6, 7}) );
+	REQUIRE( role.received() == 7 );
+	REQUIRE( acks.size() == 2 );
+	REQUIRE( acks[1].received == 7 );
+	REQUIRE( stats->catch_up_skipped == 3 );
+
+	// Rounds already delivered aren't delivered again.
+	role.handle_leader_active(ts, LeaderActiveMessage(1, 2, 5, 7, std::vector<std::string>({"g", "h"})));
+	REQUIRE( appended == std::vector<uint64_t>({4, 5, 6, 7, 8}) );
+}
+
+// Snapshot is an application snapshot held in memory.
+struct Snapshot
+{
+	uint64_t    round;
+	std::string data;
+	int         opened;
+	int         closed;
+	bool        installed;
+};
+
+TEST_CASE( "Leader sends a snapshot to a follower behind the retained rounds", "[role]" ) {
+	TestRegistry leader_reg;
+	TestRegistry follower_reg;
+	auto stats = std::make_shared<Stats>();
+	Role leader(leader_reg, 1, 3);
+	Role follower(follower_reg, 3, 3);
+	leader.set_stats(stats);
+	follower.set_stats(stats);
+
+	ab_snapshot_callbacks_t callbacks = {};
+	callbacks.open_snapshot = [](uint64_t* round, void* cb_data) -> void* {
+		auto snapshot = (Snapshot*)cb_data;
+		snapshot->opened++;
+		*round = snapshot->round;
+		return snapshot;
+	};
+	callbacks.read_snapshot = [](void* handle, uint64_t offset, char* buf, int len, void*) {
+		auto& data = ((Snapshot*)handle)->data;
+		int n = std::min<uint64_t>(len, data.size() - offset);
+		memcpy(buf, data.data() + offset, n);
+		return n;
+	};
+	callbacks.close_snapshot = [](void* handle, void*) {
+		((Snapshot*)handle)->closed++;
+	};
+	callbacks.on_snapshot_chunk = [](uint64_t round, uint64_t offset, const char* data, int data_len,
+		void* cb_data) {
+		auto snapshot = (Snapshot*)cb_data;
+		REQUIRE( offset == snapshot->data.size() );
+		snapshot->round = round;
+		snapshot->data.append(data, data_len);
+		return 0;
+	};
+	callbacks.on_snapshot = [](uint64_t round, uint64_t size, void* cb_data) {
+		auto snapshot = (Snapshot*)cb_data;
+		REQUIRE( size == snapshot->data.size() );
+		snapshot->installed = true;
+		return 0;
+	};
+	Snapshot source = {4, std::string(150000, 's'), 0, 0, false};
+	Snapshot received = {0, "", 0, 0, false};
+	leader.set_snapshot_callbacks(callbacks, &source);
+	follower.set_snapshot_callbacks(callbacks, &received);
+
+	std::vector<uint64_t> appended;
+	ab_callbacks_t follower_callbacks = {};
+	follower_callbacks.on_append = [](uint64_t round, const char*, int, void* cb_data) {
+		((std::vector<uint64_t>*)cb_data)->push_back(round);
+	};
+	follower.set_callbacks(follower_callbacks, &appended);
+	std::vector<uint64_t> truncated;
+	follower.set_truncate([&](uint64_t round) {
+		truncated.push_back(round);
+	});
+
+	// Messages are queued and delivered in order.
+	uint64_t ts = 1e9;
+	std::deque<std::function<void()>> queue;
+	leader_reg.m_send_to_id = std::function<void(uint64_t, const Message*)>([&](uint64_t id, const Message* msg) {
+		REQUIRE( id == 3 );
+		if (msg->type == MSG_SNAPSHOT_CHUNK) {
+			auto chunk = *static_cast<const SnapshotChunk*>(msg);
+			queue.push_back([&, chunk]() { follower.handle_snapshot_chunk(chunk); });
+		} else {
+			auto active = *static_cast<const LeaderActiveMessage*>(msg);
+			queue.push_back([&, active]() { follower.handle_leader_active(ts, active); });
+		}
+	});
+	follower_reg.m_send_to_id = std::function<void(uint64_t, const Message*)>([&](uint64_t id, const Message* msg) {
+		REQUIRE( id == 1 );
+		if (msg->type == MSG_SNAPSHOT_ACK) {
+			auto ack = *static_cast<const SnapshotAck*>(msg);
+			queue.push_back([&, ack]() { leader.handle_snapshot_ack(ts, ack); });
+		} else {
+			auto ack = *static_cast<const LeaderActiveAck*>(msg);
+			queue.push_back([&, ack]() { leader.handle_leader_active_ack(ts, ack); });
+		}
+	});
+
+	// Only round 5 is retained.
+	REQUIRE( leader.set_retention(1, 1024) == 0 );
+	elect_leader(leader, ts);
+	for (int i = 0; i < 5; i++) {
+		leader.send_append(ts, "x", [](int, void*) {}, nullptr);
+		leader.client_confirm_append(ts, i+1);
+		leader.handle_leader_active_ack(ts, LeaderActiveAck(2, leader.seq(), i+1));
+	}
+	REQUIRE( leader.round() == 5 );
+
+	follower.periodic(ts);
+	follower.handle_leader_active(ts, LeaderActiveMessage(1, leader.seq(), leader.round()));
+	while (!queue.empty()) {
+		queue.front()();
+		queue.pop_front();
+	}
+
+	REQUIRE( received.installed );
+	REQUIRE( received.round == 4 );
+	// The store can drop what the snapshot covers.
+	REQUIRE( truncated == std::vector<uint64_t>({4}) );
+	REQUIRE( received.data == source.data );
+	REQUIRE( source.opened == 1 );
+	REQUIRE( source.closed == 1 );
+	REQUIRE( appended == std::vector<uint64_t>({5}) );
+	REQUIRE( follower.received() == 5 );
+	REQUIRE( stats->snapshots_sent == 1 );
+	REQUIRE( stats->snapshots_installed == 1 );
+	REQUIRE( stats->snapshot_bytes == 150000 );
+	REQUIRE( stats->catch_up_skipped == 0 );
+}
+
+TEST_CASE( "Followers learn commits from the leader", "[role]" ) {
+	TestRegistry reg;
+
+	std::vector<LeaderActiveMessage> broadcasted;
+	reg.m_broadcast = std::function<void(const Message*)>([&](const Message* msg) {
+		broadcasted.push_back(*static_cast<const LeaderActiveMessage*>(msg));
+	});
+
+	std::vector<uint64_t> commits;
+	ab_callbacks_t callbacks = {};
+	callbacks.on_append = [](uint64_t, const char*, int, void*) {};
+	callbacks.on_commit = [](uint64_t round, void* cb_data) {
+		((std::vector<uint64_t>*)cb_data)->push_back(round);
+	};
+
+	Role leader(reg, 1, 3);
+	leader.set_callbacks(callbacks, &commits);
+	uint64_t ts = 1e9;
+	elect_leader(leader, ts);
+	broadcasted.clear();
+
+	// The leader tells the followers about the commit right away.
+	leader.send_append(ts, "a", [](int, void*) {}, nullptr);
+	leader.client_confirm_append(ts, 1);
+	leader.handle_leader_active_ack(ts, LeaderActiveAck(2, leader.seq(), 1));
+	REQUIRE( commits == std::vector<uint64_t>({1}) );
+	REQUIRE( broadcasted.size() == 2 );
+	REQUIRE( broadcasted[1].next == 0 );
+	REQUIRE( broadcasted[1].round == 1 );
+
+	commits.clear();
+	Role follower(reg, 2, 3);
+	follower.set_callbacks(callbacks, &commits);
+	follower.periodic(ts);
+	follower.handle_leader_active(ts, LeaderActiveMessage(1, 1, 0, 1,
+		std::vector<std::string>({"a", "b", "c"})));
+	REQUIRE( commits.empty() );
+
+	// Only delivered rounds are reported.
+	follower.handle_leader_active(ts, LeaderActiveMessage(1, 2, 2));
+	REQUIRE( commits == std::vector<uint64_t>({2}) );
+	follower.handle_leader_active(ts, LeaderActiveMessage(1, 3, 2));
+	REQUIRE( commits.size() == 1 );
+	follower.handle_leader_active(ts, LeaderActiveMessage(1, 4, 5));
+	REQUIRE( commits == std::vector<uint64_t>({2, 3}) );
+}
+
+TEST_CASE( "Role counts appends and elections in its stats", "[role]" ) {
+	TestRegistry reg;
+	auto stats = std::make_shared<Stats>();
+
+	Role role(reg, 1, 3);
+	role.set_stats(stats);
+	REQUIRE( role.set_append_window(1) == 0 );
+
+	auto cb = [](int status, void* data) {};
+	uint64_t ts = 1e9;
+	role.send_append(ts, "a", cb, nullptr);
+	REQUIRE( stats->appends_rejected_not_leader == 1 );
+
+	elect_leader(role, ts);
+	REQUIRE( stats->elections_started == 1 );
+	REQUIRE( stats->leadership_gained == 1 );
+
+	role.send_append(ts, "b", cb, nullptr);
+	role.send_append(ts, "c", cb, nullptr);
+	REQUIRE( stats->appends_rejected_window == 1 );
+	role.client_confirm_append(ts, 1);
+	role.handle_leader_active_ack(ts, LeaderActiveAck(2, role.seq(), 1));
+	REQUIRE( stats->appends_committed == 1 );
+
+	// Losing leadership cancels the pending append.
+	role.send_append(ts, "d", cb, nullptr);
+	ts += 400e6;
+	role.periodic(ts);
+	REQUIRE( role.state() == PotentialLeader );
+	REQUIRE( stats->appends_cancelled == 1 );
+	REQUIRE( stats->leadership_lost == 1 );
+	REQUIRE( stats->elections_started == 2 );
+	REQUIRE( stats->appends_submitted == 4 );
+
+	ab_stats_t snapshot;
+	stats->snapshot(&snapshot);
+	REQUIRE( snapshot.appends_committed == 1 );
+	REQUIRE( snapshot.appends_cancelled == 1 );
+}
+
+TEST_CASE( "Role records commit and confirm latency", "[role]" ) {
+	TestRegistry reg;
+	auto stats = std::make_shared<Stats>();
+
+	Role role(reg, 1, 3);
+	role.set_stats(stats);
+
+	uint64_t ts = 1e9;
+	elect_leader(role, ts);
+
+	role.send_append(ts, "a", [](int, void*) {}, nullptr);
+	role.client_confirm_append(ts + 1000, 1);
+	role.handle_leader_active_ack(ts + 5000, LeaderActiveAck(2, role.seq(), 1));
+	REQUIRE( stats->commit_latency.count() == 1 );
+	REQUIRE( stats->commit_latency.max() == 5000 );
+	REQUIRE( stats->confirm_latency.count() == 1 );
+	REQUIRE( stats->confirm_latency.max() == 1000 );
+
+	// Followers measure from on_append to the confirmation.
+	Role follower(reg, 2, 3);
+	follower.set_stats(stats);
+	ab_callbacks_t callbacks = {};
+	callbacks.on_append = [](uint64_t, const char*, int, void*) {};
+	follower.set_callbacks(callbacks, nullptr);
+	stats->confirm_latency.reset();
+	follower.periodic(ts);
+	follower.handle_leader_active(ts, LeaderActiveMessage(1, 1, 0, 1, "a"));
+	follower.client_confirm_append(ts + 2000, 1);
+	follower.client_confirm_append(ts + 3000, 1);
+	REQUIRE( stats->confirm_latency.count() == 1 );
+	REQUIRE( stats->confirm_latency.percentile(50) == 2000 );
+}
+
+TEST_CASE( "Leader tracks follower RTT and round lag", "[role]" ) {
+	TestRegistry reg;
+	Role role(reg, 1, 3);
+
+	uint64_t ts = 1e9;
+	std::vector<ab_peer_stats_t> peers;
+	role.follower_progress(ts, peers);
+	REQUIRE( peers.empty() );
+
+	elect_leader(role, ts);
+
+	role.send_append(ts, "a", [](int, void*) {}, nullptr);
+	role.send_append(ts, "b", [](int, void*) {}, nullptr);
+	auto seq = role.seq();
+	role.handle_leader_active_ack(ts + 2000, LeaderActiveAck(2, seq, 1));
+	role.handle_leader_active_ack(ts + 4000, LeaderActiveAck(3, seq, 2));
+	role.handle_leader_active_ack(ts + 10000, LeaderActiveAck(2, seq, 2));
+
+	role.follower_progress(ts + 20000, peers);
+	REQUIRE( peers.size() == 2 );
+	std::sort(peers.begin(), peers.end(), [](const ab_peer_stats_t& a, const ab_peer_stats_t& b) {
+		return a.id < b.id;
+	});
+	REQUIRE( peers[0].id == 2 );
+	REQUIRE( peers[0].acks == 2 );
+	REQUIRE( peers[0].rtt_max_ns == 10000 );
+	REQUIRE( peers[0].rtt_ewma_ns == 2000 - 2000/8 + 10000/8 );
+	REQUIRE( peers[0].acked_round == 2 );
+	REQUIRE( peers[0].round_lag == 0 );
+	REQUIRE( peers[0].last_ack_age_ns == 10000 );
+	REQUIRE( peers[1].id == 3 );
+	REQUIRE( peers[1].rtt_ewma_ns == 4000 );
+
+	// A new append puts both followers one round behind.
+	role.send_append(ts, "c", [](int, void*) {}, nullptr);
+	peers.clear();
+	role.follower_progress(ts + 20000, peers);
+	REQUIRE( peers[0].round_lag == 1 );
+	REQUIRE( peers[1].round_lag == 1 );
+}
+
+TEST_CASE( "Role reports when periodic is next due", "[role]" ) {
+	TestRegistry reg;
+	int broadcasts = 0;
+	reg.m_broadcast = std::function<void(const Message*)>([&](const Message* msg) {
+		broadcasts++;
+	});
+
+	Role role(reg, 1, 2);
+	role.add_peer(2);
+	REQUIRE( role.next_deadline() == 0 );
+
+	uint64_t ts = 1e9;
+	role.periodic(ts);
+	REQUIRE( role.next_deadline() == ts + DEFAULT_FOLLOWER_TIMEOUT_NS + 1 );
+
+	// Nothing happens until the deadline.
+	role.periodic(role.next_deadline() - 1);
+	REQUIRE( role.state() == Follower );
+	ts = role.next_deadline();
+	role.periodic(ts);
+	REQUIRE( role.state() == PotentialLeader );
+	// The election starts right away.
+	REQUIRE( role.next_deadline() <= ts );
+	role.periodic(ts);
+	REQUIRE( broadcasts == 1 );
+	REQUIRE( role.next_deadline() == ts + DEFAULT_LEADERSHIP_LOSS_NS + 1 );
+
+	role.handle_leader_active_ack(ts, LeaderActiveAck(2, role.seq(), 0));
+	ts = role.next_deadline();
+	role.periodic(ts);
+	REQUIRE( role.state() == Leader );
+	// The last broadcast was long enough ago to send a heartbeat right away.
+	REQUIRE( role.next_deadline() <= ts );
+	role.periodic(ts);
+	REQUIRE( broadcasts == 2 );
+
+	// Without acks the leader waits for leadership loss, with them for
+	// the next heartbeat.
+	REQUIRE( role.next_deadline() == ts + DEFAULT_LEADERSHIP_LOSS_NS + 1 );
+	role.handle_leader_active_ack(ts + 1000, LeaderActiveAck(2, role.seq(), 0));
+	REQUIRE( role.next_deadline() == ts + DEFAULT_HEARTBEAT_INTERVAL_NS );
+
+	// A lingering batch is due before the heartbeat.
+	REQUIRE( role.set_batching(10, 1 << 20, 5e6) == 0 );
+	role.send_append(ts + 2000, "a", [](int, void*) {}, nullptr);
+	REQUIRE( role.next_deadline() == ts + 2000 + 5e6 );
+	role.periodic(role.next_deadline());
+	REQUIRE( broadcasts == 3 );
+
+	// Both nodes have to store the round. Once the follower acked, the
+	// leader's own confirmation completes the majority, so the round
+	// can commit at once.
+	REQUIRE( role.next_deadline() == ts + 2000 + 5e6 + DEFAULT_LEADERSHIP_LOSS_NS + 1 );
+	ts += 2000 + 5e6;
+	role.handle_leader_active_ack(ts + 500, LeaderActiveAck(2, role.seq(), 1));
+	REQUIRE( role.round() == 0 );
+	role.client_confirm_append(ts + 1000, 1);
+	REQUIRE( role.next_deadline() == 0 );
+	role.periodic(ts + 1000);
+	REQUIRE( role.round() == 1 );
+}
+
+TEST_CASE( "Role uses its timing profile", "[role]" ) {
+	TestRegistry reg;
+	Role role(reg, 1, 2);
+
+	Timing timing;
+	timing.m_heartbeat_interval = 300e6;
+	REQUIRE( role.set_timing(timing) < 0 );
+	timing.m_heartbeat_interval = 10e6;
+	timing.m_leadership_loss = 30e6;
+	timing.m_follower_timeout = 30e6;
+	REQUIRE( role.set_timing(timing) < 0 );
+	timing.m_follower_timeout = 80e6;
+	REQUIRE( role.set_timing(timing) == 0 );
+	role.add_peer(2);
+
+	uint64_t ts = 1e9;
+	role.periodic(ts);
+	REQUIRE( role.next_deadline() == ts + 80e6 + 1 );
+	ts = role.next_deadline();
+	role.periodic(ts);
+	role.periodic(ts);
+	REQUIRE( role.state() == PotentialLeader );
+	REQUIRE( role.next_deadline() == ts + 30e6 + 1 );
+
+	role.handle_leader_active_ack(ts, LeaderActiveAck(2, role.seq(), 0));
+	ts = role.next_deadline();
+	role.periodic(ts);
+	role.periodic(ts);
+	REQUIRE( role.state() == Leader );
+	role.handle_leader_active_ack(ts, LeaderActiveAck(2, role.seq(), 0));
+	REQUIRE( role.next_deadline() == ts + 10e6 );
+}
+
+TEST_CASE( "Follower timeout adapts to leader heartbeats", "[role]" ) {
+	TestRegistry reg;
+	ab_callbacks_t callbacks = {};
+	Role role(reg, 2, 3);
+	role.set_callbacks(callbacks, nullptr);
+
+	uint64_t ts = 1e9;
+	role.periodic(ts);
+	uint64_t seq = 0;
+	// Too few heartbeats to trust the detector.
+	role.handle_leader_active(ts, LeaderActiveMessage(1, ++seq, 0));
+	REQUIRE( role.next_deadline() == ts + DEFAULT_FOLLOWER_TIMEOUT_NS + 1 );
+
+	// Steady heartbeats cut the timeout down to the leadership loss window.
+	for (int i = 0; i < 20; i++) {
+		ts += DEFAULT_HEARTBEAT_INTERVAL_NS;
+		role.handle_leader_active(ts, LeaderActiveMessage(1, ++seq, 0));
+	}
+	REQUIRE( role.next_deadline() == ts + DEFAULT_LEADERSHIP_LOSS_NS + 1 );
+	role.periodic(role.next_deadline() - 1);
+	REQUIRE( role.state() == Follower );
+	role.periodic(role.next_deadline());
+	REQUIRE( role.state() == PotentialLeader );
+
+	// Disabling the detector restores the fixed timeout.
+	Role fixed(reg, 2, 3);
+	fixed.set_callbacks(callbacks, nullptr);
+	Timing timing;
+	timing.m_phi_threshold = 0;
+	REQUIRE( fixed.set_timing(timing) == 0 );
+	ts = 1e9;
+	fixed.periodic(ts);
+	for (int i = 0; i < 20; i++) {
+		ts += DEFAULT_HEARTBEAT_INTERVAL_NS;
+		fixed.handle_leader_active(ts, LeaderActiveMessage(1, ++seq, 0));
+	}
+	REQUIRE( fixed.next_deadline() == ts + DEFAULT_FOLLOWER_TIMEOUT_NS + 1 );
+}
+
+TEST_CASE( "Leader counts acks from up to MAX_CLUSTER_SIZE nodes", "[role]" ) {
+	TestRegistry reg;
+	std::vector<LeaderActiveMessage> broadcasted;
+	reg.m_broadcast = std::function<void(const Message*)>([&](const Message* msg) {
+		broadcasted.push_back(*static_cast<const LeaderActiveMessage*>(msg));
+	});
+
+	Role role(reg, 1, MAX_CLUSTER_SIZE);
+	uint64_t ts = 1e9;
+	role.periodic(ts);
+	ts += 2e9;
+	role.periodic(ts);
+	role.periodic(ts);
+	REQUIRE( role.state() == PotentialLeader );
+	for (uint64_t id = 2; id <= MAX_CLUSTER_SIZE; id++) {
+		REQUIRE( role.add_peer(id*7) == 0 );
+		role.handle_leader_active_ack(ts, LeaderActiveAck(id*7, role.seq(), 0));
+	}
+	ts += 400e6;
+	role.periodic(ts);
+	REQUIRE( role.state() == Leader );
+
+	std::vector<int> results;
+	role.send_append(ts, "a", [&](int status, void*) {
+		results.push_back(status);
+	}, nullptr);
+	auto seq = broadcasted.back().seq;
+	// With the leader, one short of a majority. Repeated acks count once.
+	role.client_confirm_append(ts, 1);
+	for (uint64_t id = 2; id <= MAX_CLUSTER_SIZE/2; id++) {
+		role.handle_leader_active_ack(ts, LeaderActiveAck(id*7, seq, 1));
+		role.handle_leader_active_ack(ts, LeaderActiveAck(id*7, seq, 1));
+	}
+	REQUIRE( results.empty() );
+	// Every slot is taken by a connected node, so another ID gets
+	// none, and its acks are ignored.
+	REQUIRE( role.add_peer(1000) < 0 );
+	role.handle_leader_active_ack(ts, LeaderActiveAck(1000, seq, 1));
+	REQUIRE( results.empty() );
+	role.handle_leader_active_ack(ts, LeaderActiveAck((MAX_CLUSTER_SIZE/2+1)*7, seq, 1));
+	REQUIRE( results == std::vector<int>({0}) );
+
+	std::vector<ab_peer_stats_t> peers;
+	role.follower_progress(ts, peers);
+	REQUIRE( peers.size() == MAX_CLUSTER_SIZE/2 );
+}
+
+TEST_CASE( "Leader reuses the slots of departed nodes", "[role]" ) {
+	TestRegistry reg;
+	Role role(reg, 1, 3);
+	uint64_t ts = 1e9;
+	elect_leader(role, ts);
+
+	// Node 3 keeps coming back with a new ID, far more often than
+	// there are slots.
+	std::vector<int> results;
+	auto cb = [&](int status, void*) {
+		results.push_back(status);
+	};
+	uint64_t round = 0;
+	for (uint64_t id = 100; id < 100 + 4*MAX_CLUSTER_SIZE; id++) {
+		REQUIRE( role.add_peer(id) == 0 );
+		role.send_append(ts, "a", cb, nullptr);
+		round++;
+		role.client_confirm_append(ts, round);
+		role.handle_leader_active_ack(ts, LeaderActiveAck(id, role.seq(), round));
+		REQUIRE( role.round() == round );
+		role.remove_peer(id);
+	}
+	REQUIRE( results == std::vector<int>(round, 0) );
+
+	// A reused slot doesn't carry the old node's ack over.
+	REQUIRE( role.add_peer(5000) == 0 );
+	role.send_append(ts, "b", cb, nullptr);
+	role.handle_leader_active_ack(ts, LeaderActiveAck(5000, role.seq(), round+1));
+	REQUIRE( role.round() == round );
+	role.remove_peer(5000);
+	REQUIRE( role.add_peer(6000) == 0 );
+	role.client_confirm_append(ts, round+1);
+	role.periodic(ts);
+	REQUIRE( role.round() == round );
+	role.handle_leader_active_ack(ts, LeaderActiveAck(6000, role.seq(), round+1));
+	REQUIRE( role.round() == round+1 );
+
+	// A node that comes back with its ID keeps its slot.
+	role.remove_peer(2);
+	REQUIRE( role.add_peer(2) == 0 );
+	role.send_append(ts, "c", cb, nullptr);
+	role.client_confirm_append(ts, round+2);
+	role.handle_leader_active_ack(ts, LeaderActiveAck(2, role.seq(), round+2));
+	REQUIRE( role.round() == round+2 );
+}
@@ -0,0 +1,140 @@
+#include <catch.hpp>
+
+#include <random>
+#include <memory>
+#include <vector>
+
+#include "node/timer_wheel.hpp"
+
+TEST_CASE( "TimerWheel fires timers at their deadlines", "[timer_wheel]" ) {
+	TimerWheel wheel(1000);
+	REQUIRE( wheel.next_deadline() == UINT64_MAX );
+
+	std::vector<uint64_t> fired;
+	WheelTimer a([&]() { fired.push_back(wheel.now()); });
+	WheelTimer b([&]() { fired.push_back(wheel.now()); });
+	WheelTimer c([&]() { fired.push_back(wheel.now()); });
+	wheel.schedule(&a, 1010);
+	wheel.schedule(&b, 1000 + 5000);
+	wheel.schedule(&c, 1000 + 3600*1000);
+	REQUIRE( wheel.next_deadline() <= 1010 );
+
+	wheel.advance(1009);
+	REQUIRE( fired.empty() );
+	wheel.advance(1010);
+	REQUIRE( fired == std::vector<uint64_t>{1010} );
+	REQUIRE( !a.scheduled() );
+
+	// Jumping far ahead fires everything in between, in order.
+	wheel.advance(1000 + 7200*1000);
+	REQUIRE( fired == (std::vector<uint64_t>{1010, 6000, 1000 + 3600*1000}) );
+	REQUIRE( wheel.next_deadline() == UINT64_MAX );
+	REQUIRE( wheel.now() == 1000 + 7200*1000 );
+}
+
+TEST_CASE( "TimerWheel cancels and reschedules", "[timer_wheel]" ) {
+	TimerWheel wheel;
+	int fired = 0;
+	WheelTimer a([&]() { fired++; });
+	WheelTimer b([&]() { fired++; });
+
+	wheel.schedule(&a, 100);
+	wheel.schedule(&b, 100);
+	wheel.cancel(&a);
+	REQUIRE( !a.scheduled() );
+	wheel.advance(100);
+	REQUIRE( fired == 1 );
+
+	// Past deadlines fire on the next tick.
+	wheel.schedule(&a, 50);
+	REQUIRE( a.deadline() == 101 );
+	wheel.schedule(&a, 5000);
+	wheel.advance(4999);
+	REQUIRE( fired == 1 );
+	wheel.advance(5000);
+	REQUIRE( fired == 2 );
+}
+
+TEST_CASE( "TimerWheel callbacks can reschedule timers", "[timer_wheel]" ) {
+	TimerWheel wheel;
+	std::vector<uint64_t> fired;
+	WheelTimer periodic;
+	WheelTimer other([&]() { fired.push_back(0); });
+	periodic.set_callback([&]() {
+		fired.push_back(wheel.now());
+		wheel.cancel(&other);
+		wheel.schedule(&periodic, wheel.now() + 50);
+	});
+	wheel.schedule(&periodic, 50);
+	wheel.schedule(&other, 100);
+	wheel.advance(200);
+	REQUIRE( fired == (std::vector<uint64_t>{50, 100, 150, 200}) );
+	REQUIRE( periodic.deadline() == 250 );
+}
+
+TEST_CASE( "TimerWheel fires random deadlines on time", "[timer_wheel]" ) {
+	std::mt19937_64 rng(1);
+	TimerWheel wheel(rng() % 1000000);
+	const int N = 2000;
+	std::vector<std::unique_ptr<WheelTimer>> timers;
+	std::vector<uint64_t> fired_at(N, 0);
+	for (int i = 0; i < N; i++) {
+		timers.push_back(std::make_unique<WheelTimer>([&, i]() {
+			fired_at[i] = wheel.now();
+		}));
+		// Spread deadlines over every level.
+		uint64_t delay = rng() % ((uint64_t)1 << (rng() % 34));
+		wheel.schedule(timers[i].get(), wheel.now() + delay);
+	}
+
+	uint64_t now = wheel.now();
+	bool missed = false;
+	while (wheel.next_deadline() != UINT64_MAX) {
+		REQUIRE( wheel.next_deadline() > now );
+		// Advance by uneven steps, sometimes past several deadlines.
+		now = wheel.next_deadline() + rng() % 1000;
+		wheel.advance(now);
+		for (int i = 0; i < N; i++) {
+			if (timers[i]->scheduled() && timers[i]->deadline() <= now) {
+				missed = true;
+			}
+		}
+	}
+	REQUIRE( !missed );
+	for (int i = 0; i < N; i++) {
+		uint64_t deadline = timers[i]->deadline();
+		// Each timer fires at its deadline, or at the first tick if its deadline
+		// was already due.
+		REQUIRE( fired_at[i] == deadline );
+	}
+}
+
+TEST_CASE( "TimerWheel holds deadlines past the top level span", "[timer_wheel]" ) {
+	const uint64_t span = TimerWheel::MAX_DELAY + 1;
+	std::vector<uint64_t> fired;
+
+	// Clamped delays end in the next span.
+	TimerWheel wheel(1000);
+	WheelTimer far([&]() { fired.push_back(wheel.now()); });
+	wheel.schedule(&far, UINT64_MAX);
+	REQUIRE( far.deadline() == 1000 + TimerWheel::MAX_DELAY );
+	REQUIRE( wheel.next_deadline() == span );
+	wheel.advance(span + 998);
+	REQUIRE( fired.empty() );
+	wheel.advance(span + 999);
+	REQUIRE( fired == std::vector<uint64_t>{span + 999} );
+
+	// A short delay that crosses into the next span.
+	fired.clear();
+	TimerWheel edge(span - 10);
+	WheelTimer a([&]() { fired.push_back(edge.now()); });
+	WheelTimer b([&]() { fired.push_back(edge.now()); });
+	edge.schedule(&a, span + 100);
+	edge.schedule(&b, span + 200);
+	edge.cancel(&b);
+	edge.advance(span + 99);
+	REQUIRE( fired.empty() );
+	edge.advance(span + 1000);
+	REQUIRE( fired == std::vector<uint64_t>{span + 100} );
+	REQUIRE( edge.next_deadline() == UINT64_MAX );
+}
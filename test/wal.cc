@@ -0,0 +1,252 @@
+#include <catch.hpp>
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "log/wal.hpp"
+
+// TempDir is a scratch directory removed with its files.
+struct TempDir
+{
+	TempDir()
+	{
+		char tmpl[] = "/tmp/abwal.XXXXXX";
+		path = mkdtemp(tmpl);
+	}
+
+	~TempDir()
+	{
+		for (auto& name : files()) {
+			unlink((path + "/" + name).c_str());
+		}
+		rmdir(path.c_str());
+	}
+
+	std::vector<std::string>
+	files() const
+	{
+		std::vector<std::string> names;
+		DIR* d = opendir(path.c_str());
+		while (auto entry = readdir(d)) {
+			if (entry->d_name[0] != '.') {
+				names.push_back(entry->d_name);
+			}
+		}
+		closedir(d);
+		return names;
+	}
+
+	std::string path;
+}; // TempDir
+
+// Entry is a replayed entry.
+typedef std::pair<uint64_t, std::string> Entry;
+
+static std::vector<Entry>
+replay(Wal& wal)
+{
+	std::vector<Entry> entries;
+	wal.replay([&](uint64_t round, const char* data, size_t len) {
+		entries.push_back({round, std::string(data, len)});
+	});
+	return entries;
+}
+
+TEST_CASE( "Wal syncs appended entries and replays them", "[wal]" ) {
+	TempDir dir;
+	{
+		Wal wal;
+		REQUIRE( wal.open(dir.path, 4096) == 0 );
+		REQUIRE( wal.last_round() == 0 );
+		REQUIRE( !wal.pending() );
+		REQUIRE( replay(wal).empty() );
+
+		// Appends hand out the copy in the mapping.
+		uint64_t record = 0;
+		std::string one = "one";
+		auto data = wal.append(1, one.data(), one.size(), record);
+		REQUIRE( record == 1 );
+		REQUIRE( data != nullptr );
+		REQUIRE( data != one.data() );
+		REQUIRE( memcmp(data, "one", 3) == 0 );
+		REQUIRE( wal.append(2, "", 0, record) != nullptr );
+		REQUIRE( wal.pending() );
+
+		// Only synced entries are replayed.
+		REQUIRE( replay(wal).empty() );
+		uint64_t synced = 0;
+		REQUIRE( wal.sync(synced) == 0 );
+		REQUIRE( record == 2 );
+		REQUIRE( synced == 2 );
+		REQUIRE( !wal.pending() );
+		REQUIRE( wal.last_round() == 2 );
+		REQUIRE( replay(wal) == (std::vector<Entry>{{1, "one"}, {2, ""}}) );
+	}
+
+	Wal wal;
+	REQUIRE( wal.open(dir.path, 4096) == 0 );
+	REQUIRE( wal.last_round() == 2 );
+	REQUIRE( wal.segment() == 1 );
+
+	// Appends continue where the log ended.
+	uint64_t synced = 0;
+	uint64_t record = 0;
+	REQUIRE( wal.append(3, "three", 5, record) != nullptr );
+	REQUIRE( record == 1 );
+	REQUIRE( wal.sync(synced) == 0 );
+	Wal reopened;
+	REQUIRE( reopened.open(dir.path, 4096) == 0 );
+	REQUIRE( reopened.last_round() == 3 );
+	REQUIRE( replay(reopened) == (std::vector<Entry>{{1, "one"}, {2, ""}, {3, "three"}}) );
+}
+
+TEST_CASE( "Wal rolls over to preallocated segments", "[wal]" ) {
+	TempDir dir;
+	const uint64_t segment_size = 4096;
+	std::string entry(1000, 'x');
+	std::string big(3*segment_size, 'y');
+	{
+		Wal wal;
+		REQUIRE( wal.open(dir.path, segment_size) == 0 );
+		// The first segment is ready before the first append.
+		REQUIRE( dir.files().size() == 1 );
+
+		uint64_t synced = 0;
+		uint64_t record = 0;
+		// Four records fit in a segment.
+		const char* held = nullptr;
+		for (uint64_t round = 1; round <= 10; round++) {
+			held = wal.append(round, entry.data(), entry.size(), record);
+			REQUIRE( held != nullptr );
+		}
+		// Appends don't create segments. The records past the first
+		// one wait in memory for sync.
+		REQUIRE( dir.files().size() == 1 );
+		REQUIRE( wal.sync(synced) == 0 );
+		REQUIRE( std::string(held, entry.size()) == entry );
+		REQUIRE( synced == 10 );
+		REQUIRE( wal.segment() == 3 );
+
+		// A record bigger than a segment gets its own.
+		REQUIRE( wal.append(11, big.data(), big.size(), record) != nullptr );
+		REQUIRE( wal.append(12, entry.data(), entry.size(), record) != nullptr );
+		REQUIRE( wal.sync(synced) == 0 );
+		REQUIRE( wal.segment() == 5 );
+		REQUIRE( replay(wal).size() == 12 );
+	}
+	// Five segments and the spare.
+	REQUIRE( dir.files().size() == 6 );
+	int fd = open((dir.path + "/" + Wal::segment_name(1)).c_str(), O_RDONLY);
+	REQUIRE( lseek(fd, 0, SEEK_END) == segment_size );
+	close(fd);
+
+	Wal wal;
+	REQUIRE( wal.open(dir.path, segment_size) == 0 );
+	REQUIRE( wal.last_round() == 12 );
+	REQUIRE( wal.segment() == 5 );
+	auto entries = replay(wal);
+	REQUIRE( entries.size() == 12 );
+	REQUIRE( entries[10] == Entry(11, big) );
+	REQUIRE( entries[11] == Entry(12, entry) );
+}
+
+TEST_CASE( "Wal ends the log at a torn record", "[wal]" ) {
+	TempDir dir;
+	std::string entry(100, 'x');
+	{
+		Wal wal;
+		REQUIRE( wal.open(dir.path, 4096) == 0 );
+		uint64_t synced = 0;
+		uint64_t record = 0;
+		for (uint64_t round = 1; round <= 3; round++) {
+			REQUIRE( wal.append(round, entry.data(), entry.size(), record) != nullptr );
+		}
+		REQUIRE( wal.sync(synced) == 0 );
+	}
+
+	// Corrupt the last byte of round 3.
+	auto path = dir.path + "/" + Wal::segment_name(1);
+	int fd = open(path.c_str(), O_RDWR);
+	off_t last = Wal::SEGMENT_HEADER_SIZE + 3*(Wal::RECORD_HEADER_SIZE + entry.size()) - 1;
+	REQUIRE( pwrite(fd, "y", 1, last) == 1 );
+	close(fd);
+
+	{
+		Wal wal;
+		REQUIRE( wal.open(dir.path, 4096) == 0 );
+		REQUIRE( wal.last_round() == 2 );
+
+		// The torn record is overwritten.
+		uint64_t synced = 0;
+		uint64_t record = 0;
+		REQUIRE( wal.append(3, "retry", 5, record) != nullptr );
+		REQUIRE( wal.append(4, "next", 4, record) != nullptr );
+		REQUIRE( wal.sync(synced) == 0 );
+	}
+
+	Wal wal;
+	REQUIRE( wal.open(dir.path, 4096) == 0 );
+	REQUIRE( wal.last_round() == 4 );
+	auto entries = replay(wal);
+	REQUIRE( entries.size() == 4 );
+	REQUIRE( entries[2] == Entry(3, "retry") );
+}
+
+TEST_CASE( "Wal removes truncated segments", "[wal]" ) {
+	TempDir dir;
+	const uint64_t segment_size = 4096;
+	std::string entry(1000, 'x');
+	{
+		Wal wal;
+		REQUIRE( wal.open(dir.path, segment_size) == 0 );
+		uint64_t synced = 0;
+		uint64_t record = 0;
+		// Rounds 1-4, 5-8 and 9-10 in three segments.
+		for (uint64_t round = 1; round <= 10; round++) {
+			REQUIRE( wal.append(round, entry.data(), entry.size(), record) != nullptr );
+		}
+		REQUIRE( wal.sync(synced) == 0 );
+		REQUIRE( dir.files().size() == 4 );
+
+		// Segments go at the next sync, once all of their rounds are
+		// truncated.
+		wal.truncate(4);
+		REQUIRE( dir.files().size() == 4 );
+		REQUIRE( wal.sync(synced) == 0 );
+		REQUIRE( dir.files().size() == 3 );
+		REQUIRE( replay(wal).front().first == 5 );
+
+		wal.truncate(7);
+		REQUIRE( wal.sync(synced) == 0 );
+		REQUIRE( dir.files().size() == 3 );
+
+		// The segment being written stays.
+		wal.truncate(100);
+		wal.truncate(1);
+		REQUIRE( wal.sync(synced) == 0 );
+		REQUIRE( dir.files().size() == 2 );
+		REQUIRE( replay(wal) == (std::vector<Entry>{{9, entry}, {10, entry}}) );
+	}
+
+	// Only the rest is mapped again.
+	Wal wal;
+	REQUIRE( wal.open(dir.path, segment_size) == 0 );
+	REQUIRE( wal.last_round() == 10 );
+	REQUIRE( wal.segment() == 3 );
+	REQUIRE( replay(wal).size() == 2 );
+}
+
+TEST_CASE( "Wal rejects appends before open", "[wal]" ) {
+	Wal wal;
+	uint64_t synced = 0;
+	uint64_t record = 0;
+	REQUIRE( wal.append(1, "x", 1, record) == nullptr );
+	REQUIRE( wal.sync(synced) < 0 );
+	REQUIRE( wal.open("", 4096) < 0 );
+}